@@ -46,6 +46,7 @@ def get_battery_data(
     - **battery_id**: Identifier of the battery
     - **voltage**: Battery voltage in millivolts (mV)
     - **device_timestamp**: Timestamp of the measurement on the device (Unix timestamp)
+    - **device_timestamp_ms**: Same timestamp in milliseconds, null for older records
 
     ## Authentication
     Requires API key in the X-API-Key header
@@ -48,6 +48,7 @@ def get_gyro_data(
     - **gyro_y**: Y-axis rotation
     - **gyro_z**: Z-axis rotation
     - **device_timestamp**: Timestamp of the measurement on the device (Unix timestamp)
+    - **device_timestamp_ms**: Same timestamp in milliseconds, null for older records
 
     ## Authentication
     Requires API key in the X-API-Key header
@@ -43,6 +43,7 @@ def get_temperature_data(
     - **id**: Unique record identifier
     - **temperature**: Temperature in degrees Celsius
     - **device_timestamp**: Timestamp of the measurement on the device (Unix timestamp)
+    - **device_timestamp_ms**: Same timestamp in milliseconds, null for older records
 
     ## Authentication
     Requires API key in the X-API-Key header
@@ -0,0 +1,79 @@
+from pydantic import ValidationError
+from psycopg2 import sql
+from core.models import AlarmData
+from core.database import get_connection
+from bridge import codec
+
+
+def process_message(payload: str):
+    """Process and store an alarm event from string format"""
+    try:
+        # Parse payload: "Type/State/Channel/Value/Timestamp"
+        parts = payload.strip().split("/")
+        if len(parts) != 5:
+            print(f"Invalid alarm format: {payload}")
+            return
+
+        try:
+            # Zero until the hub has synchronized its clock, the arrival
+            # time in the timestamp column is all there is then
+            device_timestamp_ms = codec.to_milliseconds(int(parts[4])) or None
+
+            # Create AlarmData model
+            alarm_data = AlarmData(
+                alarm_type=parts[0],
+                state=parts[1],
+                channel=int(parts[2]),
+                value=int(parts[3]),
+                device_timestamp=(
+                    device_timestamp_ms // 1000 if device_timestamp_ms else None
+                ),
+                device_timestamp_ms=device_timestamp_ms,
+            )
+
+            print(f"ALARM {alarm_data.alarm_type} {alarm_data.state} "
+                  f"on channel {alarm_data.channel}: {alarm_data.value}")
+
+            # Store in database
+            store_alarm_data(alarm_data)
+
+        except (ValueError, IndexError) as e:
+            print(f"Error parsing alarm: {str(e)}")
+
+    except ValidationError as e:
+        print(f"Validation error in alarm message: {str(e)}")
+    except Exception as e:
+        print(f"Error processing alarm message: {str(e)}")
+
+
+def store_alarm_data(data: AlarmData):
+    """Store validated alarm event in database"""
+    try:
+        conn = get_connection()
+        cursor = conn.cursor()
+
+        insert_query = sql.SQL(
+            """
+            INSERT INTO {} (alarm_type, state, channel, value,
+                            device_timestamp, device_timestamp_ms)
+            VALUES (%s, %s, %s, %s, %s, %s)
+        """
+        ).format(sql.Identifier("elfryd_alarm"))
+
+        cursor.execute(
+            insert_query,
+            (
+                data.alarm_type,
+                data.state,
+                data.channel,
+                data.value,
+                data.device_timestamp,
+                data.device_timestamp_ms,
+            ),
+        )
+        conn.commit()
+        cursor.close()
+        conn.close()
+
+    except Exception as e:
+        print(f"Error storing alarm: {str(e)}")
@@ -2,6 +2,7 @@ from pydantic import ValidationError
 from psycopg2 import sql
 from core.models import BatteryData
 from core.database import get_connection
+from bridge import codec
 
 
 def process_message(payload: str):
@@ -14,11 +15,15 @@ def process_message(payload: str):
             return
 
         try:
+            # Hubs send milliseconds, older firmware seconds
+            device_timestamp_ms = codec.to_milliseconds(int(parts[2]))
+
             # Create BatteryData model
             battery_data = BatteryData(
                 battery_id=int(parts[0]),
                 voltage=int(parts[1]),
-                device_timestamp=int(parts[2]),
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
             )
 
             # Store in database
@@ -33,6 +38,25 @@ def process_message(payload: str):
         print(f"Error processing battery message: {str(e)}")
 
 
+def process_binary(payload: bytes):
+    """Process and store battery data from binary format"""
+    try:
+        # Record values: ID nibble (ID - 1), int16 voltage
+        for device_timestamp_ms, reader in codec.decode_records(payload):
+            battery_data = BatteryData(
+                battery_id=(reader.read_uint8() & 0x0F) + 1,
+                voltage=reader.read_int16(),
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
+            )
+            store_battery_data(battery_data)
+
+    except ValidationError as e:
+        print(f"Validation error in binary battery message: {str(e)}")
+    except Exception as e:
+        print(f"Error processing binary battery message: {str(e)}")
+
+
 def store_battery_data(data: BatteryData):
     """Store validated battery data in database"""
     try:
@@ -41,13 +65,19 @@ def store_battery_data(data: BatteryData):
 
         insert_query = sql.SQL(
             """
-            INSERT INTO {} (battery_id, voltage, device_timestamp)
-            VALUES (%s, %s, %s)
+            INSERT INTO {} (battery_id, voltage, device_timestamp, device_timestamp_ms)
+            VALUES (%s, %s, %s, %s)
         """
         ).format(sql.Identifier(f"elfryd_battery"))
 
         cursor.execute(
-            insert_query, (data.battery_id, data.voltage, data.device_timestamp)
+            insert_query,
+            (
+                data.battery_id,
+                data.voltage,
+                data.device_timestamp,
+                data.device_timestamp_ms,
+            ),
         )
         conn.commit()
         cursor.close()
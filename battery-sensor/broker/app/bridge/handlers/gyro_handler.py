@@ -2,6 +2,7 @@ from pydantic import ValidationError
 from psycopg2 import sql
 from core.models import GyroData
 from core.database import get_connection
+from bridge import codec
 
 
 def process_message(payload: str):
@@ -26,6 +27,9 @@ def process_message(payload: str):
                 print(f"Invalid gyroscope data format: {parts[1]}")
                 return
 
+            # Hubs send milliseconds, older firmware seconds
+            device_timestamp_ms = codec.to_milliseconds(int(parts[2]))
+
             # Create GyroData model
             gyro_data = GyroData(
                 accel_x=int(accel_parts[0]),
@@ -34,7 +38,8 @@ def process_message(payload: str):
                 gyro_x=int(gyro_parts[0]),
                 gyro_y=int(gyro_parts[1]),
                 gyro_z=int(gyro_parts[2]),
-                device_timestamp=int(parts[2]),
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
             )
 
             # Store in database
@@ -49,6 +54,29 @@ def process_message(payload: str):
         print(f"Error processing gyro message: {str(e)}")
 
 
+def process_binary(payload: bytes):
+    """Process and store gyro data from binary format"""
+    try:
+        # Record values: accel x/y/z then gyro x/y/z, each a signed 24-bit value
+        for device_timestamp_ms, reader in codec.decode_records(payload):
+            gyro_data = GyroData(
+                accel_x=reader.read_int24(),
+                accel_y=reader.read_int24(),
+                accel_z=reader.read_int24(),
+                gyro_x=reader.read_int24(),
+                gyro_y=reader.read_int24(),
+                gyro_z=reader.read_int24(),
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
+            )
+            store_gyro_data(gyro_data)
+
+    except ValidationError as e:
+        print(f"Validation error in binary gyro message: {str(e)}")
+    except Exception as e:
+        print(f"Error processing binary gyro message: {str(e)}")
+
+
 def store_gyro_data(data: GyroData):
     """Store validated gyro data in database"""
     try:
@@ -57,8 +85,8 @@ def store_gyro_data(data: GyroData):
 
         insert_query = sql.SQL(
             """
-            INSERT INTO {} (accel_x, accel_y, accel_z, gyro_x, gyro_y, gyro_z, device_timestamp)
-            VALUES (%s, %s, %s, %s, %s, %s, %s)
+            INSERT INTO {} (accel_x, accel_y, accel_z, gyro_x, gyro_y, gyro_z, device_timestamp, device_timestamp_ms)
+            VALUES (%s, %s, %s, %s, %s, %s, %s, %s)
         """
         ).format(sql.Identifier(f"elfryd_gyro"))
 
@@ -72,6 +100,7 @@ def store_gyro_data(data: GyroData):
                 data.gyro_y,
                 data.gyro_z,
                 data.device_timestamp,
+                data.device_timestamp_ms,
             ),
         )
         conn.commit()
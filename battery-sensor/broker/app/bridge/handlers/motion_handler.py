@@ -0,0 +1,121 @@
+from pydantic import ValidationError
+from psycopg2 import sql
+from core.models import MotionData
+from core.database import get_connection
+from bridge import codec
+
+# Axes of the per-axis features: accelerometer x/y/z then gyroscope x/y/z
+AXES = 6
+
+
+def parse_axes(field: str) -> list[int]:
+    """Parse a comma separated list with one value per axis"""
+    values = [int(value) for value in field.split(",")]
+    if len(values) != AXES:
+        raise ValueError(f"Expected {AXES} axis values, got {len(values)}")
+    return values
+
+
+def process_message(payload: str):
+    """Process and store motion features from string format"""
+    try:
+        # Parse payload: "Roll/Pitch/Rms,.../Peak,.../Frequency,.../Timestamp/Duration"
+        parts = payload.strip().split("/")
+        if len(parts) != 7:
+            print(f"Invalid motion data format: {payload}")
+            return
+
+        try:
+            # Start of the window, hubs send milliseconds
+            device_timestamp_ms = codec.to_milliseconds(int(parts[5]))
+
+            # Create MotionData model
+            motion_data = MotionData(
+                roll=int(parts[0]),
+                pitch=int(parts[1]),
+                rms=parse_axes(parts[2]),
+                peak=parse_axes(parts[3]),
+                frequency_mhz=parse_axes(parts[4]),
+                window_ms=int(parts[6]),
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
+            )
+
+            # Store in database
+            store_motion_data(motion_data)
+
+        except (ValueError, IndexError) as e:
+            print(f"Error parsing motion data: {str(e)}")
+
+    except ValidationError as e:
+        print(f"Validation error in motion message: {str(e)}")
+    except Exception as e:
+        print(f"Error processing motion message: {str(e)}")
+
+
+def process_binary(payload: bytes):
+    """Process and store motion features from binary format"""
+    try:
+        # Record values: zigzag roll and pitch, varint window length, then
+        # varint RMS, peak and frequency per axis
+        for device_timestamp_ms, reader in codec.decode_records(payload):
+            roll = reader.read_zigzag()
+            pitch = reader.read_zigzag()
+            window_ms = reader.read_varint()
+            rms, peak, frequency = [], [], []
+            for _ in range(AXES):
+                rms.append(reader.read_varint())
+                peak.append(reader.read_varint())
+                frequency.append(reader.read_varint())
+
+            motion_data = MotionData(
+                roll=roll,
+                pitch=pitch,
+                rms=rms,
+                peak=peak,
+                frequency_mhz=frequency,
+                window_ms=window_ms,
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
+            )
+            store_motion_data(motion_data)
+
+    except ValidationError as e:
+        print(f"Validation error in binary motion message: {str(e)}")
+    except Exception as e:
+        print(f"Error processing binary motion message: {str(e)}")
+
+
+def store_motion_data(data: MotionData):
+    """Store validated motion features in database"""
+    try:
+        conn = get_connection()
+        cursor = conn.cursor()
+
+        insert_query = sql.SQL(
+            """
+            INSERT INTO {} (roll, pitch, rms, peak, frequency_mhz, window_ms,
+                            device_timestamp, device_timestamp_ms)
+            VALUES (%s, %s, %s, %s, %s, %s, %s, %s)
+        """
+        ).format(sql.Identifier("elfryd_motion"))
+
+        cursor.execute(
+            insert_query,
+            (
+                data.roll,
+                data.pitch,
+                data.rms,
+                data.peak,
+                data.frequency_mhz,
+                data.window_ms,
+                data.device_timestamp,
+                data.device_timestamp_ms,
+            ),
+        )
+        conn.commit()
+        cursor.close()
+        conn.close()
+
+    except Exception as e:
+        print(f"Error storing motion data: {str(e)}")
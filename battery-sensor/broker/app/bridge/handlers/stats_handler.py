@@ -0,0 +1,116 @@
+from pydantic import ValidationError
+from psycopg2 import sql
+from core.models import StatsData
+from core.database import get_connection
+from bridge import codec
+
+# Sensor types by the index the hub sends in binary records
+SENSOR_NAMES = ["battery", "temp", "gyro"]
+
+
+def process_message(payload: str):
+    """Process and store a windowed aggregate from string format"""
+    try:
+        # Parse payload: "Sensor/Channel/Count/Min/Max/Mean/Last/Timestamp/Duration"
+        parts = payload.strip().split("/")
+        if len(parts) != 9:
+            print(f"Invalid aggregate data format: {payload}")
+            return
+
+        try:
+            # Window start, hubs send milliseconds
+            device_timestamp_ms = codec.to_milliseconds(int(parts[7]))
+
+            # Create StatsData model
+            stats_data = StatsData(
+                sensor=parts[0],
+                channel=int(parts[1]),
+                sample_count=int(parts[2]),
+                min_value=int(parts[3]),
+                max_value=int(parts[4]),
+                mean_value=int(parts[5]),
+                last_value=int(parts[6]),
+                window_ms=int(parts[8]),
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
+            )
+
+            # Store in database
+            store_stats_data(stats_data)
+
+        except (ValueError, IndexError) as e:
+            print(f"Error parsing aggregate data: {str(e)}")
+
+    except ValidationError as e:
+        print(f"Validation error in aggregate message: {str(e)}")
+    except Exception as e:
+        print(f"Error processing aggregate message: {str(e)}")
+
+
+def process_binary(payload: bytes):
+    """Process and store windowed aggregates from binary format"""
+    try:
+        # Record values: sensor (top two bits) and channel byte, varint count
+        # and window length, zigzag min, max, mean and last
+        for device_timestamp_ms, reader in codec.decode_records(payload):
+            channel = reader.read_uint8()
+            sensor = channel >> 6
+            if sensor >= len(SENSOR_NAMES):
+                raise ValueError(f"Unknown sensor type {sensor} in aggregate record")
+
+            stats_data = StatsData(
+                sensor=SENSOR_NAMES[sensor],
+                channel=channel & 0x3F,
+                sample_count=reader.read_varint(),
+                window_ms=reader.read_varint(),
+                min_value=reader.read_zigzag(),
+                max_value=reader.read_zigzag(),
+                mean_value=reader.read_zigzag(),
+                last_value=reader.read_zigzag(),
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
+            )
+            store_stats_data(stats_data)
+
+    except ValidationError as e:
+        print(f"Validation error in binary aggregate message: {str(e)}")
+    except Exception as e:
+        print(f"Error processing binary aggregate message: {str(e)}")
+
+
+def store_stats_data(data: StatsData):
+    """Store validated aggregate data in database"""
+    try:
+        conn = get_connection()
+        cursor = conn.cursor()
+
+        insert_query = sql.SQL(
+            """
+            INSERT INTO {} (sensor, channel, sample_count, min_value, max_value,
+                            mean_value, last_value, window_ms,
+                            device_timestamp, device_timestamp_ms)
+            VALUES (%s, %s, %s, %s, %s, %s, %s, %s, %s, %s)
+        """
+        ).format(sql.Identifier("elfryd_stats"))
+
+        cursor.execute(
+            insert_query,
+            (
+                data.sensor,
+                data.channel,
+                data.sample_count,
+                data.min_value,
+                data.max_value,
+                data.mean_value,
+                data.last_value,
+                data.window_ms,
+                data.device_timestamp,
+                data.device_timestamp_ms,
+            ),
+        )
+        conn.commit()
+        cursor.close()
+        conn.close()
+
+    except Exception as e:
+        print(f"Error storing aggregate data: {str(e)}")
@@ -2,6 +2,7 @@ from pydantic import ValidationError
 from psycopg2 import sql
 from core.models import TemperatureData
 from core.database import get_connection
+from bridge import codec
 
 
 def process_message(payload: str):
@@ -14,9 +15,14 @@ def process_message(payload: str):
             return
 
         try:
+            # Hubs send milliseconds, older firmware seconds
+            device_timestamp_ms = codec.to_milliseconds(int(parts[1]))
+
             # Create TemperatureData model
             temp_data = TemperatureData(
-                temperature=int(parts[0]), device_timestamp=int(parts[1])
+                temperature=int(parts[0]),
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
             )
 
             # Store in database
@@ -31,6 +37,24 @@ def process_message(payload: str):
         print(f"Error processing temperature message: {str(e)}")
 
 
+def process_binary(payload: bytes):
+    """Process and store temperature data from binary format"""
+    try:
+        # Record values: int16 temperature
+        for device_timestamp_ms, reader in codec.decode_records(payload):
+            temp_data = TemperatureData(
+                temperature=reader.read_int16(),
+                device_timestamp=device_timestamp_ms // 1000,
+                device_timestamp_ms=device_timestamp_ms,
+            )
+            store_temperature_data(temp_data)
+
+    except ValidationError as e:
+        print(f"Validation error in binary temperature message: {str(e)}")
+    except Exception as e:
+        print(f"Error processing binary temperature message: {str(e)}")
+
+
 def store_temperature_data(data: TemperatureData):
     """Store validated temperature data in database"""
     try:
@@ -39,12 +63,15 @@ def store_temperature_data(data: TemperatureData):
 
         insert_query = sql.SQL(
             """
-            INSERT INTO {} (temperature, device_timestamp)
-            VALUES (%s, %s)
+            INSERT INTO {} (temperature, device_timestamp, device_timestamp_ms)
+            VALUES (%s, %s, %s)
         """
         ).format(sql.Identifier(f"elfryd_temp"))
 
-        cursor.execute(insert_query, (data.temperature, data.device_timestamp))
+        cursor.execute(
+            insert_query,
+            (data.temperature, data.device_timestamp, data.device_timestamp_ms),
+        )
         conn.commit()
         cursor.close()
         conn.close()
@@ -3,10 +3,14 @@ from psycopg2 import sql
 from core.config import MQTT_CONFIG
 from core.database import get_table_name, get_connection
 from core.mqtt import create_mqtt_client
+from bridge import codec
 from bridge.handlers import (
     battery_handler,
     temperature_handler,
     gyro_handler,
+    stats_handler,
+    motion_handler,
+    alarm_handler,
     config_handler,
     default_handler,
 )
@@ -14,6 +18,15 @@ from bridge.handlers import (
 # Dictionary to track which tables have been created
 created_tables = {}
 
+# Handlers that understand the compact binary sensor format
+binary_handlers = {
+    "elfryd_battery": battery_handler,
+    "elfryd_temp": temperature_handler,
+    "elfryd_gyro": gyro_handler,
+    "elfryd_stats": stats_handler,
+    "elfryd_motion": motion_handler,
+}
+
 
 # Function to create table if it doesn't exist
 def ensure_table_exists(table_name):
@@ -33,6 +46,7 @@ def ensure_table_exists(table_name):
                 battery_id INTEGER NOT NULL,
                 voltage INTEGER NOT NULL,
                 device_timestamp BIGINT NOT NULL,
+                device_timestamp_ms BIGINT,
                 timestamp TIMESTAMPTZ DEFAULT NOW()
             );
             """
@@ -44,6 +58,7 @@ def ensure_table_exists(table_name):
                 id SERIAL PRIMARY KEY,
                 temperature INTEGER NOT NULL,
                 device_timestamp BIGINT NOT NULL,
+                device_timestamp_ms BIGINT,
                 timestamp TIMESTAMPTZ DEFAULT NOW()
             );
             """
@@ -60,6 +75,58 @@ def ensure_table_exists(table_name):
                 gyro_y INTEGER NOT NULL,
                 gyro_z INTEGER NOT NULL,
                 device_timestamp BIGINT NOT NULL,
+                device_timestamp_ms BIGINT,
+                timestamp TIMESTAMPTZ DEFAULT NOW()
+            );
+            """
+            ).format(sql.Identifier(table_name))
+        elif table_name == "elfryd_stats":
+            create_table_query = sql.SQL(
+                """
+            CREATE TABLE IF NOT EXISTS {} (
+                id SERIAL PRIMARY KEY,
+                sensor TEXT NOT NULL,
+                channel INTEGER NOT NULL,
+                sample_count INTEGER NOT NULL,
+                min_value INTEGER NOT NULL,
+                max_value INTEGER NOT NULL,
+                mean_value INTEGER NOT NULL,
+                last_value INTEGER NOT NULL,
+                window_ms INTEGER NOT NULL,
+                device_timestamp BIGINT NOT NULL,
+                device_timestamp_ms BIGINT,
+                timestamp TIMESTAMPTZ DEFAULT NOW()
+            );
+            """
+            ).format(sql.Identifier(table_name))
+        elif table_name == "elfryd_motion":
+            create_table_query = sql.SQL(
+                """
+            CREATE TABLE IF NOT EXISTS {} (
+                id SERIAL PRIMARY KEY,
+                roll INTEGER NOT NULL,
+                pitch INTEGER NOT NULL,
+                rms INTEGER[] NOT NULL,
+                peak INTEGER[] NOT NULL,
+                frequency_mhz INTEGER[] NOT NULL,
+                window_ms INTEGER NOT NULL,
+                device_timestamp BIGINT NOT NULL,
+                device_timestamp_ms BIGINT,
+                timestamp TIMESTAMPTZ DEFAULT NOW()
+            );
+            """
+            ).format(sql.Identifier(table_name))
+        elif table_name == "elfryd_alarm":
+            create_table_query = sql.SQL(
+                """
+            CREATE TABLE IF NOT EXISTS {} (
+                id SERIAL PRIMARY KEY,
+                alarm_type TEXT NOT NULL,
+                state TEXT NOT NULL,
+                channel INTEGER NOT NULL,
+                value INTEGER NOT NULL,
+                device_timestamp BIGINT,
+                device_timestamp_ms BIGINT,
                 timestamp TIMESTAMPTZ DEFAULT NOW()
             );
             """
@@ -89,6 +156,15 @@ def ensure_table_exists(table_name):
             ).format(sql.Identifier(table_name))
 
         cursor.execute(create_table_query)
+
+        # Tables created before millisecond timestamps lack the column
+        if table_name in binary_handlers:
+            cursor.execute(
+                sql.SQL(
+                    "ALTER TABLE {} ADD COLUMN IF NOT EXISTS device_timestamp_ms BIGINT"
+                ).format(sql.Identifier(table_name))
+            )
+
         conn.commit()
         cursor.close()
         conn.close()
@@ -100,44 +176,73 @@ def ensure_table_exists(table_name):
         print(f"Error creating table {table_name}: {str(e)}")
 
 
+# Store one payload as if it was published on its own topic
+def process_payload(topic: str, raw_payload: bytes):
+    """Dispatch a payload to the handler of its topic"""
+    # Determine table name based on topic
+    table_name = get_table_name(topic)
+
+    # Coalesced frames carry payloads of several topics, each stored as if
+    # it had been published on its own
+    if table_name == "elfryd_batch" and codec.is_frame(raw_payload):
+        print(f"Received coalesced frame on topic {topic}: {len(raw_payload)} bytes")
+        for section_topic, section in codec.decode_frame(raw_payload):
+            try:
+                process_payload(section_topic, section)
+            except Exception as e:
+                print(f"Error processing section for {section_topic}: {str(e)}")
+        return
+
+    # Ensure the table exists before processing
+    ensure_table_exists(table_name)
+
+    # Binary sensor batches are detected by their version byte and are
+    # decoded before any attempt to read the payload as text
+    if table_name in binary_handlers and codec.is_binary(raw_payload):
+        print(f"Received binary message on topic {topic}: {len(raw_payload)} bytes")
+        binary_handlers[table_name].process_binary(raw_payload)
+        return
+
+    payload = raw_payload.decode("utf-8")
+    print(f"Received message on topic {topic}: {payload}")
+
+    # Process message based on topic with match-case (Python 3.10+)
+    match table_name:
+        case "elfryd_alarm":
+            # Alarms are sent one at a time, never batched
+            alarm_handler.process_message(payload)
+        case "elfryd_battery" | "elfryd_temp" | "elfryd_gyro" | "elfryd_stats" | "elfryd_motion" | "elfryd_config":
+            # For specialized handlers, check if payload contains multiple datapoints
+            datapoints = payload.split("|")
+            for datapoint in datapoints:
+                if not datapoint.strip():
+                    continue  # Skip empty datapoints
+
+                print(f"Processing datapoint: {datapoint.strip()}")
+
+                # Process with appropriate handler
+                if table_name == "elfryd_battery":
+                    battery_handler.process_message(datapoint.strip())
+                elif table_name == "elfryd_temp":
+                    temperature_handler.process_message(datapoint.strip())
+                elif table_name == "elfryd_gyro":
+                    gyro_handler.process_message(datapoint.strip())
+                elif table_name == "elfryd_stats":
+                    stats_handler.process_message(datapoint.strip())
+                elif table_name == "elfryd_motion":
+                    motion_handler.process_message(datapoint.strip())
+                elif table_name == "elfryd_config":
+                    config_handler.process_message(topic, datapoint.strip())
+        case _:
+            # Default case: use default handler (no splitting)
+            default_handler.process_message(topic, payload)
+
+
 # Callback when a MQTT message is received
 def on_message(_, __, msg: mqtt.MQTTMessage):
     """Handle incoming MQTT messages"""
     try:
-        topic = msg.topic
-        payload = msg.payload.decode("utf-8")
-        print(f"Received message on topic {topic}: {payload}")
-
-        # Determine table name based on topic
-        table_name = get_table_name(topic)
-
-        # Ensure the table exists before processing
-        ensure_table_exists(table_name)
-
-        # Process message based on topic with match-case (Python 3.10+)
-        match table_name:
-            case "elfryd_battery" | "elfryd_temp" | "elfryd_gyro" | "elfryd_config":
-                # For specialized handlers, check if payload contains multiple datapoints
-                datapoints = payload.split("|")
-                for datapoint in datapoints:
-                    if not datapoint.strip():
-                        continue  # Skip empty datapoints
-
-                    print(f"Processing datapoint: {datapoint.strip()}")
-
-                    # Process with appropriate handler
-                    if table_name == "elfryd_battery":
-                        battery_handler.process_message(datapoint.strip())
-                    elif table_name == "elfryd_temp":
-                        temperature_handler.process_message(datapoint.strip())
-                    elif table_name == "elfryd_gyro":
-                        gyro_handler.process_message(datapoint.strip())
-                    elif table_name == "elfryd_config":
-                        config_handler.process_message(topic, datapoint.strip())
-            case _:
-                # Default case: use default handler (no splitting)
-                default_handler.process_message(topic, payload)
-
+        process_payload(msg.topic, msg.payload)
     except Exception as e:
         print(f"Error processing message: {str(e)}")
 
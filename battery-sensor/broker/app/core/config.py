@@ -19,10 +19,10 @@ MQTT_CONFIG = {
 }
 
 # Base configuration commands
-BASE_CONFIG_COMMANDS = ["battery", "temp", "gyro"]
+BASE_CONFIG_COMMANDS = ["battery", "temp", "gyro", "aggregate"]
 
 # Regex patterns for valid command formats
 COMMAND_PATTERNS = {
-    "basic": r"^(battery|temp|gyro)$",  # basic commands: battery, temp, gyro
-    "interval": r"^(battery|temp|gyro) \d+$",  # interval commands: battery 10, temp 5, gyro 20
+    "basic": r"^(battery|temp|gyro|aggregate)$",  # basic commands: battery, temp, gyro, aggregate
+    "interval": r"^(battery|temp|gyro|aggregate|deadband|heartbeat|capture) \d+$",  # interval commands: battery 10, temp 5, deadband 20
 }
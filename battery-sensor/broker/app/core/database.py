@@ -79,11 +79,18 @@ def row_to_model(table: str, row: tuple) -> Union[
     match table:
         case "elfryd_battery":
             return BatteryDataResponse(
-                id=row[0], battery_id=row[1], voltage=row[2], device_timestamp=row[3]
+                id=row[0],
+                battery_id=row[1],
+                voltage=row[2],
+                device_timestamp=row[3],
+                device_timestamp_ms=row[4],
             )
         case "elfryd_temp":
             return TemperatureDataResponse(
-                id=row[0], temperature=row[1], device_timestamp=row[2]
+                id=row[0],
+                temperature=row[1],
+                device_timestamp=row[2],
+                device_timestamp_ms=row[3],
             )
         case "elfryd_gyro":
             return GyroDataResponse(
@@ -95,6 +102,7 @@ def row_to_model(table: str, row: tuple) -> Union[
                 gyro_y=row[5],
                 gyro_z=row[6],
                 device_timestamp=row[7],
+                device_timestamp_ms=row[8],
             )
         case "elfryd_config":
             return ConfigDataResponse(
@@ -276,9 +284,9 @@ def query_sensor_data(
 
         # Map table names to their columns (excluding server timestamp)
         table_columns = {
-            "elfryd_battery": "id, battery_id, voltage, device_timestamp",
-            "elfryd_temp": "id, temperature, device_timestamp",
-            "elfryd_gyro": "id, accel_x, accel_y, accel_z, gyro_x, gyro_y, gyro_z, device_timestamp",
+            "elfryd_battery": "id, battery_id, voltage, device_timestamp, device_timestamp_ms",
+            "elfryd_temp": "id, temperature, device_timestamp, device_timestamp_ms",
+            "elfryd_gyro": "id, accel_x, accel_y, accel_z, gyro_x, gyro_y, gyro_z, device_timestamp, device_timestamp_ms",
         }
 
         # Validate table name
@@ -343,7 +351,7 @@ def query_sensor_data(
                         query = sql.SQL("{} AND {} = %s").format(query, sql.Identifier(id_column))
                         params.append(id_value)
                     
-                    query = sql.SQL("{} ORDER BY device_timestamp ASC").format(query)
+                    query = sql.SQL("{} ORDER BY device_timestamp ASC, device_timestamp_ms ASC").format(query)
                     
                 else:
                     # Use window functions to divide the time range into equal buckets
@@ -402,7 +410,7 @@ def query_sensor_data(
                     query = sql.SQL("{} AND {} = %s").format(query, sql.Identifier(id_column))
                     params.append(id_value)
                 
-                query = sql.SQL("{} ORDER BY device_timestamp ASC").format(query)
+                query = sql.SQL("{} ORDER BY device_timestamp ASC, device_timestamp_ms ASC").format(query)
         else:
             # No time filtering, just apply regular limit
             query = sql.SQL("SELECT {} FROM {} WHERE 1=1").format(
@@ -415,7 +423,7 @@ def query_sensor_data(
                 query = sql.SQL("{} AND {} = %s").format(query, sql.Identifier(id_column))
                 params.append(id_value)
             
-            query = sql.SQL("{} ORDER BY device_timestamp DESC LIMIT %s").format(query)
+            query = sql.SQL("{} ORDER BY device_timestamp DESC, device_timestamp_ms DESC LIMIT %s").format(query)
             params.append(limit)
 
         cur.execute(query, params)
@@ -9,6 +9,7 @@ class BatteryData(BaseModel):
     battery_id: int
     voltage: int
     device_timestamp: int
+    device_timestamp_ms: Optional[int] = None
     timestamp: Optional[datetime] = None
 
 
@@ -16,6 +17,7 @@ class TemperatureData(BaseModel):
     id: Optional[int] = None
     temperature: int
     device_timestamp: int
+    device_timestamp_ms: Optional[int] = None
     timestamp: Optional[datetime] = None
 
 
@@ -28,6 +30,46 @@ class GyroData(BaseModel):
     gyro_y: int
     gyro_z: int
     device_timestamp: int
+    device_timestamp_ms: Optional[int] = None
+    timestamp: Optional[datetime] = None
+
+
+class StatsData(BaseModel):
+    id: Optional[int] = None
+    sensor: str
+    channel: int
+    sample_count: int
+    min_value: int
+    max_value: int
+    mean_value: int
+    last_value: int
+    window_ms: int
+    device_timestamp: int
+    device_timestamp_ms: Optional[int] = None
+    timestamp: Optional[datetime] = None
+
+
+class MotionData(BaseModel):
+    id: Optional[int] = None
+    roll: int
+    pitch: int
+    rms: List[int]
+    peak: List[int]
+    frequency_mhz: List[int]
+    window_ms: int
+    device_timestamp: int
+    device_timestamp_ms: Optional[int] = None
+    timestamp: Optional[datetime] = None
+
+
+class AlarmData(BaseModel):
+    id: Optional[int] = None
+    alarm_type: str
+    state: str
+    channel: int
+    value: int
+    device_timestamp: Optional[int] = None
+    device_timestamp_ms: Optional[int] = None
     timestamp: Optional[datetime] = None
 
 
@@ -93,6 +135,12 @@ class BatteryDataResponse(BaseModel):
         description="Timestamp of the measurement on the device (Unix timestamp)",
         example=1712841632,
     )
+    device_timestamp_ms: Optional[int] = Field(
+        None,
+        description="Timestamp of the measurement on the device in milliseconds "
+        "(Unix timestamp), null for readings stored before millisecond support",
+        example=1712841632123,
+    )
 
     class Config:
         json_schema_extra = {
@@ -101,6 +149,7 @@ class BatteryDataResponse(BaseModel):
                 "battery_id": 1,
                 "voltage": 3824,
                 "device_timestamp": 1712841632,
+                "device_timestamp_ms": 1712841632123,
             }
         }
 
@@ -115,10 +164,21 @@ class TemperatureDataResponse(BaseModel):
         description="Timestamp of the measurement on the device (Unix timestamp)",
         example=1712841730,
     )
+    device_timestamp_ms: Optional[int] = Field(
+        None,
+        description="Timestamp of the measurement on the device in milliseconds "
+        "(Unix timestamp), null for readings stored before millisecond support",
+        example=1712841730123,
+    )
 
     class Config:
         json_schema_extra = {
-            "example": {"id": 456, "temperature": 25, "device_timestamp": 1712841730}
+            "example": {
+                "id": 456,
+                "temperature": 25,
+                "device_timestamp": 1712841730,
+                "device_timestamp_ms": 1712841730123,
+            }
         }
 
 
@@ -141,6 +201,12 @@ class GyroDataResponse(BaseModel):
         description="Timestamp of the measurement on the device (Unix timestamp)",
         example=1712841803,
     )
+    device_timestamp_ms: Optional[int] = Field(
+        None,
+        description="Timestamp of the measurement on the device in milliseconds "
+        "(Unix timestamp), null for readings stored before millisecond support",
+        example=1712841803123,
+    )
 
     class Config:
         json_schema_extra = {
@@ -153,6 +219,7 @@ class GyroDataResponse(BaseModel):
                 "gyro_y": 241869,
                 "gyro_z": -243303,
                 "device_timestamp": 1712841803,
+                "device_timestamp_ms": 1712841803123,
             }
         }
 
@@ -150,6 +150,10 @@ certfile /mosquitto/certs/server.crt
 # Enable internal listener for bridge
 listener 1883 0.0.0.0
 allow_anonymous true
+
+# Keep hub sessions and the config commands queued for them across restarts
+persistence true
+persistence_location /mosquitto/data/
 EOL
 
 # Create a client certificate package
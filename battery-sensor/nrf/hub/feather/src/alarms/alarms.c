@@ -0,0 +1,215 @@
+/**
+ * @file alarms.c
+ * @brief Edge triggered alarm detection implementation
+ *
+ * Every rule keeps a debounced state per channel. An event is queued only
+ * when that state changes, so a battery sitting below the cutoff raises one
+ * alarm rather than one per reading. Clearing needs the reading to move back
+ * past the threshold by a hysteresis margin, so readings hovering around a
+ * threshold do not flood the uplink.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <stdlib.h>
+
+#include "alarms/alarms.h"
+#include "utils/utils.h"
+
+LOG_MODULE_REGISTER(alarms, LOG_LEVEL_INF);
+#define LOG_PREFIX_ALARM "[ALARM] "
+
+/* Events waiting for the alarm publisher */
+#define ALARM_QUEUE_SIZE 16
+
+/* Margins a reading must move back past a threshold before an alarm clears */
+#define VOLTAGE_HYSTERESIS_MV CONFIG_ELFRYD_ALARM_VOLTAGE_HYSTERESIS_MV
+#define TILT_HYSTERESIS_DEG 5
+
+K_MSGQ_DEFINE(alarm_msgq, sizeof(alarm_event_t), ALARM_QUEUE_SIZE, 8);
+
+/* Debounced state of one rule on one channel */
+typedef struct
+{
+    bool active;
+    uint8_t count; /* Consecutive readings calling for a state change */
+} alarm_state_t;
+
+/* Rule states and rate tracking of one battery */
+typedef struct
+{
+    alarm_state_t low_voltage;
+    alarm_state_t rate;
+    bool has_last;
+    int16_t last_voltage;
+    int64_t last_uptime; /* Uptime of the previous reading in ms */
+} battery_alarm_t;
+
+/* Only touched from the sampling thread, so no locking is needed */
+static battery_alarm_t battery_alarms[NUM_BATTERIES];
+static alarm_state_t tilt_state;
+static alarm_state_t capsize_state;
+
+static const char *const type_names[ALARM_TYPE_COUNT] = {
+    [ALARM_LOW_VOLTAGE] = "low_voltage",
+    [ALARM_VOLTAGE_RATE] = "voltage_rate",
+    [ALARM_TILT] = "tilt",
+    [ALARM_CAPSIZE] = "capsize",
+};
+
+const char *alarms_type_name(alarm_type_t type)
+{
+    return type < ALARM_TYPE_COUNT ? type_names[type] : "unknown";
+}
+
+static void report(alarm_type_t type, bool raised, uint8_t channel, int32_t value,
+                   int64_t timestamp)
+{
+    alarm_event_t event = {
+        .type = type,
+        .raised = raised,
+        .channel = channel,
+        .value = value,
+        .timestamp = timestamp};
+
+    if (k_msgq_put(&alarm_msgq, &event, K_NO_WAIT) != 0)
+    {
+        LOG_ERR(LOG_PREFIX_ALARM "Alarm queue full, dropping %s event", type_names[type]);
+        return;
+    }
+
+    LOG_WRN(LOG_PREFIX_ALARM "%s %s on channel %d, value %d",
+            type_names[type], raised ? "raised" : "cleared", channel, value);
+}
+
+/* Debounce a rule, returns true when its state changed */
+static bool update_state(alarm_state_t *state, bool raise, bool clear, int debounce)
+{
+    bool change = state->active ? clear : raise;
+
+    if (!change)
+    {
+        state->count = 0;
+        return false;
+    }
+
+    if (++state->count < debounce)
+    {
+        return false;
+    }
+
+    state->count = 0;
+    state->active = !state->active;
+
+    return true;
+}
+
+void alarms_check_battery(const battery_reading_t *reading)
+{
+    battery_alarm_t *alarm;
+    int64_t now = k_uptime_get();
+    int voltage = reading->voltage;
+
+    if (reading->battery_id < 1 || reading->battery_id > NUM_BATTERIES)
+    {
+        return;
+    }
+
+    alarm = &battery_alarms[reading->battery_id - 1];
+
+    if (CONFIG_ELFRYD_ALARM_LOW_VOLTAGE_MV > 0 &&
+        update_state(&alarm->low_voltage,
+                     voltage < CONFIG_ELFRYD_ALARM_LOW_VOLTAGE_MV,
+                     voltage >= CONFIG_ELFRYD_ALARM_LOW_VOLTAGE_MV + VOLTAGE_HYSTERESIS_MV,
+                     CONFIG_ELFRYD_ALARM_DEBOUNCE))
+    {
+        report(ALARM_LOW_VOLTAGE, alarm->low_voltage.active, reading->battery_id,
+               voltage, reading->timestamp);
+    }
+
+    if (CONFIG_ELFRYD_ALARM_VOLTAGE_RATE > 0 && alarm->has_last && now > alarm->last_uptime)
+    {
+        /* Signed 64 bit, MSEC_PER_SEC is unsigned and would wrap a voltage drop */
+        int32_t rate = (int32_t)((int64_t)(voltage - alarm->last_voltage) * MSEC_PER_SEC /
+                                 (now - alarm->last_uptime));
+        bool fast = abs(rate) > CONFIG_ELFRYD_ALARM_VOLTAGE_RATE;
+
+        /* A sudden step is the event itself, so no debouncing here */
+        if (update_state(&alarm->rate, fast, !fast, 1))
+        {
+            report(ALARM_VOLTAGE_RATE, alarm->rate.active, reading->battery_id,
+                   rate, reading->timestamp);
+        }
+    }
+
+    alarm->has_last = true;
+    alarm->last_voltage = voltage;
+    alarm->last_uptime = now;
+}
+
+/* Angle in degrees (0-90) for a cosine in thousandths (0-1000), from the
+ * inverse of Bhaskara I's cosine approximation, within about a degree
+ */
+static int angle_from_cos(int32_t cos_permille)
+{
+    return utils_isqrt(32400LL * (1000 - cos_permille) / (4000 + cos_permille));
+}
+
+/* Angle between the measured gravity vector and the z axis in degrees,
+ * or -1 if the accelerometer reads no acceleration at all
+ */
+static int tilt_degrees(const gyro_reading_t *reading)
+{
+    /* Drop the low bits so the squares cannot overflow */
+    int64_t x = reading->accel_x >> 8;
+    int64_t y = reading->accel_y >> 8;
+    int64_t z = reading->accel_z >> 8;
+    uint32_t norm = utils_isqrt(x * x + y * y + z * z);
+    int32_t cos_permille;
+
+    if (norm == 0)
+    {
+        return -1;
+    }
+
+    cos_permille = (int32_t)(z * 1000 / norm);
+    if (cos_permille < 0)
+    {
+        return 180 - angle_from_cos(-cos_permille);
+    }
+
+    return angle_from_cos(cos_permille);
+}
+
+void alarms_check_gyro(const gyro_reading_t *reading)
+{
+    int tilt = tilt_degrees(reading);
+
+    if (tilt < 0)
+    {
+        return;
+    }
+
+    if (CONFIG_ELFRYD_ALARM_TILT_DEG > 0 &&
+        update_state(&tilt_state,
+                     tilt > CONFIG_ELFRYD_ALARM_TILT_DEG,
+                     tilt <= CONFIG_ELFRYD_ALARM_TILT_DEG - TILT_HYSTERESIS_DEG,
+                     CONFIG_ELFRYD_ALARM_DEBOUNCE))
+    {
+        report(ALARM_TILT, tilt_state.active, 0, tilt, reading->timestamp);
+    }
+
+    if (CONFIG_ELFRYD_ALARM_CAPSIZE_DEG > 0 &&
+        update_state(&capsize_state,
+                     tilt > CONFIG_ELFRYD_ALARM_CAPSIZE_DEG,
+                     tilt <= CONFIG_ELFRYD_ALARM_CAPSIZE_DEG - TILT_HYSTERESIS_DEG,
+                     CONFIG_ELFRYD_ALARM_DEBOUNCE))
+    {
+        report(ALARM_CAPSIZE, capsize_state.active, 0, tilt, reading->timestamp);
+    }
+}
+
+int alarms_get_event(alarm_event_t *event, k_timeout_t timeout)
+{
+    return k_msgq_get(&alarm_msgq, event, timeout);
+}
@@ -0,0 +1,78 @@
+/**
+ * @file alarms.h
+ * @brief Edge triggered alarm detection on fresh sensor readings
+ */
+
+#ifndef ALARMS_H
+#define ALARMS_H
+
+#include <stdbool.h>
+#include <zephyr/kernel.h>
+
+#include "sensors/sensors.h"
+
+/**
+ * Alarm rules
+ */
+typedef enum
+{
+    ALARM_LOW_VOLTAGE,  /* Battery voltage below the cutoff */
+    ALARM_VOLTAGE_RATE, /* Battery voltage changing faster than the limit */
+    ALARM_TILT,         /* Hull tilted past the tilt angle */
+    ALARM_CAPSIZE,      /* Hull tilted past the capsize angle */
+    ALARM_TYPE_COUNT
+} alarm_type_t;
+
+/**
+ * Alarm event, reported once when a condition starts and once when it clears
+ */
+typedef struct
+{
+    alarm_type_t type;
+    bool raised;       /* true when the condition started, false when it cleared */
+    uint8_t channel;   /* Battery ID for battery alarms, 0 for tilt alarms */
+    int32_t value;     /* mV, mV/s or degrees, depending on the type */
+    int64_t timestamp; /* Timestamp of the reading that changed the state */
+} alarm_event_t;
+
+/**
+ * Check a fresh battery reading against the battery alarm rules
+ *
+ * Must only be called from the thread sampling the sensors, right after the
+ * reading was taken, and never blocks. Events for conditions that start or
+ * clear are queued for alarms_get_event.
+ *
+ * @param reading Battery reading to check
+ */
+void alarms_check_battery(const battery_reading_t *reading);
+
+/**
+ * Check a fresh accelerometer reading against the tilt alarm rules
+ *
+ * The tilt is the angle between the measured gravity vector and the z axis,
+ * so the sensor must be mounted with z pointing up when the hull is level.
+ *
+ * @see alarms_check_battery
+ *
+ * @param reading Gyroscope/accelerometer reading to check
+ */
+void alarms_check_gyro(const gyro_reading_t *reading);
+
+/**
+ * Wait for the next alarm event
+ *
+ * @param event   Set to the oldest queued event
+ * @param timeout How long to wait for an event
+ * @return        0 on success, -EAGAIN if no event arrived in time
+ */
+int alarms_get_event(alarm_event_t *event, k_timeout_t timeout);
+
+/**
+ * Get the name of an alarm type as used in published alarms
+ *
+ * @param type Alarm type
+ * @return     Name of the alarm type
+ */
+const char *alarms_type_name(alarm_type_t type);
+
+#endif /* ALARMS_H */
@@ -21,16 +21,31 @@ static K_MUTEX_DEFINE(config_mutex);
 static int battery_interval = DEFAULT_BATTERY_INTERVAL;
 static int temp_interval = DEFAULT_TEMP_INTERVAL;
 static int gyro_interval = DEFAULT_GYRO_INTERVAL;
+static int aggregate_window = DEFAULT_AGGREGATE_WINDOW;
+static int battery_deadband = DEFAULT_BATTERY_DEADBAND;
+static int battery_heartbeat = DEFAULT_BATTERY_HEARTBEAT;
+static int gyro_capture;
 
 /* Last configuration command for confirmation */
 static char last_command[256]; /* Increased buffer size from 128 to 256 */
 static bool has_new_command = false;
 
-/* Declare external flags for immediate publishing */
-extern struct k_mutex publish_flags_mutex;
-extern bool battery_publish_request;
-extern bool temp_publish_request;
-extern bool gyro_publish_request;
+/* Handler notified of interval changes and publish requests */
+static config_event_handler_t event_handler;
+
+static void notify(config_evt_type_t evt, config_param_t param)
+{
+    config_event_handler_t handler;
+
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    handler = event_handler;
+    k_mutex_unlock(&config_mutex);
+
+    if (handler)
+    {
+        handler(evt, param);
+    }
+}
 
 int config_init(void)
 {
@@ -40,6 +55,10 @@ int config_init(void)
     battery_interval = DEFAULT_BATTERY_INTERVAL;
     temp_interval = DEFAULT_TEMP_INTERVAL;
     gyro_interval = DEFAULT_GYRO_INTERVAL;
+    aggregate_window = DEFAULT_AGGREGATE_WINDOW;
+    battery_deadband = DEFAULT_BATTERY_DEADBAND;
+    battery_heartbeat = DEFAULT_BATTERY_HEARTBEAT;
+    gyro_capture = 0;
     has_new_command = false;
     memset(last_command, 0, sizeof(last_command));
 
@@ -48,6 +67,13 @@ int config_init(void)
     return 0;
 }
 
+void config_set_event_handler(config_event_handler_t handler)
+{
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    event_handler = handler;
+    k_mutex_unlock(&config_mutex);
+}
+
 int config_get_battery_interval(void)
 {
     int interval;
@@ -81,6 +107,50 @@ int config_get_gyro_interval(void)
     return interval;
 }
 
+int config_get_aggregate_window(void)
+{
+    int window;
+
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    window = aggregate_window;
+    k_mutex_unlock(&config_mutex);
+
+    return window;
+}
+
+int config_get_battery_deadband(void)
+{
+    int deadband;
+
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    deadband = battery_deadband;
+    k_mutex_unlock(&config_mutex);
+
+    return deadband;
+}
+
+int config_get_battery_heartbeat(void)
+{
+    int heartbeat;
+
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    heartbeat = battery_heartbeat;
+    k_mutex_unlock(&config_mutex);
+
+    return heartbeat;
+}
+
+int config_get_gyro_capture(void)
+{
+    int capture;
+
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    capture = gyro_capture;
+    k_mutex_unlock(&config_mutex);
+
+    return capture;
+}
+
 int config_set_battery_interval(int interval)
 {
     if (interval < 0)
@@ -97,6 +167,8 @@ int config_set_battery_interval(int interval)
 
     k_mutex_unlock(&config_mutex);
 
+    notify(CONFIG_EVT_INTERVAL_CHANGED, CONFIG_PARAM_BATTERY);
+
     return 0;
 }
 
@@ -116,6 +188,8 @@ int config_set_temp_interval(int interval)
 
     k_mutex_unlock(&config_mutex);
 
+    notify(CONFIG_EVT_INTERVAL_CHANGED, CONFIG_PARAM_TEMP);
+
     return 0;
 }
 
@@ -135,6 +209,92 @@ int config_set_gyro_interval(int interval)
 
     k_mutex_unlock(&config_mutex);
 
+    notify(CONFIG_EVT_INTERVAL_CHANGED, CONFIG_PARAM_GYRO);
+
+    return 0;
+}
+
+int config_set_aggregate_window(int window)
+{
+    if (window < 0 || window > 3600)
+    {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    aggregate_window = window;
+
+    /* Store for confirmation */
+    snprintf(last_command, sizeof(last_command), "aggregate %d", window);
+    has_new_command = true;
+
+    k_mutex_unlock(&config_mutex);
+
+    notify(CONFIG_EVT_INTERVAL_CHANGED, CONFIG_PARAM_AGGREGATE);
+
+    return 0;
+}
+
+int config_set_battery_deadband(int deadband)
+{
+    if (deadband < 0 || deadband > 5000)
+    {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    battery_deadband = deadband;
+
+    /* Store for confirmation */
+    snprintf(last_command, sizeof(last_command), "deadband %d", deadband);
+    has_new_command = true;
+
+    k_mutex_unlock(&config_mutex);
+
+    notify(CONFIG_EVT_INTERVAL_CHANGED, CONFIG_PARAM_DEADBAND);
+
+    return 0;
+}
+
+int config_set_battery_heartbeat(int heartbeat)
+{
+    if (heartbeat < 0 || heartbeat > 86400)
+    {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    battery_heartbeat = heartbeat;
+
+    /* Store for confirmation */
+    snprintf(last_command, sizeof(last_command), "heartbeat %d", heartbeat);
+    has_new_command = true;
+
+    k_mutex_unlock(&config_mutex);
+
+    notify(CONFIG_EVT_INTERVAL_CHANGED, CONFIG_PARAM_DEADBAND);
+
+    return 0;
+}
+
+int config_set_gyro_capture(int seconds)
+{
+    if (seconds < 0 || seconds > 3600)
+    {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&config_mutex, K_FOREVER);
+    gyro_capture = seconds;
+
+    /* Store for confirmation */
+    snprintf(last_command, sizeof(last_command), "capture %d", seconds);
+    has_new_command = true;
+
+    k_mutex_unlock(&config_mutex);
+
+    notify(CONFIG_EVT_INTERVAL_CHANGED, CONFIG_PARAM_CAPTURE);
+
     return 0;
 }
 
@@ -190,10 +350,8 @@ int config_process_command(const char *command)
             has_new_command = true;
             k_mutex_unlock(&config_mutex);
 
-            /* Set the flag to publish battery data immediately */
-            k_mutex_lock(&publish_flags_mutex, K_FOREVER);
-            battery_publish_request = true;
-            k_mutex_unlock(&publish_flags_mutex);
+            /* Have the battery data published immediately */
+            notify(CONFIG_EVT_PUBLISH_REQUESTED, CONFIG_PARAM_BATTERY);
 
             return 0;
         }
@@ -207,10 +365,8 @@ int config_process_command(const char *command)
             has_new_command = true;
             k_mutex_unlock(&config_mutex);
 
-            /* Set the flag to publish temperature data immediately */
-            k_mutex_lock(&publish_flags_mutex, K_FOREVER);
-            temp_publish_request = true;
-            k_mutex_unlock(&publish_flags_mutex);
+            /* Have the temperature data published immediately */
+            notify(CONFIG_EVT_PUBLISH_REQUESTED, CONFIG_PARAM_TEMP);
 
             return 0;
         }
@@ -224,10 +380,23 @@ int config_process_command(const char *command)
             has_new_command = true;
             k_mutex_unlock(&config_mutex);
 
-            /* Set the flag to publish gyro data immediately */
-            k_mutex_lock(&publish_flags_mutex, K_FOREVER);
-            gyro_publish_request = true;
-            k_mutex_unlock(&publish_flags_mutex);
+            /* Have the gyro data published immediately */
+            notify(CONFIG_EVT_PUBLISH_REQUESTED, CONFIG_PARAM_GYRO);
+
+            return 0;
+        }
+        else if (strcmp(type, "aggregate") == 0)
+        {
+            LOG_INF(LOG_PREFIX_CONFIG "Request to send all aggregate data");
+
+            /* Store confirmation that will be sent back */
+            k_mutex_lock(&config_mutex, K_FOREVER);
+            snprintf(last_command, sizeof(last_command), "aggregate");
+            has_new_command = true;
+            k_mutex_unlock(&config_mutex);
+
+            /* Have the closed windows published immediately */
+            notify(CONFIG_EVT_PUBLISH_REQUESTED, CONFIG_PARAM_AGGREGATE);
 
             return 0;
         }
@@ -260,6 +429,22 @@ int config_process_command(const char *command)
     {
         ret = config_set_gyro_interval(value);
     }
+    else if (strcmp(type, "aggregate") == 0)
+    {
+        ret = config_set_aggregate_window(value);
+    }
+    else if (strcmp(type, "deadband") == 0)
+    {
+        ret = config_set_battery_deadband(value);
+    }
+    else if (strcmp(type, "heartbeat") == 0)
+    {
+        ret = config_set_battery_heartbeat(value);
+    }
+    else if (strcmp(type, "capture") == 0)
+    {
+        ret = config_set_gyro_capture(value);
+    }
     else
     {
         LOG_ERR(LOG_PREFIX_CONFIG "Unknown command type: %s", type);
@@ -14,14 +14,41 @@
 #define DEFAULT_TEMP_INTERVAL CONFIG_SENSOR_TEMP_INTERVAL
 #define DEFAULT_GYRO_INTERVAL CONFIG_SENSOR_GYRO_INTERVAL
 
+/** Default battery deadband in millivolts and heartbeat in seconds from Kconfig */
+#define DEFAULT_BATTERY_DEADBAND CONFIG_ELFRYD_BATTERY_DEADBAND_MV
+#define DEFAULT_BATTERY_HEARTBEAT CONFIG_ELFRYD_BATTERY_HEARTBEAT
+
+/** Default aggregation window in seconds from Kconfig, 0 = raw readings */
+#define DEFAULT_AGGREGATE_WINDOW CONFIG_ELFRYD_AGGREGATE_WINDOW
+
 /** Configuration parameter types */
 typedef enum
 {
     CONFIG_PARAM_BATTERY,
     CONFIG_PARAM_TEMP,
-    CONFIG_PARAM_GYRO
+    CONFIG_PARAM_GYRO,
+    CONFIG_PARAM_AGGREGATE,
+    CONFIG_PARAM_DEADBAND,
+    CONFIG_PARAM_CAPTURE
 } config_param_t;
 
+/** Configuration events reported to the event handler */
+typedef enum
+{
+    CONFIG_EVT_INTERVAL_CHANGED,  /* A sampling interval, filter or capture setting was set */
+    CONFIG_EVT_PUBLISH_REQUESTED  /* All stored data should be sent now */
+} config_evt_type_t;
+
+/**
+ * @brief Handler for configuration events
+ *
+ * Called from the thread processing the command, must not block.
+ *
+ * @param evt Type of event
+ * @param param Sensor type the event applies to
+ */
+typedef void (*config_event_handler_t)(config_evt_type_t evt, config_param_t param);
+
 /**
  * @brief Initialize the configuration module
  *
@@ -29,6 +56,16 @@ typedef enum
  */
 int config_init(void);
 
+/**
+ * @brief Set the handler for configuration events
+ *
+ * Lets the scheduler re-arm its deadlines only when the configuration
+ * actually changes instead of polling it.
+ *
+ * @param handler Handler to call, or NULL to disable notifications
+ */
+void config_set_event_handler(config_event_handler_t handler);
+
 /**
  * @brief Get the current battery sampling interval
  *
@@ -50,6 +87,34 @@ int config_get_temp_interval(void);
  */
 int config_get_gyro_interval(void);
 
+/**
+ * @brief Get the current aggregation window
+ *
+ * @return Window length in seconds (0 = raw readings)
+ */
+int config_get_aggregate_window(void);
+
+/**
+ * @brief Get the current battery voltage deadband
+ *
+ * @return Deadband in millivolts (0 = store every reading)
+ */
+int config_get_battery_deadband(void);
+
+/**
+ * @brief Get the current battery reading heartbeat
+ *
+ * @return Heartbeat in seconds (0 = only store changes)
+ */
+int config_get_battery_heartbeat(void);
+
+/**
+ * @brief Get the length of the last requested raw gyroscope capture
+ *
+ * @return Capture length in seconds (0 = no capture)
+ */
+int config_get_gyro_capture(void);
+
 /**
  * @brief Set the battery sampling interval
  *
@@ -74,6 +139,39 @@ int config_set_temp_interval(int interval);
  */
 int config_set_gyro_interval(int interval);
 
+/**
+ * @brief Set the aggregation window
+ *
+ * @param window Window length in seconds (0 = publish raw readings)
+ * @return 0 on success, negative errno code on failure
+ */
+int config_set_aggregate_window(int window);
+
+/**
+ * @brief Set the battery voltage deadband
+ *
+ * @param deadband Deadband in millivolts (0 = store every reading)
+ * @return 0 on success, negative errno code on failure
+ */
+int config_set_battery_deadband(int deadband);
+
+/**
+ * @brief Set the battery reading heartbeat
+ *
+ * @param heartbeat Heartbeat in seconds (0 = only store changes)
+ * @return 0 on success, negative errno code on failure
+ */
+int config_set_battery_heartbeat(int heartbeat);
+
+/**
+ * @brief Request a capture of raw gyroscope readings
+ *
+ * @param seconds How long to store raw readings next to the motion features
+ *                (0 = stop a running capture)
+ * @return 0 on success, negative errno code on failure
+ */
+int config_set_gyro_capture(int seconds);
+
 /**
  * @brief Process a configuration command
  *
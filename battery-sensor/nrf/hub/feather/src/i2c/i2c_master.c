@@ -10,6 +10,7 @@
 #include <zephyr/random/rand32.h>
 #include "i2c/i2c_master.h"
 #include "utils/utils.h"
+#include "metrics/metrics.h"
 
 LOG_MODULE_REGISTER(i2c_master, LOG_LEVEL_INF);
 #define LOG_PREFIX_I2C "[I2C] "
@@ -81,6 +82,7 @@ static int read_battery_data_block(uint8_t *data, size_t size)
     if (ret < 0)
     {
         LOG_ERR(LOG_PREFIX_HW "Failed to read battery data from I2C: %d", ret);
+        metrics_inc(METRIC_I2C_ERRORS);
         return ret;
     }
 
@@ -108,6 +110,7 @@ static int read_temp_data_block(uint8_t *data, size_t size)
     if (ret < 0)
     {
         LOG_ERR(LOG_PREFIX_HW "Failed to read temperature data from I2C: %d", ret);
+        metrics_inc(METRIC_I2C_ERRORS);
         return ret;
     }
 
@@ -135,6 +138,7 @@ static int read_gyro_data_block(uint8_t *data, size_t size)
     if (ret < 0)
     {
         LOG_ERR(LOG_PREFIX_HW "Failed to read gyroscope data from I2C: %d", ret);
+        metrics_inc(METRIC_I2C_ERRORS);
         return ret;
     }
 
@@ -196,7 +200,7 @@ int i2c_read_battery_data(int battery_id, battery_reading_t *reading)
     /* Fill in the battery reading structure with local timestamp */
     reading->battery_id = battery_id;
     reading->voltage = voltage;
-    reading->timestamp = utils_get_timestamp();
+    reading->timestamp = utils_get_sample_timestamp();
 
     LOG_DBG(LOG_PREFIX_I2C "Read battery data: id=%d, voltage=%d mV, timestamp=%lld",
             reading->battery_id, reading->voltage, reading->timestamp);
@@ -263,7 +267,7 @@ int i2c_read_all_battery_data(battery_reading_t *readings, int max_readings)
         /* Fill in the battery reading structure with local timestamp */
         readings[valid_readings].battery_id = id_from_data;
         readings[valid_readings].voltage = voltage;
-        readings[valid_readings].timestamp = utils_get_timestamp();
+        readings[valid_readings].timestamp = utils_get_sample_timestamp();
 
         LOG_DBG(LOG_PREFIX_I2C "Read battery data: id=%d, voltage=%d mV, timestamp=%lld",
                 readings[valid_readings].battery_id, 
@@ -317,7 +321,7 @@ int i2c_read_temp_data(temp_reading_t *reading)
 
     /* Fill in the temperature reading structure with local timestamp */
     reading->temperature = temperature;
-    reading->timestamp = utils_get_timestamp();
+    reading->timestamp = utils_get_sample_timestamp();
 
     LOG_DBG(LOG_PREFIX_I2C "Read temperature data: %d °C, timestamp=%lld",
             reading->temperature, reading->timestamp);
@@ -383,7 +387,7 @@ int i2c_read_gyro_data(gyro_reading_t *reading)
     reading->gyro_x = values[3];
     reading->gyro_y = values[4];
     reading->gyro_z = values[5];
-    reading->timestamp = utils_get_timestamp();
+    reading->timestamp = utils_get_sample_timestamp();
 
     LOG_DBG(LOG_PREFIX_I2C "Read gyro data: accel_x=%d, accel_y=%d, accel_z=%d, gyro_x=%d, gyro_y=%d, gyro_z=%d, timestamp=%lld",
             reading->accel_x, reading->accel_y, reading->accel_z,
@@ -0,0 +1,443 @@
+/**
+ * @file lte_manager.c
+ * @brief Power-aware LTE link management implementation
+ *
+ * Between publish batches the hub has nothing to say, so the modem should
+ * spend that time in PSM. The manager requests PSM timers and optionally
+ * eDRX when attaching, releases the RRC connection with RAI once an
+ * exchange is complete, and derives the MQTT keepalive from the granted TAU
+ * so the connection survives without waking the modem in between.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/logging/log.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <nrf_modem_at.h>
+#include <modem/lte_lc.h>
+
+#include "lte/lte_manager.h"
+#include "utils/boot_phases.h"
+
+LOG_MODULE_REGISTER(lte_manager, LOG_LEVEL_INF);
+#define LOG_PREFIX_LTE "[LTE] "
+
+/* The keepalive ping goes out this long before the periodic TAU is due */
+#define KEEPALIVE_TAU_MARGIN_S 30
+
+/* One unit of a 3GPP GPRS timer, see TS 24.008 10.5.7.3 and 10.5.7.4a */
+typedef struct
+{
+    uint8_t bits;
+    uint32_t seconds;
+} timer_unit_t;
+
+/* Periodic TAU (T3412 extended) units, shortest first */
+static const timer_unit_t tau_units[] = {
+    {0x3, 2}, {0x4, 30}, {0x5, 60}, {0x0, 600}, {0x1, 3600}, {0x2, 36000}, {0x6, 1152000},
+};
+
+/* Active time (T3324) units, shortest first */
+static const timer_unit_t active_units[] = {
+    {0x0, 2}, {0x1, 60}, {0x2, 360},
+};
+
+/* LTE-M eDRX cycles in ms, indexed by their 4 bit code, see TS 24.008 10.5.5.32 */
+static const uint32_t edrx_cycles_ms[] = {
+    5120, 10240, 20480, 40960, 61440, 81920, 102400,
+    122880, 143360, 163840, 327680, 655360, 1310720, 2621440,
+};
+
+/* Link state reported by the modem, read from other threads */
+static K_MUTEX_DEFINE(lte_mutex);
+static int granted_tau = -1;    /* Seconds, -1 = PSM not granted */
+static int granted_active = -1; /* Seconds, -1 = PSM not granted */
+static bool rrc_connected;
+static bool registered;
+
+static lte_manager_evt_cb_t event_handler;
+
+/* Write a timer as the 8 character bit string AT+CPSMS takes, a 3 bit unit
+ * and a 5 bit value. Rounds up, so the hub never asks for less than
+ * configured. Returns the encoded time in seconds or a negative error.
+ */
+static int encode_timer(char *bits, uint32_t seconds, const timer_unit_t *units, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t value = DIV_ROUND_UP(seconds, units[i].seconds);
+        uint8_t timer;
+
+        if (value > 0x1F)
+        {
+            continue;
+        }
+
+        timer = (units[i].bits << 5) | value;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            bits[bit] = (timer & BIT(7 - bit)) ? '1' : '0';
+        }
+        bits[8] = '\0';
+
+        return value * units[i].seconds;
+    }
+
+    return -EINVAL;
+}
+
+/* Write the longest eDRX cycle not above the given time as its 4 bit code.
+ * Returns the cycle in ms or a negative error if even the shortest is longer.
+ */
+static int encode_edrx(char *bits, uint32_t seconds)
+{
+    int code = -1;
+
+    for (int i = 0; i < ARRAY_SIZE(edrx_cycles_ms); i++)
+    {
+        if (edrx_cycles_ms[i] <= seconds * MSEC_PER_SEC)
+        {
+            code = i;
+        }
+    }
+
+    if (code < 0)
+    {
+        return -EINVAL;
+    }
+
+    for (int bit = 0; bit < 4; bit++)
+    {
+        bits[bit] = (code & BIT(3 - bit)) ? '1' : '0';
+    }
+    bits[4] = '\0';
+
+    return edrx_cycles_ms[code];
+}
+
+static void notify(lte_manager_evt_t evt)
+{
+    lte_manager_evt_cb_t handler;
+
+    k_mutex_lock(&lte_mutex, K_FOREVER);
+    handler = event_handler;
+    k_mutex_unlock(&lte_mutex);
+
+    if (handler)
+    {
+        handler(evt);
+    }
+}
+
+/* Track registration, reporting only changes */
+static void set_registered(bool now_registered)
+{
+    bool changed;
+
+    k_mutex_lock(&lte_mutex, K_FOREVER);
+    changed = registered != now_registered;
+    registered = now_registered;
+    k_mutex_unlock(&lte_mutex);
+
+    if (changed && now_registered)
+    {
+        boot_phase_done(BOOT_PHASE_ATTACH);
+    }
+
+    if (changed)
+    {
+        notify(now_registered ? LTE_MANAGER_EVT_REGISTERED : LTE_MANAGER_EVT_DEREGISTERED);
+    }
+}
+
+static void lte_handler(const struct lte_lc_evt *const evt)
+{
+    switch (evt->type)
+    {
+    case LTE_LC_EVT_NW_REG_STATUS:
+        LOG_INF(LOG_PREFIX_LTE "Network registration status: %d", evt->nw_reg_status);
+        set_registered(evt->nw_reg_status == LTE_LC_NW_REG_REGISTERED_HOME ||
+                       evt->nw_reg_status == LTE_LC_NW_REG_REGISTERED_ROAMING);
+        break;
+    case LTE_LC_EVT_PSM_UPDATE:
+        LOG_INF(LOG_PREFIX_LTE "PSM parameter update: TAU: %d, Active time: %d",
+                evt->psm_cfg.tau, evt->psm_cfg.active_time);
+
+        k_mutex_lock(&lte_mutex, K_FOREVER);
+        granted_tau = evt->psm_cfg.tau;
+        granted_active = evt->psm_cfg.active_time;
+        k_mutex_unlock(&lte_mutex);
+        break;
+    case LTE_LC_EVT_EDRX_UPDATE:
+        LOG_INF(LOG_PREFIX_LTE "eDRX parameter update: eDRX: %f, PTW: %f",
+                (double)evt->edrx_cfg.edrx, (double)evt->edrx_cfg.ptw);
+        break;
+    case LTE_LC_EVT_RRC_UPDATE:
+        LOG_INF(LOG_PREFIX_LTE "RRC mode: %s",
+                evt->rrc_mode == LTE_LC_RRC_MODE_CONNECTED ? "Connected" : "Idle");
+
+        k_mutex_lock(&lte_mutex, K_FOREVER);
+        rrc_connected = evt->rrc_mode == LTE_LC_RRC_MODE_CONNECTED;
+        k_mutex_unlock(&lte_mutex);
+        break;
+    case LTE_LC_EVT_CELL_UPDATE:
+        LOG_INF(LOG_PREFIX_LTE "LTE cell changed: Cell ID: %d, Tracking area: %d",
+                evt->cell.id, evt->cell.tac);
+        notify(LTE_MANAGER_EVT_CELL_CHANGED);
+        break;
+    case LTE_LC_EVT_LTE_MODE_UPDATE:
+        LOG_INF(LOG_PREFIX_LTE "Active LTE mode changed: %s",
+                evt->lte_mode == LTE_LC_LTE_MODE_NONE ? "None" : evt->lte_mode == LTE_LC_LTE_MODE_LTEM ? "LTE-M"
+                                                             : evt->lte_mode == LTE_LC_LTE_MODE_NBIOT  ? "NB-IoT"
+                                                                                                       : "Unknown");
+        break;
+    default:
+        break;
+    }
+}
+
+/* Ask for PSM and eDRX in the attach request, the network decides what it grants */
+static int request_power_saving(void)
+{
+    int err;
+
+#ifdef CONFIG_ELFRYD_LTE_PSM
+    char tau[9];
+    char active[9];
+    int tau_s = encode_timer(tau, CONFIG_ELFRYD_LTE_PSM_TAU, tau_units, ARRAY_SIZE(tau_units));
+    int active_s = encode_timer(active, CONFIG_ELFRYD_LTE_PSM_ACTIVE_TIME, active_units,
+                                ARRAY_SIZE(active_units));
+
+    if (tau_s < 0 || active_s < 0)
+    {
+        LOG_ERR(LOG_PREFIX_LTE "PSM timers out of range");
+        return -EINVAL;
+    }
+
+    err = lte_lc_psm_param_set(tau, active);
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_LTE "Failed to set PSM parameters: %d", err);
+        return err;
+    }
+
+    err = lte_lc_psm_req(true);
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_LTE "Failed to request PSM: %d", err);
+        return err;
+    }
+
+    LOG_INF(LOG_PREFIX_LTE "Requested PSM, TAU %d s (%s), active time %d s (%s)",
+            tau_s, tau, active_s, active);
+#endif
+
+    if (CONFIG_ELFRYD_LTE_EDRX_CYCLE > 0)
+    {
+        char edrx[5];
+        int cycle_ms = encode_edrx(edrx, CONFIG_ELFRYD_LTE_EDRX_CYCLE);
+
+        if (cycle_ms < 0)
+        {
+            LOG_ERR(LOG_PREFIX_LTE "eDRX cycle out of range");
+            return -EINVAL;
+        }
+
+        err = lte_lc_edrx_param_set(LTE_LC_LTE_MODE_LTEM, edrx);
+        if (!err)
+        {
+            err = lte_lc_edrx_req(true);
+        }
+        if (err)
+        {
+            LOG_ERR(LOG_PREFIX_LTE "Failed to request eDRX: %d", err);
+            return err;
+        }
+
+        LOG_INF(LOG_PREFIX_LTE "Requested eDRX cycle of %d ms (%s)", cycle_ms, edrx);
+    }
+
+#ifdef CONFIG_ELFRYD_LTE_RAI
+    /* Access stratum RAI, set per socket with SO_RAI once an exchange is done */
+    err = nrf_modem_at_printf("AT%%RAI=1");
+    if (err)
+    {
+        LOG_WRN(LOG_PREFIX_LTE "Modem does not support release assistance: %d", err);
+    }
+#endif
+
+    return 0;
+}
+
+int lte_manager_init(void)
+{
+    int err;
+
+    LOG_INF(LOG_PREFIX_LTE "Setting up LTE connection...");
+
+    /* Initialize LTE link controller */
+    err = lte_lc_init();
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_LTE "Failed to initialize LTE link controller, error: %d", err);
+        return err;
+    }
+
+    /* Configure modem for LTE-M/NB-IoT */
+    err = lte_lc_system_mode_set(LTE_LC_SYSTEM_MODE_LTEM_GPS,
+                                 LTE_LC_SYSTEM_MODE_PREFER_LTEM);
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_LTE "Failed to set system mode, error: %d", err);
+        return err;
+    }
+
+    /* The modem library leaves the modem powered off, which also allows
+     * writing credentials, so no mode switch is needed before attaching
+     */
+
+    /* Register event handler */
+    lte_lc_register_handler(lte_handler);
+
+    return 0;
+}
+
+int lte_manager_attach(void)
+{
+    int err;
+
+    /* Power saving is negotiated during attach, so request it first */
+    err = request_power_saving();
+    if (err)
+    {
+        return err;
+    }
+
+    LOG_INF(LOG_PREFIX_LTE "Attaching to the network...");
+
+    /* Registration is reported to lte_handler */
+    err = lte_lc_connect_async(lte_handler);
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_LTE "Failed to connect to LTE network, error: %d", err);
+        return err;
+    }
+
+    return 0;
+}
+
+int lte_manager_detach(void)
+{
+    int err;
+
+    LOG_INF(LOG_PREFIX_LTE "Detaching from the network");
+
+    err = lte_lc_offline();
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_LTE "Failed to set modem offline: %d", err);
+        return err;
+    }
+
+    /* The modem reports no status change when taken offline */
+    set_registered(false);
+
+    k_mutex_lock(&lte_mutex, K_FOREVER);
+    rrc_connected = false;
+    k_mutex_unlock(&lte_mutex);
+
+    return 0;
+}
+
+bool lte_manager_registered(void)
+{
+    bool result;
+
+    k_mutex_lock(&lte_mutex, K_FOREVER);
+    result = registered;
+    k_mutex_unlock(&lte_mutex);
+
+    return result;
+}
+
+void lte_manager_set_event_handler(lte_manager_evt_cb_t handler)
+{
+    k_mutex_lock(&lte_mutex, K_FOREVER);
+    event_handler = handler;
+    k_mutex_unlock(&lte_mutex);
+}
+
+int lte_manager_imei(char *buf, size_t len)
+{
+    int ret;
+
+    if (len < LTE_MANAGER_IMEI_LEN + 1)
+    {
+        return -ENOMEM;
+    }
+
+    /* AT+CGSN answers with the bare IMEI */
+    ret = nrf_modem_at_scanf("AT+CGSN", "%15[0-9]", buf);
+    if (ret != 1)
+    {
+        LOG_ERR(LOG_PREFIX_LTE "Failed to read IMEI: %d", ret);
+        return ret < 0 ? ret : -EBADMSG;
+    }
+
+    return 0;
+}
+
+uint16_t lte_manager_keepalive(void)
+{
+    int tau;
+    int active;
+
+    k_mutex_lock(&lte_mutex, K_FOREVER);
+    tau = granted_tau;
+    active = granted_active;
+    k_mutex_unlock(&lte_mutex);
+
+    /* Without PSM the modem idles in DRX and a ping is cheap */
+    if (tau <= 0 || active < 0)
+    {
+        return CONFIG_MQTT_KEEPALIVE;
+    }
+
+    /* Every transfer restarts the TAU timer, so a ping just before it is
+     * due replaces the TAU instead of adding a second wakeup
+     */
+    return CLAMP(tau - KEEPALIVE_TAU_MARGIN_S, CONFIG_MQTT_KEEPALIVE,
+                 CONFIG_ELFRYD_LTE_KEEPALIVE_MAX);
+}
+
+int lte_manager_release(int sock)
+{
+#ifdef CONFIG_ELFRYD_LTE_RAI
+    int rai = RAI_NO_DATA;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_RAI, &rai, sizeof(rai)) < 0)
+    {
+        LOG_WRN(LOG_PREFIX_LTE "Failed to set release assistance: %d", errno);
+        return -errno;
+    }
+
+    LOG_DBG(LOG_PREFIX_LTE "Released RRC connection");
+#else
+    ARG_UNUSED(sock);
+#endif
+
+    return 0;
+}
+
+bool lte_manager_rrc_connected(void)
+{
+    bool connected;
+
+    k_mutex_lock(&lte_mutex, K_FOREVER);
+    connected = rrc_connected;
+    k_mutex_unlock(&lte_mutex);
+
+    return connected;
+}
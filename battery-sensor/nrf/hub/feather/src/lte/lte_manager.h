@@ -0,0 +1,121 @@
+/**
+ * @file lte_manager.h
+ * @brief Power-aware LTE link management
+ */
+
+#ifndef LTE_MANAGER_H
+#define LTE_MANAGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Length of an IMEI, without the terminating NUL */
+#define LTE_MANAGER_IMEI_LEN 15
+
+/** Link events reported to the handler set with lte_manager_set_event_handler */
+typedef enum
+{
+    LTE_MANAGER_EVT_REGISTERED,   /* Registered with the home or a roaming network */
+    LTE_MANAGER_EVT_DEREGISTERED, /* Registration lost, the modem searches for a cell */
+    LTE_MANAGER_EVT_CELL_CHANGED, /* The modem moved to another cell */
+} lte_manager_evt_t;
+
+/**
+ * Callback for link events
+ *
+ * Called from the LTE link controller's context, so it must not block.
+ *
+ * @param evt Event that occurred
+ */
+typedef void (*lte_manager_evt_cb_t)(lte_manager_evt_t evt);
+
+/**
+ * Initialize the LTE link controller
+ *
+ * Selects LTE-M and leaves the modem off as the modem library started it,
+ * so credentials can be written before lte_manager_attach brings it to the
+ * network.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int lte_manager_init(void);
+
+/**
+ * Start attaching to the network with the configured power saving parameters
+ *
+ * Requests PSM with the configured periodic TAU and active time, eDRX if
+ * configured, and release assistance, then brings the modem online and
+ * returns without waiting. LTE_MANAGER_EVT_REGISTERED follows once the
+ * network accepts the modem. The network may grant other timers than
+ * requested, the granted ones are reported through lte_manager_keepalive.
+ *
+ * @return 0 once the attach is under way, negative error code on failure
+ */
+int lte_manager_attach(void);
+
+/**
+ * Detach from the network and leave the modem offline
+ *
+ * Drops the PDN connection and every socket on it. Used to start over when
+ * the modem does not register or the network refuses connections.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int lte_manager_detach(void);
+
+/**
+ * Check whether the modem is registered with a network
+ *
+ * @return True while registered, false otherwise
+ */
+bool lte_manager_registered(void);
+
+/**
+ * Set the handler called on link events
+ *
+ * @param handler Handler to call, or NULL to disable notifications
+ */
+void lte_manager_set_event_handler(lte_manager_evt_cb_t handler);
+
+/**
+ * Read the modem's IMEI
+ *
+ * @param buf Buffer for the IMEI as a NUL terminated string
+ * @param len Size of the buffer, at least LTE_MANAGER_IMEI_LEN + 1
+ * @return    0 on success, negative error code on failure
+ */
+int lte_manager_imei(char *buf, size_t len);
+
+/**
+ * Get the MQTT keepalive that suits the granted power saving timers
+ *
+ * With PSM granted the keepalive ping is sent shortly before the periodic
+ * TAU would wake the modem, so an idle link costs one wakeup per TAU period
+ * instead of one per CONFIG_MQTT_KEEPALIVE.
+ *
+ * @return Keepalive in seconds, CONFIG_MQTT_KEEPALIVE without PSM
+ */
+uint16_t lte_manager_keepalive(void);
+
+/**
+ * Tell the network no more data is expected on a socket
+ *
+ * Sets the release assistance indication, so the network releases the RRC
+ * connection at once instead of after its inactivity timer and the modem
+ * can enter PSM or eDRX sleep. Does nothing unless CONFIG_ELFRYD_LTE_RAI is
+ * enabled.
+ *
+ * @param sock Socket whose exchange is complete
+ * @return     0 on success, negative error code on failure
+ */
+int lte_manager_release(int sock);
+
+/**
+ * Check whether the modem holds an RRC connection
+ *
+ * @return True while RRC connected, false while idle or asleep
+ */
+bool lte_manager_rrc_connected(void);
+
+#endif /* LTE_MANAGER_H */
@@ -10,7 +10,6 @@ LOG_MODULE_REGISTER(elfryd_hub, LOG_LEVEL_INF);
 #define LOG_MODULE_NAME elfryd_hub
 #define LOG_PREFIX_MAIN "[MAIN] "
 #define LOG_PREFIX_MQTT "[MQTT] "
-#define LOG_PREFIX_SENS "[SENS] "
 #define LOG_PREFIX_TIME "[TIME] "
 #define LOG_PREFIX_LTE "[LTE] "
 
@@ -23,93 +22,70 @@ LOG_MODULE_REGISTER(elfryd_hub, LOG_LEVEL_INF);
 #include "mqtt/mqtt_client.h"
 #include "mqtt/mqtt_publishers.h"
 #include "utils/utils.h"
-
-/* Configuration for sensor data generation */
-#define MAIN_LOOP_INTERVAL_MS 1000
+#include "utils/boot_phases.h"
+#include "metrics/metrics.h"
+#include "scheduler/sensor_scheduler.h"
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+#include "storage/offline_store.h"
+#endif
 
 /* Thread stacks and definitions */
 #define STACK_SIZE 4096
 #define MQTT_THREAD_PRIORITY 5
-#define SENSOR_THREAD_PRIORITY 6
 #define TIME_THREAD_PRIORITY 4
 #define PUBLISHER_THREAD_PRIORITY 5
+#define ALARM_STACK_SIZE 2048
+#define ALARM_THREAD_PRIORITY 4
 
-/* Types of data to publish */
-typedef enum
-{
-    PUBLISH_TYPE_BATTERY,
-    PUBLISH_TYPE_TEMP,
-    PUBLISH_TYPE_GYRO,
-    PUBLISH_TYPE_CONFIG
-} publish_type_t;
+/* Time between attempts to publish an alarm that could not be queued */
+#define ALARM_RETRY_MS 1000
+
+/* Time between attempts to publish the boot record that could not be queued */
+#define BOOT_RECORD_RETRY_MS 1000
+
+/* The boot record goes out with the first publish, or this long after boot
+ * if that has not happened yet, with the phases still running as -1
+ */
+#define BOOT_RECORD_TIMEOUT_S 300
+
+#ifdef CONFIG_ELFRYD_METRICS
+/* Time between metrics snapshots */
+#define METRICS_INTERVAL_MS (CONFIG_ELFRYD_METRICS_INTERVAL * MSEC_PER_SEC)
+#endif
 
 /* Message structure for publish queue */
 typedef struct
 {
-    publish_type_t type;
-    int64_t timestamp;
-    int count;
+    config_param_t sensor; /* Sensor type that is due, see sensors_channel_param */
 } publish_msg_t;
 
 static K_THREAD_STACK_DEFINE(mqtt_thread_stack, STACK_SIZE);
 static struct k_thread mqtt_thread_data;
 
-static K_THREAD_STACK_DEFINE(sensor_thread_stack, STACK_SIZE);
-static struct k_thread sensor_thread_data;
-
 static K_THREAD_STACK_DEFINE(time_thread_stack, STACK_SIZE);
 static struct k_thread time_thread_data;
 
 static K_THREAD_STACK_DEFINE(publisher_thread_stack, STACK_SIZE);
 static struct k_thread publisher_thread_data;
 
+#ifdef CONFIG_ELFRYD_ALARMS
+static K_THREAD_STACK_DEFINE(alarm_thread_stack, ALARM_STACK_SIZE);
+static struct k_thread alarm_thread_data;
+#endif
+
 /* Semaphore for signaling when date/time is synchronized */
 K_SEM_DEFINE(date_time_ready, 0, 1);
-K_SEM_DEFINE(lte_ready, 0, 1);
 
 /* Message queue for publishing operations */
 K_MSGQ_DEFINE(publish_msgq, sizeof(publish_msg_t), 10, 4);
 
-/* Static buffers for readings to avoid stack allocations */
-static battery_reading_t static_battery_readings[MAX_BATTERY_SAMPLES];
-static temp_reading_t static_temp_readings[MAX_TEMP_SAMPLES];
-static gyro_reading_t static_gyro_readings[MAX_GYRO_SAMPLES];
-
-/* Timers for tracking when to publish data */
-static int64_t last_battery_publish_time;
-static int64_t last_temp_publish_time;
-static int64_t last_gyro_publish_time;
-
-/* Variables for storing the latest sensor readings */
-#ifdef CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR
-static battery_reading_t latest_battery_reading;
-static int battery_count_cached = 0;
-#endif
-
-#ifdef CONFIG_ELFRYD_ENABLE_TEMP_SENSOR
-static temp_reading_t latest_temp_reading;
-static int temp_count_cached = 0;
-#endif
-
-#ifdef CONFIG_ELFRYD_ENABLE_GYRO_SENSOR
-static gyro_reading_t latest_gyro_reading;
-static int gyro_count_cached = 0;
-#endif
-
-/* External flags for immediate publishing - these definitions need to match
- * the extern declarations in config_module.c
- */
-K_MUTEX_DEFINE(publish_flags_mutex);
-bool battery_publish_request = false;
-bool temp_publish_request = false;
-bool gyro_publish_request = false;
+/* Cursors tracking the next stored reading to publish per channel */
+static sensor_cursor_t cursors[SENSOR_CHANNEL_COUNT];
 
 /* MQTT processing thread function */
 static void mqtt_thread_fn(void *arg1, void *arg2, void *arg3)
 {
     int err;
-    int retry_count = 0;
-    int max_retries = 5;
 
     ARG_UNUSED(arg1);
     ARG_UNUSED(arg2);
@@ -117,6 +93,19 @@ static void mqtt_thread_fn(void *arg1, void *arg2, void *arg3)
 
     LOG_INF(LOG_PREFIX_MQTT "MQTT thread started");
 
+    /* Started here rather than in main, so sensors and the offline store
+     * come up while the modem boots
+     */
+    err = nrf_modem_lib_init();
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_MAIN "Failed to initialize modem library: %d", err);
+        return;
+    }
+
+    LOG_INF(LOG_PREFIX_MAIN "Modem library initialized");
+    boot_phase_done(BOOT_PHASE_MODEM);
+
     /* Initialize MQTT client */
     err = elfryd_mqtt_client_init();
     if (err)
@@ -125,49 +114,157 @@ static void mqtt_thread_fn(void *arg1, void *arg2, void *arg3)
         return;
     }
 
-    /* Connect to the MQTT broker with retries */
-    do
+    /* Main MQTT processing loop, brings the connection up and keeps it up,
+     * and sleeps until there is input, a queued publish, a modem event or
+     * a timer due
+     */
+    while (1)
     {
-        err = mqtt_client_connect();
-        if (err)
+        err = mqtt_client_process(SYS_FOREVER_MS);
+        if (err && err != -ENOTCONN && err != -EAGAIN)
         {
-            LOG_WRN(LOG_PREFIX_MQTT "Failed to connect to MQTT broker, retrying (%d/%d): %d",
-                    retry_count + 1, max_retries, err);
-            k_sleep(K_SECONDS(5));
+            LOG_ERR(LOG_PREFIX_MQTT "Error in MQTT processing: %d", err);
         }
-    } while (err && ++retry_count < max_retries);
+    }
+}
 
-    if (err)
+/* Publish stored readings of one channel in as many chunks as needed */
+static void publish_stored_readings(sensor_channel_t channel)
+{
+    const char *name = sensors_channel_name(channel);
+    sensor_cursor_t *cursor = &cursors[channel];
+    int err;
+    int pending;
+    int published = 0;
+    int chunks = 0;
+
+#ifndef CONFIG_ELFRYD_OFFLINE_STORE
+    /* Without the offline store readings wait in RAM for the next attempt */
+    if (!mqtt_client_is_connected())
     {
-        LOG_ERR(LOG_PREFIX_MQTT "Failed to connect to MQTT broker after %d attempts", max_retries);
+        LOG_WRN(LOG_PREFIX_MAIN "MQTT not connected, skipping %s publish", name);
         return;
     }
+#endif
 
-    /* Main MQTT processing loop */
-    while (1)
+    /* Only drain what is stored now, readings added meanwhile go out next time */
+    pending = sensors_get_count(channel);
+    if (pending == 0)
+    {
+        /* Sensor types with several channels often have nothing on some */
+        LOG_DBG(LOG_PREFIX_MAIN "No %s readings to publish", name);
+        return;
+    }
+
+    while (published < pending)
     {
-        /* Process MQTT events */
-        err = mqtt_client_process(1000);
-        if (err && err != -EAGAIN)
+        /* Serialize straight from the sensor store, one reading at a time */
+        err = mqtt_client_publish_channel(channel, cursor);
+        if (err == -ENODATA)
         {
-            LOG_ERR(LOG_PREFIX_MQTT "Error in MQTT processing: %d", err);
+            break;
+        }
+        else if (err)
+        {
+            LOG_ERR(LOG_PREFIX_MAIN "Failed to publish %s data: %d", name, err);
+            break;
+        }
+
+        /* The chunk's readings are released once the broker acknowledges it */
+        cursor->start += cursor->count;
+        published += cursor->count;
+        chunks++;
+    }
+
+    LOG_INF(LOG_PREFIX_MAIN "Published %d %s readings in %d chunks", published, name, chunks);
+}
+
+/* Publish every channel that is due with a sensor type */
+static void publish_sensor_type(config_param_t sensor)
+{
+    for (int i = 0; i < SENSOR_CHANNEL_COUNT; i++)
+    {
+        if (sensors_channel_param(i) == sensor)
+        {
+            publish_stored_readings(i);
+        }
+    }
+}
+
+#ifdef CONFIG_ELFRYD_COALESCE
+/* Channels published with a sensor type, as a mask of sensor channels */
+static uint32_t due_channels(config_param_t sensor)
+{
+    uint32_t channels = 0;
+
+    for (int i = 0; i < SENSOR_CHANNEL_COUNT; i++)
+    {
+        if (sensors_channel_param(i) == sensor && sensors_get_count(i) > 0)
+        {
+            channels |= BIT(i);
+        }
+    }
+
+    return channels;
+}
+
+/* Publish stored readings of several channels in as few frames as they fit */
+static void publish_coalesced(uint32_t channels)
+{
+    int pending[SENSOR_CHANNEL_COUNT] = {0};
+    int published[SENSOR_CHANNEL_COUNT] = {0};
+    int total = 0;
+    int frames = 0;
+    int err;
+
+    /* Only drain what is stored now, readings added meanwhile go out next time */
+    for (int i = 0; i < SENSOR_CHANNEL_COUNT; i++)
+    {
+        if (channels & BIT(i))
+        {
+            pending[i] = sensors_get_count(i);
+        }
+    }
 
-            /* Try to reconnect */
-            if (!mqtt_client_is_connected())
+    while (channels)
+    {
+        err = mqtt_client_publish_frame(channels, cursors);
+        if (err == -ENODATA)
+        {
+            break;
+        }
+        else if (err)
+        {
+            LOG_ERR(LOG_PREFIX_MAIN "Failed to publish frame: %d", err);
+            break;
+        }
+
+        /* Each section's readings are released once the broker acknowledges the frame */
+        for (int i = 0; i < SENSOR_CHANNEL_COUNT; i++)
+        {
+            if (!(channels & BIT(i)))
             {
-                LOG_INF(LOG_PREFIX_MQTT "Attempting to reconnect to MQTT broker");
-                mqtt_client_connect();
+                continue;
             }
-        }
 
-        k_sleep(K_MSEC(100));
+            cursors[i].start += cursors[i].count;
+            published[i] += cursors[i].count;
+            total += cursors[i].count;
+            if (published[i] >= pending[i])
+            {
+                channels &= ~BIT(i);
+            }
+        }
+        frames++;
     }
+
+    LOG_INF(LOG_PREFIX_MAIN "Published %d readings in %d frames", total, frames);
 }
+#endif
 
 /* Publisher thread function */
 static void publisher_thread_fn(void *arg1, void *arg2, void *arg3)
 {
-    int err;
     publish_msg_t msg;
 
     ARG_UNUSED(arg1);
@@ -176,128 +273,88 @@ static void publisher_thread_fn(void *arg1, void *arg2, void *arg3)
 
     LOG_INF(LOG_PREFIX_MAIN "Publisher thread started");
 
+    /* Batches replayed from the offline store need it mounted */
+    boot_wait_for(BOOT_DEP(STORE));
+
     while (1)
     {
-        /* Wait for a publish message */
-        if (k_msgq_get(&publish_msgq, &msg, K_SECONDS(1)) == 0)
+        k_timeout_t timeout = K_FOREVER;
+
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+        /* Keep draining the offline store once a second while it has batches */
+        if (offline_store_has_pending())
         {
-            /* Handle different types of publish requests */
-            switch (msg.type)
-            {
-            case PUBLISH_TYPE_BATTERY:
-            {
-                LOG_INF(LOG_PREFIX_MAIN "Processing battery publish request");
-                /* Use static buffer instead of stack allocation */
-                int count = sensors_get_battery_readings(static_battery_readings, MAX_BATTERY_SAMPLES);
+            timeout = K_SECONDS(1);
+        }
+#endif
 
-                if (count > 0)
-                {
-                    if (mqtt_client_is_connected())
-                    {
-                        err = mqtt_client_publish_battery(static_battery_readings, count);
-                        if (err)
-                        {
-                            LOG_ERR(LOG_PREFIX_MAIN "Failed to publish battery data: %d", err);
-                        }
-                        else
-                        {
-                            LOG_INF(LOG_PREFIX_MAIN "Published %d battery readings", count);
-                            sensors_clear_battery_readings();
-                        }
-                    }
-                    else
-                    {
-                        LOG_WRN(LOG_PREFIX_MAIN "MQTT not connected, skipping battery publish");
-                    }
-                }
-                else
-                {
-                    LOG_WRN(LOG_PREFIX_MAIN "No battery readings to publish");
-                }
-            }
-            break;
+        /* Sleep until a sensor type is due, nothing else needs this thread */
+        if (k_msgq_get(&publish_msgq, &msg, timeout) == 0)
+        {
+            LOG_INF(LOG_PREFIX_MAIN "Processing publish request for sensor type %d", msg.sensor);
 
-            case PUBLISH_TYPE_TEMP:
+#ifdef CONFIG_ELFRYD_COALESCE
+            /* Sensor types queued along with this one share its frames. Chunks
+             * that cannot go out now take the usual path to the offline store.
+             */
+            if (mqtt_client_is_connected())
             {
-                LOG_INF(LOG_PREFIX_MAIN "Processing temperature publish request");
-                /* Use static buffer instead of stack allocation */
-                int count = sensors_get_temp_readings(static_temp_readings, MAX_TEMP_SAMPLES);
+                uint32_t channels = due_channels(msg.sensor);
 
-                if (count > 0)
+                while (k_msgq_get(&publish_msgq, &msg, K_NO_WAIT) == 0)
                 {
-                    if (mqtt_client_is_connected())
-                    {
-                        err = mqtt_client_publish_temp(static_temp_readings, count);
-                        if (err)
-                        {
-                            LOG_ERR(LOG_PREFIX_MAIN "Failed to publish temperature data: %d", err);
-                        }
-                        else
-                        {
-                            LOG_INF(LOG_PREFIX_MAIN "Published %d temperature readings", count);
-                            sensors_clear_temp_readings();
-                        }
-                    }
-                    else
-                    {
-                        LOG_WRN(LOG_PREFIX_MAIN "MQTT not connected, skipping temperature publish");
-                    }
+                    channels |= due_channels(msg.sensor);
                 }
-                else
-                {
-                    LOG_WRN(LOG_PREFIX_MAIN "No temperature readings to publish");
-                }
-            }
-            break;
 
-            case PUBLISH_TYPE_GYRO:
+                publish_coalesced(channels);
+            }
+            else
             {
-                LOG_INF(LOG_PREFIX_MAIN "Processing gyroscope publish request");
-                /* Use static buffer instead of stack allocation */
-                int count = sensors_get_gyro_readings(static_gyro_readings, MAX_GYRO_SAMPLES);
-
-                if (count > 0)
-                {
-                    if (mqtt_client_is_connected())
-                    {
-                        err = mqtt_client_publish_gyro(static_gyro_readings, count);
-                        if (err)
-                        {
-                            LOG_ERR(LOG_PREFIX_MAIN "Failed to publish gyroscope data: %d", err);
-                        }
-                        else
-                        {
-                            LOG_INF(LOG_PREFIX_MAIN "Published %d gyroscope readings", count);
-                            sensors_clear_gyro_readings();
-                        }
-                    }
-                    else
-                    {
-                        LOG_WRN(LOG_PREFIX_MAIN "MQTT not connected, skipping gyroscope publish");
-                    }
-                }
-                else
-                {
-                    LOG_WRN(LOG_PREFIX_MAIN "No gyroscope readings to publish");
-                }
+                publish_sensor_type(msg.sensor);
             }
-            break;
-
-            case PUBLISH_TYPE_CONFIG:
-                /* Handle config publish requests */
-                /* This would handle publishing config confirmations */
-                break;
+#else
+            publish_sensor_type(msg.sensor);
+#endif
+        }
 
-            default:
-                LOG_WRN(LOG_PREFIX_MAIN "Unknown publish type: %d", msg.type);
-                break;
-            }
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+        /* Drain batches kept in flash during a coverage gap, a few at a time */
+        if (mqtt_client_is_connected() && offline_store_has_pending())
+        {
+            mqtt_client_publish_offline_batches(CONFIG_ELFRYD_OFFLINE_STORE_REPLAY_BURST);
         }
+#endif
+    }
+}
+
+#ifdef CONFIG_ELFRYD_ALARMS
+/* Alarm thread function, publishes alarms as soon as they are detected
+ * instead of waiting for the publisher thread to get through its batches
+ */
+static void alarm_thread_fn(void *arg1, void *arg2, void *arg3)
+{
+    alarm_event_t event;
+    int err;
+
+    ARG_UNUSED(arg1);
+    ARG_UNUSED(arg2);
+    ARG_UNUSED(arg3);
+
+    LOG_INF(LOG_PREFIX_MAIN "Alarm thread started");
 
-        /* Sleep a short while if no messages to process */
-        k_sleep(K_MSEC(100));
+    while (1)
+    {
+        alarms_get_event(&event, K_FOREVER);
+
+        /* Keep trying while disconnected or earlier priority messages await their acks */
+        while ((err = mqtt_client_publish_alarm(&event)) != 0)
+        {
+            LOG_DBG(LOG_PREFIX_MAIN "Alarm not queued, retrying: %d", err);
+            k_sleep(K_MSEC(ALARM_RETRY_MS));
+        }
     }
 }
+#endif
 
 /* Date time event handler */
 static void date_time_event_handler(const struct date_time_evt *evt)
@@ -328,7 +385,6 @@ static void date_time_event_handler(const struct date_time_evt *evt)
 static void time_thread_fn(void *arg1, void *arg2, void *arg3)
 {
     int err;
-    uint64_t ts = 0;
 
     ARG_UNUSED(arg1);
     ARG_UNUSED(arg2);
@@ -336,6 +392,9 @@ static void time_thread_fn(void *arg1, void *arg2, void *arg3)
 
     LOG_INF(LOG_PREFIX_TIME "Time synchronization thread started");
 
+    /* Runs alongside the attach, the modem delivers network time on registration */
+    boot_phase_wait(BOOT_PHASE_TIME);
+
     /* Force time update */
     LOG_INF(LOG_PREFIX_TIME "Requesting time update");
     err = date_time_update_async(date_time_event_handler);
@@ -345,340 +404,127 @@ static void time_thread_fn(void *arg1, void *arg2, void *arg3)
         return;
     }
 
-    /* Wait for time synchronization */
+    /* Sampling already runs on uptime timestamps, this only anchors them
+     * to UTC. Later updates from the date_time library re-anchor the offset.
+     */
     LOG_INF(LOG_PREFIX_TIME "Waiting for time synchronization");
-    k_sem_take(&date_time_ready, K_FOREVER);
-
-    /* Notify the system that time is now synchronized */
-    utils_notify_time_synchronized();
-
-    LOG_INF(LOG_PREFIX_TIME "Time sync complete, entering time tracking loop");
 
-    /* Main time tracking loop */
     while (1)
     {
-        /* Get the current time */
-        err = date_time_now(&ts);
-        if (err)
-        {
-            LOG_ERR(LOG_PREFIX_TIME "Unable to get date & time: %d", err);
-        }
-        else
-        {
-            /* Convert to seconds and log */
-            ts = ts / 1000;
-            LOG_INF(LOG_PREFIX_TIME "UTC Unix Epoch: %lld", ts);
-        }
+        k_sem_take(&date_time_ready, K_FOREVER);
 
-        /* Time updates are handled automatically by date_time library according to:
-         * - TIME_AUTO_UPDATE setting
-         * - TIME_UPDATE_INTERVAL_SECONDS for regular updates
-         * - TIME_TOO_OLD_SECONDS for staleness checks
-         */
+        /* Notify the system that time is now synchronized */
+        utils_notify_time_synchronized();
+        LOG_INF(LOG_PREFIX_TIME "UTC Unix Epoch: %lld", utils_get_timestamp());
+        boot_phase_done(BOOT_PHASE_TIME);
 
-        k_sleep(K_SECONDS(5)); /* Update time display every 5 seconds */
+        /* Readings taken before the first sync can now be published */
+        sensors_timestamps_synchronized();
     }
 }
 
-/* Sensor data collection thread function */
-static void sensor_thread_fn(void *arg1, void *arg2, void *arg3)
-{
-    int err;
-    publish_msg_t msg;
-    int i2c_read_counter = 0;  /* Counter to track when to read I2C data */
-    const int I2C_READ_INTERVAL = CONFIG_SENSOR_I2C_READ_INTERVAL;  /* Read I2C data based on config */
-
-    ARG_UNUSED(arg1);
-    ARG_UNUSED(arg2);
-    ARG_UNUSED(arg3);
-
-    LOG_INF(LOG_PREFIX_SENS "Sensor thread started");
-    LOG_INF(LOG_PREFIX_SENS "I2C read interval set to %d seconds", I2C_READ_INTERVAL);
-
-    /* Initialize sensors */
-    sensors_init();
+#ifdef CONFIG_ELFRYD_BOOT_RECORD
+static void boot_record_work_fn(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(boot_record_work, boot_record_work_fn);
 
-    /* Get the current time */
-    int64_t current_time = utils_get_timestamp();
-
-    /* Get intervals */
-    int battery_interval = config_get_battery_interval();
-    int temp_interval = config_get_temp_interval();
-    int gyro_interval = config_get_gyro_interval();
-
-    /* Initialize last publish timestamps to ensure we wait a full interval before first publish */
-    last_battery_publish_time = current_time;
-    last_temp_publish_time = current_time;
-    last_gyro_publish_time = current_time;
-
-    LOG_INF(LOG_PREFIX_SENS "Waiting for first interval before publishing data");
-    LOG_INF(LOG_PREFIX_SENS "Intervals (seconds) - Battery: %d, Temp: %d, Gyro: %d",
-            battery_interval, temp_interval, gyro_interval);
-    
-#ifdef CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR
-    LOG_INF(LOG_PREFIX_SENS "System configured for %d batteries", NUM_BATTERIES);
-#else
-    LOG_INF(LOG_PREFIX_SENS "Battery sensor disabled in config");
-#endif
+/* Set once the boot record is queued, system work queue only */
+static bool boot_record_sent;
 
-#ifndef CONFIG_ELFRYD_ENABLE_TEMP_SENSOR
-    LOG_INF(LOG_PREFIX_SENS "Temperature sensor disabled in config");
-#endif
+/* Publish the boot timing record once, with whatever phases are done by then */
+static void boot_record_work_fn(struct k_work *work)
+{
+    int err;
 
-#ifndef CONFIG_ELFRYD_ENABLE_GYRO_SENSOR
-    LOG_INF(LOG_PREFIX_SENS "Gyroscope sensor disabled in config");
-#endif
+    ARG_UNUSED(work);
 
-    /* Main sensor processing loop */
-    while (1)
+    if (boot_record_sent)
     {
-        current_time = utils_get_timestamp();
-
-        /* Only read from I2C sensors every I2C_READ_INTERVAL iterations */
-        bool should_read_i2c = (i2c_read_counter == 0);
-
-#ifdef CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR
-        /* Generate new battery sensor data */
-        if (sensors_using_i2c()) {
-            if (should_read_i2c) {
-                /* More efficient approach - read all battery data at once when using I2C */
-                err = sensors_generate_all_battery_readings();
-                if (err < 0 && err != -EAGAIN) {
-                    LOG_ERR(LOG_PREFIX_SENS "Failed to generate battery readings: %d", err);
-                } else if (err > 0) {
-                    LOG_INF(LOG_PREFIX_SENS "Generated %d battery readings in a batch", err);
-                }
-            }
-        } else {
-            /* When not using I2C, use the individual approach to ensure consistent behavior */
-            for (int battery_id = 1; battery_id <= NUM_BATTERIES; battery_id++)
-            {
-                err = sensors_generate_battery_reading(battery_id);
-                if (err)
-                {
-                    LOG_ERR(LOG_PREFIX_SENS "Failed to generate battery reading for battery %d: %d",
-                            battery_id, err);
-                }
-            }
-        }
-
-        /* Get the latest battery reading and count for monitoring */
-        err = sensors_get_latest_battery_reading(&latest_battery_reading);
-        battery_count_cached = sensors_get_battery_reading_count();
-#endif
-
-#ifdef CONFIG_ELFRYD_ENABLE_TEMP_SENSOR
-        /* Generate temperature readings */
-        if (!sensors_using_i2c() || should_read_i2c) {
-            err = sensors_generate_temp_reading();
-            if (err)
-            {
-                LOG_ERR(LOG_PREFIX_SENS "Failed to generate temperature reading: %d", err);
-            }
-            else
-            {
-                err = sensors_get_latest_temp_reading(&latest_temp_reading);
-                temp_count_cached = sensors_get_temp_reading_count();
-            }
-        }
-#endif
-
-#ifdef CONFIG_ELFRYD_ENABLE_GYRO_SENSOR
-        /* Generate gyro readings */
-        if (!sensors_using_i2c() || should_read_i2c) {
-            err = sensors_generate_gyro_reading();
-            if (err)
-            {
-                LOG_ERR(LOG_PREFIX_SENS "Failed to generate gyroscope reading: %d", err);
-            }
-            else
-            {
-                err = sensors_get_latest_gyro_reading(&latest_gyro_reading);
-                gyro_count_cached = sensors_get_gyro_reading_count();
-            }
-        }
-#endif
-
-        /* Print monitoring information for debugging */
-#if defined(CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR) && defined(CONFIG_ELFRYD_ENABLE_TEMP_SENSOR) && defined(CONFIG_ELFRYD_ENABLE_GYRO_SENSOR)
-        LOG_INF(LOG_PREFIX_SENS "Array sizes - Battery: %d/%d, Temp: %d/%d, Gyro: %d/%d",
-                battery_count_cached, MAX_BATTERY_SAMPLES,
-                temp_count_cached, MAX_TEMP_SAMPLES,
-                gyro_count_cached, MAX_GYRO_SAMPLES);
-#elif defined(CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR) && defined(CONFIG_ELFRYD_ENABLE_TEMP_SENSOR)
-        LOG_INF(LOG_PREFIX_SENS "Array sizes - Battery: %d/%d, Temp: %d/%d",
-                battery_count_cached, MAX_BATTERY_SAMPLES,
-                temp_count_cached, MAX_TEMP_SAMPLES);
-#elif defined(CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR) && defined(CONFIG_ELFRYD_ENABLE_GYRO_SENSOR)
-        LOG_INF(LOG_PREFIX_SENS "Array sizes - Battery: %d/%d, Gyro: %d/%d",
-                battery_count_cached, MAX_BATTERY_SAMPLES,
-                gyro_count_cached, MAX_GYRO_SAMPLES);
-#elif defined(CONFIG_ELFRYD_ENABLE_TEMP_SENSOR) && defined(CONFIG_ELFRYD_ENABLE_GYRO_SENSOR)
-        LOG_INF(LOG_PREFIX_SENS "Array sizes - Temp: %d/%d, Gyro: %d/%d",
-                temp_count_cached, MAX_TEMP_SAMPLES,
-                gyro_count_cached, MAX_GYRO_SAMPLES);
-#elif defined(CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR)
-        LOG_INF(LOG_PREFIX_SENS "Array sizes - Battery: %d/%d",
-                battery_count_cached, MAX_BATTERY_SAMPLES);
-#elif defined(CONFIG_ELFRYD_ENABLE_TEMP_SENSOR)
-        LOG_INF(LOG_PREFIX_SENS "Array sizes - Temp: %d/%d",
-                temp_count_cached, MAX_TEMP_SAMPLES);
-#elif defined(CONFIG_ELFRYD_ENABLE_GYRO_SENSOR)
-        LOG_INF(LOG_PREFIX_SENS "Array sizes - Gyro: %d/%d",
-                gyro_count_cached, MAX_GYRO_SAMPLES);
-#else
-        LOG_INF(LOG_PREFIX_SENS "All sensor types disabled");
-#endif
-
-        /* Process immediate publish requests by sending messages to publisher thread */
-        k_mutex_lock(&publish_flags_mutex, K_FOREVER);
-
-        /* Process immediate publish requests even on first run,
-           as these are explicit user requests */
-#ifdef CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR
-        if (battery_publish_request)
-        {
-            msg.type = PUBLISH_TYPE_BATTERY;
-            msg.timestamp = current_time;
-            msg.count = battery_count_cached;
+        return;
+    }
 
-            /* Try to send the message without blocking */
-            err = k_msgq_put(&publish_msgq, &msg, K_NO_WAIT);
-            if (err)
-            {
-                LOG_WRN(LOG_PREFIX_SENS "Failed to queue battery publish request: %d", err);
-            }
-            else
-            {
-                LOG_INF(LOG_PREFIX_SENS "Queued immediate battery publish request");
-                battery_publish_request = false;
-            }
-        }
-#endif
+    err = mqtt_client_publish_boot_record();
+    if (err == -ENOTCONN)
+    {
+        /* Timed out before the broker was reached, the first publish
+         * after connecting schedules the record again
+         */
+        LOG_WRN(LOG_PREFIX_MAIN "Boot record held back until connected");
+        return;
+    }
+    else if (err)
+    {
+        LOG_DBG(LOG_PREFIX_MAIN "Boot record not queued, retrying: %d", err);
+        k_work_schedule(&boot_record_work, K_MSEC(BOOT_RECORD_RETRY_MS));
+        return;
+    }
 
-#ifdef CONFIG_ELFRYD_ENABLE_TEMP_SENSOR
-        if (temp_publish_request)
-        {
-            msg.type = PUBLISH_TYPE_TEMP;
-            msg.timestamp = current_time;
-            msg.count = temp_count_cached;
+    boot_record_sent = true;
+    LOG_INF(LOG_PREFIX_MAIN "Boot record published");
+}
 
-            /* Try to send the message without blocking */
-            err = k_msgq_put(&publish_msgq, &msg, K_NO_WAIT);
-            if (err)
-            {
-                LOG_WRN(LOG_PREFIX_SENS "Failed to queue temperature publish request: %d", err);
-            }
-            else
-            {
-                LOG_INF(LOG_PREFIX_SENS "Queued immediate temperature publish request");
-                temp_publish_request = false;
-            }
-        }
+/* Publish the boot record as soon as something reached the broker, a
+ * stalled phase must not hold back the record that shows it
+ */
+static void boot_phase_handler(boot_phase_t phase)
+{
+    if (phase == BOOT_PHASE_FIRST_PUBLISH)
+    {
+        k_work_reschedule(&boot_record_work, K_NO_WAIT);
+    }
+}
 #endif
 
-#ifdef CONFIG_ELFRYD_ENABLE_GYRO_SENSOR
-        if (gyro_publish_request)
-        {
-            msg.type = PUBLISH_TYPE_GYRO;
-            msg.timestamp = current_time;
-            msg.count = gyro_count_cached;
+#ifdef CONFIG_ELFRYD_METRICS
+static void metrics_work_fn(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(metrics_work, metrics_work_fn);
 
-            /* Try to send the message without blocking */
-            err = k_msgq_put(&publish_msgq, &msg, K_NO_WAIT);
-            if (err)
-            {
-                LOG_WRN(LOG_PREFIX_SENS "Failed to queue gyroscope publish request: %d", err);
-            }
-            else
-            {
-                LOG_INF(LOG_PREFIX_SENS "Queued immediate gyroscope publish request");
-                gyro_publish_request = false;
-            }
-        }
-#endif
-
-        k_mutex_unlock(&publish_flags_mutex);
+/* Publish a metrics snapshot every interval. Counters are cumulative, so a
+ * snapshot that cannot be published is not retried, the next one covers it.
+ */
+static void metrics_work_fn(struct k_work *work)
+{
+    int err;
 
-        /* Refresh the interval values (in case config changed) */
-        battery_interval = config_get_battery_interval();
-        temp_interval = config_get_temp_interval();
-        gyro_interval = config_get_gyro_interval();
+    ARG_UNUSED(work);
 
-        /* Check if it's time to publish battery data based on intervals */
-#ifdef CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR
-        if (battery_interval > 0 &&
-            (current_time - last_battery_publish_time) >= battery_interval)
-        {
-            /* Queue a battery publish request */
-            msg.type = PUBLISH_TYPE_BATTERY;
-            msg.timestamp = current_time;
-            msg.count = battery_count_cached;
+    err = mqtt_client_publish_metrics();
+    if (err)
+    {
+        LOG_DBG(LOG_PREFIX_MAIN "Metrics snapshot not published: %d", err);
+    }
 
-            err = k_msgq_put(&publish_msgq, &msg, K_NO_WAIT);
-            if (err)
-            {
-                LOG_WRN(LOG_PREFIX_SENS "Failed to queue battery interval publish: %d", err);
-            }
-            else
-            {
-                LOG_INF(LOG_PREFIX_SENS "Queued battery interval publish request");
-                last_battery_publish_time = current_time;
-            }
-        }
+    k_work_schedule(&metrics_work, K_MSEC(METRICS_INTERVAL_MS));
+}
 #endif
 
-        /* Check if it's time to publish temperature data */
-#ifdef CONFIG_ELFRYD_ENABLE_TEMP_SENSOR
-        if (temp_interval > 0 &&
-            (current_time - last_temp_publish_time) >= temp_interval)
-        {
-            /* Queue a temperature publish request */
-            msg.type = PUBLISH_TYPE_TEMP;
-            msg.timestamp = current_time;
-            msg.count = temp_count_cached;
+/* Hand a due sensor type to the publisher thread, called by the scheduler */
+static int queue_publish(config_param_t sensor)
+{
+    publish_msg_t msg = {.sensor = sensor};
+    bool has_channel = false;
+    int err;
 
-            err = k_msgq_put(&publish_msgq, &msg, K_NO_WAIT);
-            if (err)
-            {
-                LOG_WRN(LOG_PREFIX_SENS "Failed to queue temperature interval publish: %d", err);
-            }
-            else
-            {
-                LOG_INF(LOG_PREFIX_SENS "Queued temperature interval publish request");
-                last_temp_publish_time = current_time;
-            }
-        }
-#endif
+    for (int i = 0; i < SENSOR_CHANNEL_COUNT; i++)
+    {
+        has_channel |= sensors_channel_param(i) == sensor;
+    }
 
-        /* Check if it's time to publish gyroscope data */
-#ifdef CONFIG_ELFRYD_ENABLE_GYRO_SENSOR
-        if (gyro_interval > 0 &&
-            (current_time - last_gyro_publish_time) >= gyro_interval)
-        {
-            /* Queue a gyroscope publish request */
-            msg.type = PUBLISH_TYPE_GYRO;
-            msg.timestamp = current_time;
-            msg.count = gyro_count_cached;
+    if (!has_channel)
+    {
+        return -EINVAL;
+    }
 
-            err = k_msgq_put(&publish_msgq, &msg, K_NO_WAIT);
-            if (err)
-            {
-                LOG_WRN(LOG_PREFIX_SENS "Failed to queue gyroscope interval publish: %d", err);
-            }
-            else
-            {
-                LOG_INF(LOG_PREFIX_SENS "Queued gyroscope interval publish request");
-                last_gyro_publish_time = current_time;
-            }
-        }
-#endif
+    /* Never block the scheduler, a full queue already has work pending */
+    err = k_msgq_put(&publish_msgq, &msg, K_NO_WAIT);
+    if (err)
+    {
+        metrics_inc(METRIC_QUEUE_FULL);
+        return err;
+    }
 
-        /* Update I2C read counter */
-        i2c_read_counter = (i2c_read_counter + 1) % I2C_READ_INTERVAL;
+    metrics_max(METRIC_QUEUE_PEAK, k_msgq_num_used_get(&publish_msgq));
 
-        k_sleep(K_SECONDS(1)); /* Main loop still runs every second for timely response to commands */
-    }
+    return 0;
 }
 
 int main(void)
@@ -695,17 +541,21 @@ int main(void)
         return -1;
     }
 
-    /* We'll initialize only the modem library but not the LTE connection
-     * This allows the MQTT thread to set up the LTE connection with its specific settings
-     */
-    err = nrf_modem_lib_init();
-    if (err)
-    {
-        LOG_ERR(LOG_PREFIX_MAIN "Failed to initialize modem library: %d", err);
-        return -1;
-    }
+    /* Publishers must be listening for acks before anything is published */
+    mqtt_publishers_init();
+#ifdef CONFIG_ELFRYD_BOOT_RECORD
+    boot_set_phase_handler(boot_phase_handler);
+    k_work_schedule(&boot_record_work, K_SECONDS(BOOT_RECORD_TIMEOUT_S));
+#endif
 
-    LOG_INF(LOG_PREFIX_MAIN "Modem library initialized");
+    /* Start MQTT thread first, it has the longest way to go: modem, attach,
+     * DNS and connect. Every other phase runs while it waits on the network.
+     */
+    k_thread_create(&mqtt_thread_data, mqtt_thread_stack,
+                    K_THREAD_STACK_SIZEOF(mqtt_thread_stack),
+                    mqtt_thread_fn, NULL, NULL, NULL,
+                    MQTT_THREAD_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&mqtt_thread_data, "mqtt_thread");
 
     /* Start time synchronization thread */
     k_thread_create(&time_thread_data, time_thread_stack,
@@ -721,19 +571,40 @@ int main(void)
                     PUBLISHER_THREAD_PRIORITY, 0, K_NO_WAIT);
     k_thread_name_set(&publisher_thread_data, "publisher_thread");
 
-    /* Start MQTT thread */
-    k_thread_create(&mqtt_thread_data, mqtt_thread_stack,
-                    K_THREAD_STACK_SIZEOF(mqtt_thread_stack),
-                    mqtt_thread_fn, NULL, NULL, NULL,
-                    MQTT_THREAD_PRIORITY, 0, K_NO_WAIT);
-    k_thread_name_set(&mqtt_thread_data, "mqtt_thread");
+#ifdef CONFIG_ELFRYD_ALARMS
+    /* Start alarm thread */
+    k_thread_create(&alarm_thread_data, alarm_thread_stack,
+                    K_THREAD_STACK_SIZEOF(alarm_thread_stack),
+                    alarm_thread_fn, NULL, NULL, NULL,
+                    ALARM_THREAD_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&alarm_thread_data, "alarm_thread");
+#endif
 
-    /* Start sensor thread */
-    k_thread_create(&sensor_thread_data, sensor_thread_stack,
-                    K_THREAD_STACK_SIZEOF(sensor_thread_stack),
-                    sensor_thread_fn, NULL, NULL, NULL,
-                    SENSOR_THREAD_PRIORITY, 0, K_NO_WAIT);
-    k_thread_name_set(&sensor_thread_data, "sensor_thread");
+    /* Start sampling and interval publishing, readings are timestamped on
+     * uptime so sampling does not wait for time sync
+     */
+    err = sensor_scheduler_start(queue_publish);
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_MAIN "Failed to start sensor scheduler: %d", err);
+        return -1;
+    }
+    boot_phase_done(BOOT_PHASE_SENSORS);
+
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+    /* Batches stored before a reboot are replayed once connected */
+    err = offline_store_init();
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_MAIN "Failed to initialize offline store: %d", err);
+    }
+#endif
+    /* Done even without a store or when it failed, the publisher waits on it */
+    boot_phase_done(BOOT_PHASE_STORE);
+
+#ifdef CONFIG_ELFRYD_METRICS
+    k_work_schedule(&metrics_work, K_MSEC(METRICS_INTERVAL_MS));
+#endif
 
     LOG_INF(LOG_PREFIX_MAIN "Elfryd Hub initialized and running");
 
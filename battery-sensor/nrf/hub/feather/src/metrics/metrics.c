@@ -0,0 +1,173 @@
+/**
+ * @file metrics.c
+ * @brief Runtime counters, gauges and histograms implementation
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "metrics/metrics.h"
+
+#define METRIC_NAME(id, name) [METRIC_##id] = #name,
+static const char *const counter_names[METRIC_COUNTER_COUNT] = {
+    METRICS_COUNTERS(METRIC_NAME)
+};
+static const char *const gauge_names[METRIC_GAUGE_COUNT] = {
+    METRICS_GAUGES(METRIC_NAME)
+};
+static const char *const histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    METRICS_HISTOGRAMS(METRIC_NAME)
+};
+#undef METRIC_NAME
+
+/* Every metric is an atomic, so updating one never takes a lock. A
+ * snapshot may see some updates of a burst and miss others, which is
+ * fine for diagnostics.
+ */
+static atomic_t counters[METRIC_COUNTER_COUNT];
+static atomic_t gauges[METRIC_GAUGE_COUNT];
+static atomic_t histograms[METRIC_HISTOGRAM_COUNT][METRICS_HISTOGRAM_BUCKETS];
+
+/* Progress of a snapshot, shared with the thread callback */
+typedef struct
+{
+    char *buf;
+    size_t len;
+    size_t offset;
+    int err;
+} snapshot_t;
+
+void metrics_add(metric_counter_t counter, uint32_t value)
+{
+    if (counter < METRIC_COUNTER_COUNT)
+    {
+        atomic_add(&counters[counter], value);
+    }
+}
+
+void metrics_set(metric_gauge_t gauge, uint32_t value)
+{
+    if (gauge < METRIC_GAUGE_COUNT)
+    {
+        atomic_set(&gauges[gauge], value);
+    }
+}
+
+void metrics_max(metric_gauge_t gauge, uint32_t value)
+{
+    atomic_val_t old;
+
+    if (gauge >= METRIC_GAUGE_COUNT)
+    {
+        return;
+    }
+
+    do
+    {
+        old = atomic_get(&gauges[gauge]);
+        if ((uint32_t)old >= value)
+        {
+            return;
+        }
+    } while (!atomic_cas(&gauges[gauge], old, value));
+}
+
+void metrics_observe(metric_histogram_t histogram, uint32_t value)
+{
+    uint32_t bound = METRICS_HISTOGRAM_BASE;
+    int bucket = 0;
+
+    if (histogram >= METRIC_HISTOGRAM_COUNT)
+    {
+        return;
+    }
+
+    while (value >= bound && bucket < METRICS_HISTOGRAM_BUCKETS - 1)
+    {
+        bound <<= 1;
+        bucket++;
+    }
+
+    atomic_inc(&histograms[histogram][bucket]);
+}
+
+/* Append to a snapshot, remembering if anything did not fit */
+static void append(snapshot_t *snap, const char *fmt, ...)
+{
+    va_list args;
+    int written;
+
+    if (snap->err)
+    {
+        return;
+    }
+
+    va_start(args, fmt);
+    written = vsnprintf(snap->buf + snap->offset, snap->len - snap->offset, fmt, args);
+    va_end(args);
+
+    if (written < 0 || written >= snap->len - snap->offset)
+    {
+        snap->err = -ENOMEM;
+        return;
+    }
+
+    snap->offset += written;
+}
+
+/* Append the unused stack of a thread, called for every thread */
+static void append_stack(const struct k_thread *thread, void *user_data)
+{
+    snapshot_t *snap = user_data;
+    const char *name = k_thread_name_get((k_tid_t)thread);
+    size_t unused;
+
+    /* Unnamed threads could not be told apart in the snapshot */
+    if (name == NULL || name[0] == '\0')
+    {
+        return;
+    }
+
+    if (k_thread_stack_space_get(thread, &unused) == 0)
+    {
+        append(snap, ",stack.%s=%u", name, (unsigned int)unused);
+    }
+}
+
+int metrics_format(char *buf, size_t len)
+{
+    snapshot_t snap = {.buf = buf, .len = len};
+
+    if (len > 0)
+    {
+        buf[0] = '\0';
+    }
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        append(&snap, "%s%s=%u", i > 0 ? "," : "", counter_names[i],
+               (uint32_t)atomic_get(&counters[i]));
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        append(&snap, ",%s=%u", gauge_names[i], (uint32_t)atomic_get(&gauges[i]));
+    }
+
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        append(&snap, ",%s=", histogram_names[i]);
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++)
+        {
+            append(&snap, "%s%u", b > 0 ? "/" : "", (uint32_t)atomic_get(&histograms[i][b]));
+        }
+    }
+
+    /* Threads are only read, so the thread list need not be locked */
+    k_thread_foreach_unlocked(append_stack, &snap);
+
+    return snap.err ? snap.err : (int)snap.offset;
+}
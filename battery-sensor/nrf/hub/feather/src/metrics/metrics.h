@@ -0,0 +1,169 @@
+/**
+ * @file metrics.h
+ * @brief Runtime counters, gauges and histograms in fixed RAM
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Counters, X(id, name) for every counter
+ *
+ * Counters only grow and are never reset, so a consumer diffs two
+ * snapshots to get a rate. They wrap at 2^32.
+ */
+#define METRICS_COUNTERS(X)                   \
+    X(SENSOR_INSERTS, inserts)                \
+    X(SENSOR_EVICTIONS, evictions)            \
+    X(I2C_ERRORS, i2c_errors)                 \
+    X(QUEUE_FULL, queue_full)                 \
+    X(WINDOW_FULL, window_full)               \
+    X(PUBLISHES, publishes)                   \
+    X(PUBLISH_BYTES, publish_bytes)           \
+    X(PUBLISH_ERRORS, publish_errors)
+
+/**
+ * Gauges, X(id, name) for every gauge, holding the last value set or the
+ * highest value seen
+ */
+#define METRICS_GAUGES(X)                     \
+    X(UPTIME, uptime_s)                       \
+    X(QUEUE_PEAK, queue_peak)                 \
+    X(RECONNECTS, reconnects)                 \
+    X(MAX_RECOVERY, max_recovery_ms)
+
+/**
+ * Histograms, X(id, name) for every histogram
+ *
+ * Bucket 0 counts values below METRICS_HISTOGRAM_BASE, every following
+ * bucket doubles the bound, and the last bucket counts the rest.
+ */
+#define METRICS_HISTOGRAMS(X)                 \
+    X(PUBLISH_LATENCY, ack_ms)
+
+/** Buckets per histogram */
+#define METRICS_HISTOGRAM_BUCKETS 8
+
+/** Upper bound of the first histogram bucket */
+#define METRICS_HISTOGRAM_BASE 64
+
+/** Buffer size that fits a snapshot from metrics_format */
+#define METRICS_SNAPSHOT_SIZE 768
+
+/**
+ * Counters, generated from METRICS_COUNTERS
+ */
+typedef enum
+{
+#define METRIC_ID(id, name) METRIC_##id,
+    METRICS_COUNTERS(METRIC_ID)
+#undef METRIC_ID
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+/**
+ * Gauges, generated from METRICS_GAUGES
+ */
+typedef enum
+{
+#define METRIC_ID(id, name) METRIC_##id,
+    METRICS_GAUGES(METRIC_ID)
+#undef METRIC_ID
+    METRIC_GAUGE_COUNT
+} metric_gauge_t;
+
+/**
+ * Histograms, generated from METRICS_HISTOGRAMS
+ */
+typedef enum
+{
+#define METRIC_ID(id, name) METRIC_##id,
+    METRICS_HISTOGRAMS(METRIC_ID)
+#undef METRIC_ID
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+#ifdef CONFIG_ELFRYD_METRICS
+
+/**
+ * Add to a counter
+ *
+ * Lock-free, so it may be called from any context, including interrupts
+ * and with other locks held.
+ *
+ * @param counter Counter to add to
+ * @param value   Amount to add
+ */
+void metrics_add(metric_counter_t counter, uint32_t value);
+
+/**
+ * Set a gauge
+ *
+ * @param gauge Gauge to set
+ * @param value New value
+ */
+void metrics_set(metric_gauge_t gauge, uint32_t value);
+
+/**
+ * Raise a gauge to a value if it is higher, for high-water marks
+ *
+ * @param gauge Gauge to raise
+ * @param value Value seen
+ */
+void metrics_max(metric_gauge_t gauge, uint32_t value);
+
+/**
+ * Count a value in its histogram bucket
+ *
+ * @param histogram Histogram to count in
+ * @param value     Value seen
+ */
+void metrics_observe(metric_histogram_t histogram, uint32_t value);
+
+/**
+ * Format a snapshot of every metric and the free stack of every thread
+ *
+ * Format: "{name}={value},...,{histogram}={b0}/{b1}/...,stack.{thread}={bytes},..."
+ * with counters first, then gauges, histograms and the unused stack bytes
+ * of each named thread.
+ *
+ * @param buf Buffer to write to, METRICS_SNAPSHOT_SIZE fits every metric
+ * @param len Size of the buffer
+ * @return    Length written, or negative error code if it did not fit
+ */
+int metrics_format(char *buf, size_t len);
+
+#else
+
+static inline void metrics_add(metric_counter_t counter, uint32_t value)
+{
+}
+
+static inline void metrics_set(metric_gauge_t gauge, uint32_t value)
+{
+}
+
+static inline void metrics_max(metric_gauge_t gauge, uint32_t value)
+{
+}
+
+static inline void metrics_observe(metric_histogram_t histogram, uint32_t value)
+{
+}
+
+#endif /* CONFIG_ELFRYD_METRICS */
+
+/**
+ * Add one to a counter
+ *
+ * @param counter Counter to increment
+ */
+static inline void metrics_inc(metric_counter_t counter)
+{
+    metrics_add(counter, 1);
+}
+
+#endif /* METRICS_H */
@@ -0,0 +1,277 @@
+/**
+ * @file motion.c
+ * @brief Motion feature extraction implementation
+ *
+ * Readings are collected per axis over a window of MOTION_WINDOW_SAMPLES.
+ * When the window is full the mean is removed from every axis, and the RMS
+ * and peak of what remains describe how hard the hull moves. A radix-2 FFT
+ * in Q15 fixed point finds the dominant frequency of each axis, and the mean
+ * of the accelerometer axes gives the roll and pitch of the hull.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <stdlib.h>
+
+#include "motion/motion.h"
+#include "utils/utils.h"
+
+LOG_MODULE_REGISTER(motion, LOG_LEVEL_INF);
+#define LOG_PREFIX_MOTION "[MOTION] "
+
+BUILD_ASSERT((MOTION_WINDOW_SAMPLES & (MOTION_WINDOW_SAMPLES - 1)) == 0,
+             "Motion window must be a power of two");
+
+/* Points of the FFT the twiddle table is made for, the largest window */
+#define TWIDDLE_POINTS 128
+
+BUILD_ASSERT(MOTION_WINDOW_SAMPLES <= TWIDDLE_POINTS, "Motion window too large");
+
+/* FFT input is scaled below this so the butterflies cannot overflow */
+#define FFT_INPUT_BITS 14
+
+/* sin(2 * pi * k / TWIDDLE_POINTS) in Q15 for the first quarter wave */
+static const int16_t quarter_sine[TWIDDLE_POINTS / 4 + 1] = {
+    0, 1608, 3212, 4808, 6393, 7962, 9512, 11039,
+    12539, 14010, 15446, 16846, 18204, 19519, 20787, 22005,
+    23170, 24279, 25329, 26319, 27245, 28105, 28898, 29621,
+    30273, 30852, 31356, 31785, 32137, 32412, 32609, 32728,
+    32767,
+};
+
+/* Current window, only touched from the sampling thread */
+static int32_t samples[GYRO_AXES][MOTION_WINDOW_SAMPLES];
+static int filled;
+static int64_t window_start;  /* Timestamp of the first reading */
+static int64_t window_opened; /* Uptime of the first reading in ms */
+
+/* FFT work buffers, shared by all axes */
+static int32_t fft_re[MOTION_WINDOW_SAMPLES];
+static int32_t fft_im[MOTION_WINDOW_SAMPLES];
+
+/* Twiddle factor for an angle of 2 * pi * index / TWIDDLE_POINTS, index in
+ * the first half turn
+ */
+static void twiddle(int index, int32_t *cos_q15, int32_t *sin_q15)
+{
+    if (index <= TWIDDLE_POINTS / 4)
+    {
+        *sin_q15 = quarter_sine[index];
+        *cos_q15 = quarter_sine[TWIDDLE_POINTS / 4 - index];
+    }
+    else
+    {
+        *sin_q15 = quarter_sine[TWIDDLE_POINTS / 2 - index];
+        *cos_q15 = -quarter_sine[index - TWIDDLE_POINTS / 4];
+    }
+}
+
+/* In-place radix-2 decimation in time FFT. Every stage halves its output,
+ * so the result is the DFT divided by the window length and never
+ * overflows for inputs below 2^FFT_INPUT_BITS.
+ */
+static void fft(int32_t *re, int32_t *im, int n)
+{
+    /* Bit reversal permutation */
+    for (int i = 1, j = 0; i < n; i++)
+    {
+        int bit = n >> 1;
+
+        for (; j & bit; bit >>= 1)
+        {
+            j ^= bit;
+        }
+        j ^= bit;
+
+        if (i < j)
+        {
+            int32_t tmp;
+
+            tmp = re[i];
+            re[i] = re[j];
+            re[j] = tmp;
+            tmp = im[i];
+            im[i] = im[j];
+            im[j] = tmp;
+        }
+    }
+
+    for (int len = 2; len <= n; len <<= 1)
+    {
+        int half = len / 2;
+        int stride = TWIDDLE_POINTS / len;
+
+        for (int i = 0; i < n; i += len)
+        {
+            for (int k = 0; k < half; k++)
+            {
+                int a = i + k;
+                int b = a + half;
+                int32_t wr, wi, tr, ti;
+
+                /* Multiply by cos - j sin */
+                twiddle(k * stride, &wr, &wi);
+                tr = (re[b] * wr + im[b] * wi) >> 15;
+                ti = (im[b] * wr - re[b] * wi) >> 15;
+
+                re[b] = (re[a] - tr) >> 1;
+                im[b] = (im[a] - ti) >> 1;
+                re[a] = (re[a] + tr) >> 1;
+                im[a] = (im[a] + ti) >> 1;
+            }
+        }
+    }
+}
+
+/* Index of the strongest frequency bin above DC, or 0 for a flat signal */
+static int dominant_bin(const int32_t *deviation, int32_t peak)
+{
+    int shift = 0;
+    int best = 0;
+    int64_t best_power = 0;
+
+    while ((peak >> shift) >= (1 << FFT_INPUT_BITS))
+    {
+        shift++;
+    }
+
+    for (int i = 0; i < MOTION_WINDOW_SAMPLES; i++)
+    {
+        fft_re[i] = deviation[i] >> shift;
+        fft_im[i] = 0;
+    }
+
+    fft(fft_re, fft_im, MOTION_WINDOW_SAMPLES);
+
+    /* Real input, the upper half mirrors the lower */
+    for (int k = 1; k <= MOTION_WINDOW_SAMPLES / 2; k++)
+    {
+        int64_t power = (int64_t)fft_re[k] * fft_re[k] + (int64_t)fft_im[k] * fft_im[k];
+
+        if (power > best_power)
+        {
+            best_power = power;
+            best = k;
+        }
+    }
+
+    return best;
+}
+
+/* Arctangent of a ratio between 0 and 1 in Q15, in tenths of a degree,
+ * from atan(r) ~ 45r + 15.64r(1 - r) degrees, within about 0.3 degrees
+ */
+static int32_t atan_decidegrees(int64_t ratio_q15)
+{
+    return (int32_t)((4500 * ratio_q15 + 1564 * ratio_q15 * (32768 - ratio_q15) / 32768) /
+                     327680);
+}
+
+/* Four quadrant arctangent in tenths of a degree */
+static int16_t atan2_decidegrees(int64_t y, int64_t x)
+{
+    int64_t abs_y = llabs(y);
+    int64_t abs_x = llabs(x);
+    int32_t angle;
+
+    if (abs_x == 0 && abs_y == 0)
+    {
+        return 0;
+    }
+
+    if (abs_y <= abs_x)
+    {
+        angle = atan_decidegrees(abs_y * 32768 / abs_x);
+    }
+    else
+    {
+        angle = 900 - atan_decidegrees(abs_x * 32768 / abs_y);
+    }
+
+    if (x < 0)
+    {
+        angle = 1800 - angle;
+    }
+
+    return y < 0 ? -angle : angle;
+}
+
+/* Compute the features of the full window */
+static void extract_features(motion_record_t *record)
+{
+    int32_t deviation[MOTION_WINDOW_SAMPLES];
+    int32_t mean[GYRO_AXES];
+    uint32_t duration = (uint32_t)(k_uptime_get() - window_opened);
+
+    record->timestamp = window_start;
+    record->duration = duration;
+
+    for (int axis = 0; axis < GYRO_AXES; axis++)
+    {
+        int64_t sum = 0;
+        uint64_t sum_squares = 0;
+        int32_t peak = 0;
+        int bin;
+
+        for (int i = 0; i < MOTION_WINDOW_SAMPLES; i++)
+        {
+            sum += samples[axis][i];
+        }
+        mean[axis] = sum / MOTION_WINDOW_SAMPLES;
+
+        for (int i = 0; i < MOTION_WINDOW_SAMPLES; i++)
+        {
+            deviation[i] = samples[axis][i] - mean[axis];
+            sum_squares += (int64_t)deviation[i] * deviation[i];
+            peak = MAX(peak, abs(deviation[i]));
+        }
+
+        record->rms[axis] = utils_isqrt(sum_squares / MOTION_WINDOW_SAMPLES);
+        record->peak[axis] = peak;
+
+        /* Bin k spans k cycles over the window, which is one sample
+         * period longer than the time between its first and last reading
+         */
+        bin = peak > 0 ? dominant_bin(deviation, peak) : 0;
+        record->frequency[axis] =
+            duration > 0 ? (uint32_t)((int64_t)bin * MSEC_PER_SEC * MSEC_PER_SEC *
+                                      (MOTION_WINDOW_SAMPLES - 1) /
+                                      ((int64_t)MOTION_WINDOW_SAMPLES * duration))
+                         : 0;
+    }
+
+    /* Gravity dominates the mean acceleration */
+    record->roll = atan2_decidegrees(mean[1], mean[2]);
+    record->pitch = atan2_decidegrees(-(int64_t)mean[0],
+                                      utils_isqrt((int64_t)mean[1] * mean[1] +
+                                                  (int64_t)mean[2] * mean[2]));
+}
+
+int motion_add_sample(const gyro_reading_t *reading, motion_record_t *record)
+{
+    if (filled == 0)
+    {
+        window_start = reading->timestamp;
+        window_opened = k_uptime_get();
+    }
+
+    samples[0][filled] = reading->accel_x;
+    samples[1][filled] = reading->accel_y;
+    samples[2][filled] = reading->accel_z;
+    samples[3][filled] = reading->gyro_x;
+    samples[4][filled] = reading->gyro_y;
+    samples[5][filled] = reading->gyro_z;
+
+    if (++filled < MOTION_WINDOW_SAMPLES)
+    {
+        return 0;
+    }
+
+    extract_features(record);
+    filled = 0;
+
+    LOG_DBG(LOG_PREFIX_MOTION "Window closed after %u ms, roll %d pitch %d",
+            record->duration, record->roll, record->pitch);
+
+    return 1;
+}
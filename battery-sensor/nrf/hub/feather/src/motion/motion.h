@@ -0,0 +1,33 @@
+/**
+ * @file motion.h
+ * @brief Motion feature extraction from gyroscope/accelerometer readings
+ */
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <zephyr/kernel.h>
+
+#include "sensors/sensors.h"
+
+/** Number of readings in one motion window, a power of two from Kconfig */
+#define MOTION_WINDOW_SAMPLES CONFIG_ELFRYD_MOTION_WINDOW_SAMPLES
+
+/** Gyroscope sampling period while extracting motion features */
+#define MOTION_SAMPLE_PERIOD_MS (MSEC_PER_SEC / CONFIG_ELFRYD_MOTION_SAMPLE_RATE_HZ)
+
+/**
+ * Add a reading to the current motion window
+ *
+ * Once the window holds MOTION_WINDOW_SAMPLES readings its features are
+ * computed and a new window is started. Must only be called from the thread
+ * sampling the sensors. Closing a window runs one fixed-point FFT per axis,
+ * so do not hold locks other threads wait for.
+ *
+ * @param reading Gyroscope/accelerometer reading to add
+ * @param record  Set to the features of the window if this reading completed it
+ * @return        1 if the window completed and record was set, 0 otherwise
+ */
+int motion_add_sample(const gyro_reading_t *reading, motion_record_t *record);
+
+#endif /* MOTION_H */
@@ -6,20 +6,31 @@
 #include <zephyr/kernel.h>
 #include <zephyr/net/socket.h>
 #include <zephyr/net/mqtt.h>
-#include <zephyr/random/rand32.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/random/rand32.h>
+#include <zephyr/sys/atomic.h>
 
-#include <nrf_modem_at.h>
-#include <modem/lte_lc.h>
 #include <modem/nrf_modem_lib.h>
 #include <modem/modem_key_mgmt.h>
 
+#ifdef CONFIG_SETTINGS
+#include <zephyr/settings/settings.h>
+#endif
+#ifdef CONFIG_ELFRYD_PROVISIONING_CACHE
+#include <zephyr/sys/crc.h>
+#endif
+
 #include "mqtt/mqtt_client.h"
 #include "mqtt/mqtt_publishers.h"
 #include "config/config_module.h"
+#include "lte/lte_manager.h"
+#include "utils/utils.h"
+#include "utils/boot_phases.h"
+#include "metrics/metrics.h"
 #include "certificates.h"
 
 LOG_MODULE_REGISTER(mqtt_client, LOG_LEVEL_INF);
@@ -28,10 +39,71 @@ LOG_MODULE_REGISTER(mqtt_client, LOG_LEVEL_INF);
 #define LOG_PREFIX_TLS "[TLS] "
 #define LOG_PREFIX_NET "[NET] "
 
+/* Largest PUBLISH fixed header: one type byte and up to four length bytes */
+#define MQTT_PUBLISH_FIXED_HEADER_MAX 5
+
+/* Socket watcher thread, only polls the socket so it needs little stack */
+#define SOCKET_WATCHER_STACK_SIZE 1024
+#define SOCKET_WATCHER_PRIORITY 5
+
+/* Time to register with the network before detaching and starting over */
+#define LTE_ATTACH_TIMEOUT_S 120
+
 /* Buffers for MQTT client */
 static uint8_t rx_buffer[APP_MQTT_BUFFER_SIZE];
 static uint8_t tx_buffer[APP_MQTT_BUFFER_SIZE];
-static uint8_t payload_buffer[APP_MQTT_BUFFER_SIZE];
+
+/* An outgoing message, kept until the broker has acknowledged it (QoS 1/2)
+ * or until it has been sent (QoS 0)
+ */
+typedef struct
+{
+    bool used;
+    bool queued;     /* Waiting for the I/O thread to send it */
+    bool released;   /* PUBREC received, waiting for PUBCOMP */
+    bool tracked;    /* Report the acknowledgement to ack_handler */
+    uint16_t message_id;
+    enum mqtt_qos qos;
+    const char *topic;
+    uint32_t token;
+    int64_t sent_at; /* Uptime of the last send, for the acknowledgement latency */
+    size_t len;
+    uint8_t payload[APP_MQTT_BUFFER_SIZE];
+} inflight_msg_t;
+
+/* Slots after the in-flight window are kept for priority messages, so an
+ * alarm or a config confirmation never waits for sensor batches to be
+ * acknowledged. Two, so one of them does not hold back the other.
+ */
+#define MQTT_PRIORITY_SLOTS 2
+
+static inflight_msg_t inflight[CONFIG_MQTT_INFLIGHT_WINDOW + MQTT_PRIORITY_SLOTS];
+
+/* Counts free in-flight slots so publishers can wait for one */
+static K_SEM_DEFINE(inflight_free, CONFIG_MQTT_INFLIGHT_WINDOW, CONFIG_MQTT_INFLIGHT_WINDOW);
+static K_SEM_DEFINE(priority_free, MQTT_PRIORITY_SLOTS, MQTT_PRIORITY_SLOTS);
+
+/* Slot indices handed from publishing threads to the I/O thread, the
+ * priority queue is always drained first
+ */
+K_MSGQ_DEFINE(outgoing_msgq, sizeof(uint8_t), CONFIG_MQTT_INFLIGHT_WINDOW, 1);
+K_MSGQ_DEFINE(priority_msgq, sizeof(uint8_t), MQTT_PRIORITY_SLOTS, 1);
+
+/* Next packet identifier, 0 is not a valid identifier */
+static uint16_t next_message_id = 1;
+
+/* The socket watcher blocks in poll on behalf of the I/O thread and raises
+ * socket_signal when the socket is readable. Offloaded modem sockets cannot
+ * be polled together with kernel objects, so this lets the I/O thread wait
+ * on the socket and the outgoing queue at once with k_poll.
+ */
+static K_THREAD_STACK_DEFINE(socket_watcher_stack, SOCKET_WATCHER_STACK_SIZE);
+static struct k_thread socket_watcher_data;
+static struct k_poll_signal socket_signal;
+static K_SEM_DEFINE(socket_watcher_arm, 0, 1);
+static int socket_watcher_fd = -1;
+
+static mqtt_client_ack_cb_t ack_handler;
 
 /* The mqtt client struct */
 static struct mqtt_client client_ctx;
@@ -39,143 +111,229 @@ static struct mqtt_client client_ctx;
 /* MQTT Broker details */
 static struct sockaddr_storage broker;
 
+/* CONFIG_MQTT_CLIENT_ID, with the IMEI appended if configured. A persistent
+ * session is tied to the client ID, so every hub needs its own.
+ */
+static char client_id[sizeof(MQTT_CLIENTID) + 1 + LTE_MANAGER_IMEI_LEN];
+
 static struct zsock_pollfd fds[1];
 static int nfds;
 
 static bool mqtt_connected;
 
+/* Steps of bringing the connection up, in order. The I/O thread moves
+ * through them in advance_link without ever sleeping in between, so a
+ * failed step only costs a backoff timer and publishers keep queueing.
+ */
+typedef enum
+{
+    LINK_DETACHED,    /* Modem offline, attach on the next attempt */
+    LINK_ATTACHING,   /* Attach under way, waiting for registration */
+    LINK_RESOLVING,   /* Registered, broker address unknown */
+    LINK_CONNECTING,  /* Broker address known, TLS and MQTT CONNECT next */
+    LINK_CONNACK,     /* CONNECT sent, waiting for CONNACK */
+    LINK_SUBSCRIBING, /* Connected, waiting for SUBACK */
+    LINK_CONNECTED,
+} link_state_t;
+
+static const char *const link_state_names[] = {
+    "detached", "attaching", "resolving", "connecting", "connack", "subscribing", "connected",
+};
+
+/* Connection progress, I/O thread only */
+static link_state_t link_state = LINK_DETACHED;
+static int link_failures;     /* Failed attempts since the last connection */
+static int64_t link_retry_at; /* Uptime in ms of the next attempt */
+static int64_t link_deadline; /* Uptime in ms the step waited for is given up */
+
+/* Uptime in ms an established connection was lost, -1 once the first
+ * publish after it went out
+ */
+static int64_t link_lost_at = -1;
+
+/* An established connection was lost and is not back yet. Kept apart from
+ * link_lost_at, which the first publish may clear before link_up runs.
+ */
+static bool link_lost;
+
+/* Recovery figures for mqtt_client_get_link_stats, under mqtt_mutex */
+static mqtt_link_stats_t link_stats;
+
+/* Modem events handed from the link controller to the I/O thread */
+static struct k_poll_signal link_signal;
+static atomic_t link_events;
+
+#ifdef CONFIG_ELFRYD_LTE_RAI
+/* Wait this long after the last exchange for more messages before letting
+ * the radio go, so the chunks of one batch share an RRC connection
+ */
+#define RAI_LINGER_MS 1000
+
+/* Data was exchanged since the radio was last released, I/O thread only */
+static bool rai_pending;
+#endif
+
 /* Calculate the length of the CA certificate */
 static const size_t ca_certificate_len = sizeof(ca_certificate) - 1;
 
-/* Mutex for protecting the MQTT client */
+/* Mutex for the state shared with publishing threads: the connection flag,
+ * the in-flight slots and the packet identifiers. The client itself is only
+ * used by the I/O thread.
+ */
 static K_MUTEX_DEFINE(mqtt_mutex);
 
-/* LTE connection semaphore */
-static K_SEM_DEFINE(lte_connected, 0, 1);
-
 /* Forward declarations */
 static void mqtt_evt_handler(struct mqtt_client *const client,
                              const struct mqtt_evt *evt);
 static int get_mqtt_broker_addrinfo(void);
 static int setup_certificates(void);
 
-/* Flag for DNS resolution success */
+/* Broker address lookup. A resolved address is used for
+ * CONFIG_ELFRYD_DNS_CACHE_TTL, and with CONFIG_ELFRYD_DNS_CACHE it is kept
+ * in settings so it also outlives a reboot.
+ */
 static bool dns_resolved = false;
+static bool dns_cached;             /* From settings, not yet proven by a connection */
+static int64_t dns_resolved_uptime; /* ms */
+static int64_t dns_resolved_utc;    /* s, 0 if the time was not known */
 static char resolved_ip[INET_ADDRSTRLEN];
 
-/* Handle LTE connection state */
-static void lte_handler(const struct lte_lc_evt *const evt)
+#ifdef CONFIG_ELFRYD_PROVISIONING_CACHE
+#define PROVISIONING_KEY "elfryd/prov"
+
+/* The credentials in the modem were compared with the compiled-in ones
+ * during this boot, or written
+ */
+static bool credentials_checked;
+#endif
+
+#ifdef CONFIG_ELFRYD_DNS_CACHE
+#define DNS_CACHE_KEY "elfryd/dns"
+
+/* Broker address as kept in settings */
+typedef struct
 {
-    switch (evt->type)
+    uint32_t addr;        /* IPv4, network byte order */
+    int64_t resolved_utc; /* s, 0 if the time was not known */
+} dns_cache_entry_t;
+#endif
+
+static void lte_event_handler(lte_manager_evt_t evt)
+{
+    /* Runs in the link controller's context, the I/O thread does the work */
+    atomic_set_bit(&link_events, evt);
+    k_poll_signal_raise(&link_signal, evt);
+}
+
+#ifdef CONFIG_SETTINGS
+/* Destination of a setting read with load_setting */
+typedef struct
+{
+    void *data;
+    size_t len;
+} setting_buf_t;
+
+static int load_setting_cb(const char *key, size_t len, settings_read_cb read_cb,
+                           void *cb_arg, void *param)
+{
+    setting_buf_t *buf = param;
+
+    if (len != buf->len)
     {
-    case LTE_LC_EVT_NW_REG_STATUS:
-        if ((evt->nw_reg_status == LTE_LC_NW_REG_REGISTERED_HOME) ||
-            (evt->nw_reg_status == LTE_LC_NW_REG_REGISTERED_ROAMING))
-        {
-            LOG_INF(LOG_PREFIX_LTE "Network registration status: %d", evt->nw_reg_status);
-            k_sem_give(&lte_connected);
-        }
-        break;
-    case LTE_LC_EVT_PSM_UPDATE:
-        LOG_INF(LOG_PREFIX_LTE "PSM parameter update: TAU: %d, Active time: %d",
-                evt->psm_cfg.tau, evt->psm_cfg.active_time);
-        break;
-    case LTE_LC_EVT_EDRX_UPDATE:
-        LOG_INF(LOG_PREFIX_LTE "eDRX parameter update: eDRX: %f, PTW: %f",
-                evt->edrx_cfg.edrx, evt->edrx_cfg.ptw);
-        break;
-    case LTE_LC_EVT_RRC_UPDATE:
-        LOG_INF(LOG_PREFIX_LTE "RRC mode: %s", evt->rrc_mode == LTE_LC_RRC_MODE_CONNECTED ? "Connected" : "Idle");
-        break;
-    case LTE_LC_EVT_CELL_UPDATE:
-        LOG_INF(LOG_PREFIX_LTE "LTE cell changed: Cell ID: %d, Tracking area: %d",
-                evt->cell.id, evt->cell.tac);
-        break;
-    case LTE_LC_EVT_LTE_MODE_UPDATE:
-        LOG_INF(LOG_PREFIX_LTE "Active LTE mode changed: %s",
-                evt->lte_mode == LTE_LC_LTE_MODE_NONE ? "None" : evt->lte_mode == LTE_LC_LTE_MODE_LTEM ? "LTE-M"
-                                                             : evt->lte_mode == LTE_LC_LTE_MODE_NBIOT  ? "NB-IoT"
-                                                                                                       : "Unknown");
-        break;
-    default:
-        break;
+        return -EINVAL;
     }
+
+    return read_cb(cb_arg, buf->data, buf->len) == buf->len ? 0 : -EIO;
 }
 
-static int setup_lte(void)
+/* Read a fixed size setting, data is left untouched if it was never saved */
+static int load_setting(const char *key, void *data, size_t len)
+{
+    setting_buf_t buf = {.data = data, .len = len};
+
+    return settings_load_subtree_direct(key, load_setting_cb, &buf);
+}
+#endif
+
+#ifdef CONFIG_ELFRYD_PROVISIONING_CACHE
+/* Fingerprint of the credential set, to notice when the firmware carries
+ * another one than the modem was provisioned with
+ */
+static uint32_t credentials_hash(void)
+{
+    uint32_t tag = SEC_TAG;
+    uint32_t crc = crc32_ieee((const uint8_t *)&tag, sizeof(tag));
+
+    return crc32_ieee_update(crc, (const uint8_t *)ca_certificate, ca_certificate_len);
+}
+#endif
+
+/* Make sure the modem holds the compiled-in credentials. With
+ * CONFIG_ELFRYD_PROVISIONING_CACHE the hash of the set last provisioned is
+ * kept in settings, and while it matches the modem is trusted to still hold
+ * it, so boot skips the offline switch and the compare.
+ */
+static int provision_credentials(void)
 {
     int err;
 
-    LOG_INF(LOG_PREFIX_LTE "Setting up LTE connection...");
+#ifdef CONFIG_ELFRYD_PROVISIONING_CACHE
+    uint32_t hash = credentials_hash();
+    uint32_t stored = 0;
 
-    /* Initialize LTE link controller */
-    err = lte_lc_init();
-    if (err)
+    if (load_setting(PROVISIONING_KEY, &stored, sizeof(stored)) == 0 && stored == hash)
     {
-        LOG_ERR(LOG_PREFIX_LTE "Failed to initialize LTE link controller, error: %d", err);
-        return err;
+        LOG_INF(LOG_PREFIX_TLS "Credentials unchanged since provisioning, skipping check");
+        return 0;
     }
+#endif
 
-    /* Configure modem for LTE-M/NB-IoT */
-    err = lte_lc_system_mode_set(LTE_LC_SYSTEM_MODE_LTEM_GPS,
-                                 LTE_LC_SYSTEM_MODE_PREFER_LTEM);
+    /* Credentials can only be written while offline */
+    err = lte_manager_detach();
     if (err)
     {
-        LOG_ERR(LOG_PREFIX_LTE "Failed to set system mode, error: %d", err);
         return err;
     }
 
-    /* Set LTE offline for certificate provisioning */
-    err = lte_lc_offline();
+    err = setup_certificates();
     if (err)
     {
-        LOG_ERR(LOG_PREFIX_LTE "Failed to set modem offline: %d", err);
         return err;
     }
 
-    /* Set up certificates while offline */
-    err = setup_certificates();
+#ifdef CONFIG_ELFRYD_PROVISIONING_CACHE
+    credentials_checked = true;
+
+    err = settings_save_one(PROVISIONING_KEY, &hash, sizeof(hash));
     if (err)
     {
-        LOG_ERR(LOG_PREFIX_LTE "Failed to set up certificates, error: %d", err);
-        return err;
+        LOG_WRN(LOG_PREFIX_TLS "Failed to store provisioning hash: %d", err);
     }
+#endif
 
-    /* Register event handler */
-    lte_lc_register_handler(lte_handler);
+    return 0;
+}
 
-    LOG_INF(LOG_PREFIX_LTE "Waiting for LTE connection...");
+static int setup_lte(void)
+{
+    int err;
 
-    /* Connect to network asynchronously */
-    err = lte_lc_connect_async(lte_handler);
+    err = lte_manager_init();
     if (err)
     {
-        LOG_ERR(LOG_PREFIX_LTE "Failed to connect to LTE network, error: %d", err);
         return err;
     }
 
-    /* Wait for network registration with a timeout */
-    err = k_sem_take(&lte_connected, K_SECONDS(120));
-    if (err == -EAGAIN)
-    {
-        LOG_ERR(LOG_PREFIX_LTE "Timeout waiting for LTE connection");
-        return -ETIMEDOUT;
-    }
-
-    LOG_INF(LOG_PREFIX_LTE "LTE connected!");
-
-    /* Additional check of registration status */
-    enum lte_lc_nw_reg_status reg_status;
-    err = lte_lc_nw_reg_status_get(&reg_status);
+    err = provision_credentials();
     if (err)
     {
-        LOG_ERR(LOG_PREFIX_LTE "Failed to get network registration status: %d", err);
-    }
-    else
-    {
-        LOG_INF(LOG_PREFIX_LTE "Network registration status: %d", reg_status);
+        LOG_ERR(LOG_PREFIX_LTE "Failed to set up certificates, error: %d", err);
+        return err;
     }
 
+    k_poll_signal_init(&link_signal);
+    lte_manager_set_event_handler(lte_event_handler);
+
     return 0;
 }
 
@@ -237,6 +395,96 @@ static int setup_certificates(void)
     return 0;
 }
 
+static void setup_client_id(void)
+{
+    snprintf(client_id, sizeof(client_id), "%s", MQTT_CLIENTID);
+
+#ifdef CONFIG_ELFRYD_MQTT_CLIENT_ID_IMEI
+    char imei[LTE_MANAGER_IMEI_LEN + 1];
+
+    if (lte_manager_imei(imei, sizeof(imei)) == 0)
+    {
+        snprintf(client_id, sizeof(client_id), "%s-%s", MQTT_CLIENTID, imei);
+    }
+    else
+    {
+        LOG_WRN(LOG_PREFIX_MQTT "No IMEI, falling back to the configured client ID");
+    }
+#endif
+
+    LOG_INF(LOG_PREFIX_MQTT "Client ID: %s", client_id);
+}
+
+static void set_broker_address(uint32_t addr)
+{
+    struct sockaddr_in *server4 = ((struct sockaddr_in *)&broker);
+
+    server4->sin_addr.s_addr = addr;
+    server4->sin_family = AF_INET;
+    server4->sin_port = htons(SERVER_PORT);
+
+    /* Store the resolved IP address */
+    inet_ntop(AF_INET, &server4->sin_addr, resolved_ip, sizeof(resolved_ip));
+}
+
+/* Check whether the broker address may be used without a new lookup */
+static bool dns_fresh(void)
+{
+    int64_t now = utils_get_timestamp();
+
+    if (!dns_resolved)
+    {
+        return false;
+    }
+
+    /* Across reboots only UTC tells the age, within one boot the uptime does */
+    if (dns_resolved_utc > 0 && now > 0)
+    {
+        return now - dns_resolved_utc < CONFIG_ELFRYD_DNS_CACHE_TTL;
+    }
+
+    return k_uptime_get() - dns_resolved_uptime <
+           (int64_t)CONFIG_ELFRYD_DNS_CACHE_TTL * MSEC_PER_SEC;
+}
+
+#ifdef CONFIG_ELFRYD_DNS_CACHE
+static void dns_cache_load(void)
+{
+    dns_cache_entry_t entry = {0};
+    int err;
+
+    err = load_setting(DNS_CACHE_KEY, &entry, sizeof(entry));
+    if (err || entry.addr == 0)
+    {
+        return;
+    }
+
+    set_broker_address(entry.addr);
+    dns_resolved = true;
+    dns_cached = true;
+    boot_phase_done(BOOT_PHASE_DNS);
+    dns_resolved_utc = entry.resolved_utc;
+    /* Until the time is known the age counts from boot */
+    dns_resolved_uptime = k_uptime_get();
+
+    LOG_INF(LOG_PREFIX_NET "Cached address for %s: %s", SERVER_HOST, resolved_ip);
+}
+
+static void dns_cache_save(void)
+{
+    const dns_cache_entry_t entry = {
+        .addr = ((struct sockaddr_in *)&broker)->sin_addr.s_addr,
+        .resolved_utc = dns_resolved_utc};
+    int err;
+
+    err = settings_save_one(DNS_CACHE_KEY, &entry, sizeof(entry));
+    if (err)
+    {
+        LOG_WRN(LOG_PREFIX_NET "Failed to cache broker address: %d", err);
+    }
+}
+#endif
+
 static int get_mqtt_broker_addrinfo(void)
 {
     int err;
@@ -264,56 +512,606 @@ static int get_mqtt_broker_addrinfo(void)
     }
 
     /* IPv4 Address. */
-    struct sockaddr_in *server4 = ((struct sockaddr_in *)&broker);
-
-    server4->sin_addr.s_addr =
-        ((struct sockaddr_in *)result->ai_addr)->sin_addr.s_addr;
-    server4->sin_family = AF_INET;
-    server4->sin_port = htons(SERVER_PORT);
-
-    /* Store the resolved IP address */
-    inet_ntop(AF_INET, &server4->sin_addr, resolved_ip, sizeof(resolved_ip));
+    set_broker_address(((struct sockaddr_in *)result->ai_addr)->sin_addr.s_addr);
     LOG_INF(LOG_PREFIX_NET "Hostname %s resolved to %s", SERVER_HOST, resolved_ip);
 
     dns_resolved = true;
+    dns_cached = false;
+    dns_resolved_uptime = k_uptime_get();
+    boot_phase_done(BOOT_PHASE_DNS);
+    dns_resolved_utc = utils_get_timestamp();
     freeaddrinfo(result);
 
-    return 0;
+#ifdef CONFIG_ELFRYD_DNS_CACHE
+    dns_cache_save();
+#endif
+
+    return 0;
+}
+
+static void prepare_fds(struct mqtt_client *client)
+{
+    if (client->transport.type == MQTT_TRANSPORT_SECURE)
+    {
+        fds[0].fd = client->transport.tls.sock;
+    }
+    else
+    {
+        fds[0].fd = client->transport.tcp.sock;
+    }
+    fds[0].events = ZSOCK_POLLIN;
+    nfds = 1;
+}
+
+static void clear_fds(void)
+{
+    nfds = 0;
+}
+
+static void set_connected(bool connected)
+{
+    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    mqtt_connected = connected;
+    k_mutex_unlock(&mqtt_mutex);
+}
+
+#ifdef CONFIG_ELFRYD_LTE_RAI
+/* Check that no message or ping awaits an answer, so the radio may go */
+static bool link_idle(void)
+{
+    bool idle = client_ctx.unacked_ping == 0;
+
+    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    for (int i = 0; i < ARRAY_SIZE(inflight) && idle; i++)
+    {
+        idle = !inflight[i].used;
+    }
+    k_mutex_unlock(&mqtt_mutex);
+
+    return idle;
+}
+#endif
+
+static void socket_watcher_fn(void *arg1, void *arg2, void *arg3)
+{
+    struct zsock_pollfd pfd;
+    int ret;
+
+    ARG_UNUSED(arg1);
+    ARG_UNUSED(arg2);
+    ARG_UNUSED(arg3);
+
+    while (1)
+    {
+        /* Armed by the I/O thread once it is ready for more input */
+        k_sem_take(&socket_watcher_arm, K_FOREVER);
+
+        pfd.fd = socket_watcher_fd;
+        pfd.events = ZSOCK_POLLIN;
+        pfd.revents = 0;
+
+        ret = zsock_poll(&pfd, 1, -1);
+
+        /* Errors and hangups are signalled too, mqtt_input reports them */
+        k_poll_signal_raise(&socket_signal, ret < 0 ? -errno : pfd.revents);
+    }
+}
+
+/* Let the watcher poll the socket again, called from the I/O thread */
+static void arm_socket_watcher(void)
+{
+    socket_watcher_fd = fds[0].fd;
+    k_sem_give(&socket_watcher_arm);
+}
+
+/* Delay before the next attempt. It doubles with every failure up to the
+ * maximum, and a random half of it is dropped so hubs that lost the network
+ * together do not all come back in the same second.
+ */
+static int64_t backoff_ms(int failures)
+{
+    int64_t delay = CONFIG_MQTT_CONNECT_RETRY_DELAY_MS;
+
+    for (int i = 0; i < failures && delay < CONFIG_MQTT_CONNECT_RETRY_MAX_DELAY_MS; i++)
+    {
+        delay *= 2;
+    }
+    delay = MIN(delay, CONFIG_MQTT_CONNECT_RETRY_MAX_DELAY_MS);
+
+    return delay / 2 + sys_rand32_get() % (delay / 2 + 1);
+}
+
+static void wait_for_registration(void)
+{
+    link_state = LINK_ATTACHING;
+    link_deadline = k_uptime_get() + LTE_ATTACH_TIMEOUT_S * MSEC_PER_SEC;
+}
+
+/* The connection is fully up, the backoff starts over */
+static void link_up(void)
+{
+    link_state = LINK_CONNECTED;
+    link_failures = 0;
+    dns_cached = false;
+    boot_phase_done(BOOT_PHASE_CONNECT);
+    LOG_INF(LOG_PREFIX_MQTT "Connected with a keepalive of %d seconds", client_ctx.keepalive);
+
+    if (link_lost)
+    {
+        link_lost = false;
+        k_mutex_lock(&mqtt_mutex, K_FOREVER);
+        link_stats.reconnects++;
+        k_mutex_unlock(&mqtt_mutex);
+    }
+
+#ifdef CONFIG_ELFRYD_LTE_RAI
+    rai_pending = true;
+#endif
+}
+
+/* The step after registration, DNS is only looked up again once the
+ * address expired or after failures
+ */
+static link_state_t registered_state(void)
+{
+    return dns_fresh() ? LINK_CONNECTING : LINK_RESOLVING;
+}
+
+/* Plan the next attempt after the connection closed or an attempt failed */
+static void schedule_retry(bool failed)
+{
+    int64_t delay;
+
+    if (failed)
+    {
+        link_failures++;
+    }
+    else
+    {
+        link_lost = true;
+        if (link_lost_at < 0)
+        {
+            link_lost_at = k_uptime_get();
+        }
+    }
+
+    if (failed && dns_cached && link_state >= LINK_CONNECTING)
+    {
+        /* The stored address may be stale, look it up before the next attempt */
+        dns_resolved = false;
+        dns_cached = false;
+    }
+
+    if (failed && link_state != LINK_DETACHED &&
+        link_failures % CONFIG_MQTT_CONNECT_ATTEMPTS == 0)
+    {
+        /* Retrying the same way keeps failing, start over with a fresh
+         * attach and DNS lookup in case the PDN or the broker address went
+         * stale
+         */
+        LOG_WRN(LOG_PREFIX_MQTT "%d failed attempts, reattaching to the network", link_failures);
+        lte_manager_detach();
+        dns_resolved = false;
+        link_state = LINK_DETACHED;
+
+#ifdef CONFIG_ELFRYD_PROVISIONING_CACHE
+        /* Boot trusted the stored hash, the modem is offline now so make
+         * sure the credentials are really there
+         */
+        if (!credentials_checked && setup_certificates() == 0)
+        {
+            credentials_checked = true;
+        }
+#endif
+    }
+    else if (link_state != LINK_DETACHED)
+    {
+        if (lte_manager_registered())
+        {
+            link_state = registered_state();
+        }
+        else
+        {
+            wait_for_registration();
+        }
+    }
+
+    delay = backoff_ms(link_failures);
+    link_retry_at = k_uptime_get() + delay;
+
+    LOG_INF(LOG_PREFIX_MQTT "Next connection attempt in %lld ms (%s)",
+            delay, link_state_names[link_state]);
+}
+
+/* Drop a broken connection, unacknowledged messages are kept for later */
+static void abort_connection(void)
+{
+    /* Losing an established connection is not a failed attempt */
+    bool failed = link_state != LINK_CONNECTED;
+
+    mqtt_abort(&client_ctx);
+    set_connected(false);
+    clear_fds();
+
+    schedule_retry(failed);
+}
+
+/* Open the TLS connection and send CONNECT, CONNACK arrives through
+ * mqtt_input like any other packet
+ */
+static int start_connect(void)
+{
+    int64_t start = k_uptime_get();
+    uint32_t elapsed;
+    int err;
+
+    LOG_INF(LOG_PREFIX_MQTT "Connecting to MQTT broker %s:%d (attempt %d)",
+            SERVER_HOST, SERVER_PORT, link_failures + 1);
+
+    /* The granted PSM timers can change with every attach */
+    client_ctx.keepalive = lte_manager_keepalive();
+
+    err = mqtt_connect(&client_ctx);
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_MQTT "Failed to connect to MQTT broker, error: %d", err);
+        return err;
+    }
+
+    /* TCP and TLS handshake, much shorter when the TLS session is resumed */
+    elapsed = k_uptime_get() - start;
+    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    link_stats.last_connect_ms = elapsed;
+    k_mutex_unlock(&mqtt_mutex);
+    LOG_INF(LOG_PREFIX_MQTT "Connection opened in %u ms", elapsed);
+
+    prepare_fds(&client_ctx);
+
+    /* Hand the socket to the watcher, a stale signal from the previous
+     * connection only costs one empty mqtt_input
+     */
+    k_poll_signal_reset(&socket_signal);
+    arm_socket_watcher();
+
+    link_state = LINK_CONNACK;
+    link_deadline = k_uptime_get() + APP_CONNECT_TIMEOUT_MS;
+
+    return 0;
+}
+
+/* Take the next step towards a connection once it is due. Each step either
+ * completes at once or leaves something to wait for, a modem event, socket
+ * input or a deadline, so the caller can go back to k_poll.
+ */
+static void advance_link(void)
+{
+    int64_t now = k_uptime_get();
+    int err;
+
+    switch (link_state)
+    {
+    case LINK_ATTACHING:
+        if (now >= link_deadline)
+        {
+            LOG_WRN(LOG_PREFIX_LTE "Not registered after %d s, detaching", LTE_ATTACH_TIMEOUT_S);
+            lte_manager_detach();
+            link_state = LINK_DETACHED;
+            schedule_retry(true);
+        }
+        return;
+    case LINK_CONNACK:
+    case LINK_SUBSCRIBING:
+        if (now >= link_deadline)
+        {
+            LOG_ERR(LOG_PREFIX_MQTT "No answer from the broker (%s)", link_state_names[link_state]);
+            abort_connection();
+        }
+        return;
+    case LINK_CONNECTED:
+        return;
+    default:
+        break;
+    }
+
+    if (now < link_retry_at)
+    {
+        return;
+    }
+
+    switch (link_state)
+    {
+    case LINK_DETACHED:
+        err = lte_manager_attach();
+        if (err)
+        {
+            schedule_retry(true);
+            return;
+        }
+        wait_for_registration();
+        break;
+    case LINK_RESOLVING:
+        err = get_mqtt_broker_addrinfo();
+        if (err)
+        {
+            schedule_retry(true);
+            return;
+        }
+        link_state = LINK_CONNECTING;
+        __fallthrough;
+    case LINK_CONNECTING:
+        err = start_connect();
+        if (err)
+        {
+            /* mqtt_connect cleans up after itself */
+            schedule_retry(true);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* React to registration changes and cell changes reported by the modem */
+static void handle_link_events(void)
+{
+    atomic_val_t events = atomic_clear(&link_events);
+    bool registered = lte_manager_registered();
+
+    if (!registered && (link_state == LINK_RESOLVING || link_state == LINK_CONNECTING))
+    {
+        /* Nothing gets through until the modem finds a cell again. An open
+         * connection is kept, it may well survive a short gap.
+         */
+        LOG_WRN(LOG_PREFIX_LTE "Lost network registration");
+        wait_for_registration();
+    }
+    else if (registered && link_state == LINK_ATTACHING)
+    {
+        /* Back after an outage, connect at once instead of waiting out the backoff */
+        link_state = registered_state();
+        link_retry_at = k_uptime_get();
+    }
+    else if (registered && (events & BIT(LTE_MANAGER_EVT_REGISTERED)) &&
+             link_state == LINK_CONNECTED)
+    {
+        /* Registration came back under an open connection, find out now
+         * whether it survived rather than at the next keepalive
+         */
+        if (mqtt_ping(&client_ctx))
+        {
+            abort_connection();
+        }
+    }
+
+    if ((events & BIT(LTE_MANAGER_EVT_CELL_CHANGED)) && registered &&
+        (link_state == LINK_RESOLVING || link_state == LINK_CONNECTING))
+    {
+        /* The new cell may have the coverage the old one lacked */
+        link_retry_at = MIN(link_retry_at, k_uptime_get());
+    }
+}
+
+/* Hand out monotonically increasing packet identifiers, skipping any still
+ * in flight. Must be called with mqtt_mutex held.
+ */
+static uint16_t allocate_message_id(void)
+{
+    bool in_use;
+    uint16_t id;
+
+    do
+    {
+        id = next_message_id++;
+        if (next_message_id == 0)
+        {
+            next_message_id = 1;
+        }
+
+        in_use = false;
+        for (int i = 0; i < ARRAY_SIZE(inflight); i++)
+        {
+            if (inflight[i].used && inflight[i].message_id == id)
+            {
+                in_use = true;
+                break;
+            }
+        }
+    } while (in_use);
+
+    return id;
+}
+
+static inflight_msg_t *find_inflight(uint16_t message_id)
+{
+    for (int i = 0; i < ARRAY_SIZE(inflight); i++)
+    {
+        if (inflight[i].used && inflight[i].message_id == message_id)
+        {
+            return &inflight[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Release a slot and let a waiting publisher have it */
+static void free_inflight(inflight_msg_t *msg)
+{
+    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    msg->used = false;
+    msg->queued = false;
+    k_mutex_unlock(&mqtt_mutex);
+
+    if (msg - inflight >= CONFIG_MQTT_INFLIGHT_WINDOW)
+    {
+        k_sem_give(&priority_free);
+    }
+    else
+    {
+        k_sem_give(&inflight_free);
+    }
+}
+
+/* Free a slot once the broker has acknowledged its message */
+static void complete_inflight(uint16_t message_id)
+{
+    mqtt_client_ack_cb_t handler;
+    inflight_msg_t *msg;
+
+    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    msg = find_inflight(message_id);
+    handler = ack_handler;
+    k_mutex_unlock(&mqtt_mutex);
+
+    if (msg == NULL || msg->queued)
+    {
+        LOG_WRN(LOG_PREFIX_MQTT "Acknowledgement for unknown message id: %u", message_id);
+        return;
+    }
+
+    metrics_observe(METRIC_PUBLISH_LATENCY, k_uptime_get() - msg->sent_at);
+
+    /* Called without the mutex so the handler may publish or take its own locks */
+    if (msg->tracked && handler)
+    {
+        handler(msg->token);
+    }
+
+    free_inflight(msg);
+}
+
+/* Send the message in a slot, from the I/O thread only */
+static int send_inflight(inflight_msg_t *msg, bool dup)
+{
+    const struct mqtt_publish_param param = {
+        .message.topic.qos = msg->qos,
+        .message.topic.topic.utf8 = (uint8_t *)msg->topic,
+        .message.topic.topic.size = strlen(msg->topic),
+        .message.payload.data = msg->payload,
+        .message.payload.len = msg->len,
+        .message_id = msg->message_id,
+        .dup_flag = dup ? 1 : 0,
+        .retain_flag = 0};
+    int err;
+
+    msg->sent_at = k_uptime_get();
+    err = mqtt_publish(&client_ctx, &param);
+    if (err == 0)
+    {
+        boot_phase_done(BOOT_PHASE_FIRST_PUBLISH);
+        metrics_inc(METRIC_PUBLISHES);
+        metrics_add(METRIC_PUBLISH_BYTES, msg->len);
+    }
+    else
+    {
+        metrics_inc(METRIC_PUBLISH_ERRORS);
+    }
+
+    if (err == 0 && link_lost_at >= 0)
+    {
+        uint32_t recovery_ms = k_uptime_get() - link_lost_at;
+
+        link_lost_at = -1;
+
+        k_mutex_lock(&mqtt_mutex, K_FOREVER);
+        link_stats.last_recovery_ms = recovery_ms;
+        link_stats.max_recovery_ms = MAX(link_stats.max_recovery_ms, recovery_ms);
+        k_mutex_unlock(&mqtt_mutex);
+
+        LOG_INF(LOG_PREFIX_MQTT "First publish %u ms after losing the connection", recovery_ms);
+    }
+
+    return err;
 }
 
-static void prepare_fds(struct mqtt_client *client)
+/* Send everything publishers have queued since the last call, priority
+ * messages first, even if they were queued while sending the others
+ */
+static int send_queued(void)
 {
-    if (client->transport.type == MQTT_TRANSPORT_SECURE)
-    {
-        fds[0].fd = client->transport.tls.sock;
-    }
-    else
+    uint8_t index;
+    int err;
+
+    while (k_msgq_get(&priority_msgq, &index, K_NO_WAIT) == 0 ||
+           k_msgq_get(&outgoing_msgq, &index, K_NO_WAIT) == 0)
     {
-        fds[0].fd = client->transport.tcp.sock;
+        inflight_msg_t *msg = &inflight[index];
+
+        err = send_inflight(msg, false);
+        if (err)
+        {
+            LOG_ERR(LOG_PREFIX_MQTT "Failed to publish to %s, error: %d", msg->topic, err);
+        }
+
+        if (msg->qos == MQTT_QOS_0_AT_MOST_ONCE)
+        {
+            /* Nothing to wait for, and nothing to retransmit if it failed */
+            free_inflight(msg);
+        }
+        else
+        {
+            /* Now awaiting acknowledgement, retransmitted after a reconnect */
+            k_mutex_lock(&mqtt_mutex, K_FOREVER);
+            msg->queued = false;
+            k_mutex_unlock(&mqtt_mutex);
+        }
+
+        if (err)
+        {
+            /* Messages still queued are sent once the connection is back */
+            abort_connection();
+            return err;
+        }
     }
-    fds[0].events = ZSOCK_POLLIN;
-    nfds = 1;
-}
 
-static void clear_fds(void)
-{
-    nfds = 0;
+    return 0;
 }
 
-static int wait(int timeout)
+/* Resend every unacknowledged message after a reconnect, stops at the
+ * first send that fails and returns its error
+ */
+static int retransmit_inflight(struct mqtt_client *const client)
 {
-    int ret = 0;
+    int err;
 
-    if (nfds > 0)
+    for (int i = 0; i < ARRAY_SIZE(inflight); i++)
     {
-        ret = zsock_poll(fds, nfds, timeout);
-        if (ret < 0)
+        inflight_msg_t *msg = &inflight[i];
+        bool sent;
+
+        /* Queued messages have not been sent yet, send_queued handles them */
+        k_mutex_lock(&mqtt_mutex, K_FOREVER);
+        sent = msg->used && !msg->queued;
+        k_mutex_unlock(&mqtt_mutex);
+
+        if (!sent)
+        {
+            continue;
+        }
+
+        if (msg->released)
+        {
+            /* The broker has the message, only the release is outstanding */
+            const struct mqtt_pubrel_param rel_param = {
+                .message_id = msg->message_id};
+
+            err = mqtt_publish_qos2_release(client, &rel_param);
+        }
+        else
+        {
+            err = send_inflight(msg, true);
+        }
+
+        if (err)
         {
-            LOG_ERR(LOG_PREFIX_NET "poll error: %d", errno);
+            LOG_ERR(LOG_PREFIX_MQTT "Failed to retransmit message id %u: %d", msg->message_id, err);
+            return err;
         }
+
+        LOG_INF(LOG_PREFIX_MQTT "Retransmitted message id %u", msg->message_id);
     }
 
-    return ret;
+    return 0;
 }
 
 void mqtt_evt_handler(struct mqtt_client *const client,
@@ -328,13 +1126,40 @@ void mqtt_evt_handler(struct mqtt_client *const client,
     case MQTT_EVT_CONNACK:
         if (evt->result != 0)
         {
+            /* Refused, give up on this attempt without waiting for the deadline */
             LOG_ERR(LOG_PREFIX_MQTT "MQTT connection failed %d", evt->result);
+            link_deadline = k_uptime_get();
             break;
         }
 
-        mqtt_connected = true;
+        set_connected(true);
         LOG_INF(LOG_PREFIX_MQTT "MQTT client connected!");
 
+        /* Messages from the previous connection were never acknowledged. With
+         * a resumed session the broker still has their state, so this
+         * completes the exchanges rather than repeating them.
+         */
+        if (retransmit_inflight(client))
+        {
+            /* The rest are marked sent and would hold the in-flight window
+             * until the next reconnect, start over now instead. Aborting
+             * inside the event handler is not safe, advance_link does it.
+             */
+            link_deadline = k_uptime_get();
+            break;
+        }
+
+        if (evt->param.connack.session_present_flag)
+        {
+            /* The broker kept the subscription and delivers the config
+             * commands queued while the hub was away
+             */
+            LOG_INF(LOG_PREFIX_MQTT "Resumed session, already subscribed to %s",
+                    MQTT_TOPIC_CONFIG_SEND);
+            link_up();
+            break;
+        }
+
         /* Subscribe to configuration topic - USING QoS 1 INSTEAD OF QoS 2 */
         struct mqtt_topic subscribe_topic = {
             .topic = {
@@ -345,7 +1170,7 @@ void mqtt_evt_handler(struct mqtt_client *const client,
         const struct mqtt_subscription_list subscription_list = {
             .list = &subscribe_topic,
             .list_count = 1,
-            .message_id = 1};
+            .message_id = allocate_message_id()};
 
         err = mqtt_subscribe(client, &subscription_list);
         if (err)
@@ -358,11 +1183,14 @@ void mqtt_evt_handler(struct mqtt_client *const client,
             LOG_INF(LOG_PREFIX_MQTT "Subscribed to topic: %s", MQTT_TOPIC_CONFIG_SEND);
         }
 
+        /* Publishing may start, the connection counts once SUBACK is in */
+        link_state = LINK_SUBSCRIBING;
+        link_deadline = k_uptime_get() + (err ? 0 : APP_CONNECT_TIMEOUT_MS);
         break;
 
     case MQTT_EVT_DISCONNECT:
         LOG_INF(LOG_PREFIX_MQTT "MQTT client disconnected %d", evt->result);
-        mqtt_connected = false;
+        set_connected(false);
         clear_fds();
         break;
 
@@ -492,6 +1320,15 @@ void mqtt_evt_handler(struct mqtt_client *const client,
             break;
         }
 
+        /* Remember the broker has the message, a retransmit only needs PUBREL */
+        k_mutex_lock(&mqtt_mutex, K_FOREVER);
+        inflight_msg_t *msg = find_inflight(evt->param.pubrec.message_id);
+        if (msg)
+        {
+            msg->released = true;
+        }
+        k_mutex_unlock(&mqtt_mutex);
+
         /* For QoS 2, we need to send a PUBREL */
         const struct mqtt_pubrel_param rel_param = {
             .message_id = evt->param.pubrec.message_id};
@@ -536,10 +1373,27 @@ void mqtt_evt_handler(struct mqtt_client *const client,
             break;
         }
         LOG_INF(LOG_PREFIX_MQTT "PUBCOMP packet id: %u", evt->param.pubcomp.message_id);
+        complete_inflight(evt->param.pubcomp.message_id);
+        break;
+
+    case MQTT_EVT_PUBACK:
+        if (evt->result != 0)
+        {
+            LOG_ERR(LOG_PREFIX_MQTT "MQTT PUBACK error %d", evt->result);
+            break;
+        }
+
+        LOG_INF(LOG_PREFIX_MQTT "PUBACK packet id: %u", evt->param.puback.message_id);
+        complete_inflight(evt->param.puback.message_id);
         break;
 
     case MQTT_EVT_SUBACK:
         LOG_INF(LOG_PREFIX_MQTT "SUBACK packet id: %u", evt->param.suback.message_id);
+
+        if (link_state == LINK_SUBSCRIBING)
+        {
+            link_up();
+        }
         break;
 
     case MQTT_EVT_PINGRESP:
@@ -558,6 +1412,15 @@ int elfryd_mqtt_client_init(void)
 
     LOG_INF(LOG_PREFIX_MQTT "Initializing MQTT client...");
 
+#ifdef CONFIG_SETTINGS
+    /* Without settings nothing is cached, but the hub still works */
+    err = settings_subsys_init();
+    if (err)
+    {
+        LOG_WRN(LOG_PREFIX_MQTT "Settings unavailable: %d", err);
+    }
+#endif
+
     /* Set up LTE connection */
     err = setup_lte();
     if (err)
@@ -566,26 +1429,39 @@ int elfryd_mqtt_client_init(void)
         return err;
     }
 
-    /* Initialize broker address */
-    err = get_mqtt_broker_addrinfo();
-    if (err)
+    /* Registration takes seconds, let it run while the rest is set up. If
+     * it cannot start now the I/O thread retries.
+     */
+    if (lte_manager_attach() == 0)
     {
-        LOG_ERR(LOG_PREFIX_MQTT "Failed to get broker address, error: %d", err);
-        return err;
+        wait_for_registration();
     }
 
+    setup_client_id();
+
+#ifdef CONFIG_ELFRYD_DNS_CACHE
+    dns_cache_load();
+#endif
+
     /* Configure MQTT client */
     mqtt_client_init(&client_ctx);
 
     client_ctx.broker = &broker;
     client_ctx.evt_cb = mqtt_evt_handler;
-    client_ctx.client_id.utf8 = (uint8_t *)MQTT_CLIENTID;
-    client_ctx.client_id.size = strlen(MQTT_CLIENTID);
+    client_ctx.client_id.utf8 = (uint8_t *)client_id;
+    client_ctx.client_id.size = strlen(client_id);
     client_ctx.password = NULL;
     client_ctx.user_name = NULL;
     client_ctx.protocol_version = MQTT_VERSION_3_1_1;
     client_ctx.transport.type = MQTT_TRANSPORT_SECURE;
+#ifdef CONFIG_ELFRYD_MQTT_PERSISTENT_SESSION
+    /* The broker keeps the subscription, queued config commands and QoS
+     * state while the hub is away
+     */
+    client_ctx.clean_session = 0;
+#else
     client_ctx.clean_session = 1;
+#endif
 
     /* Set TLS configuration */
     struct mqtt_sec_config *tls_config = &client_ctx.transport.tls.config;
@@ -599,235 +1475,334 @@ int elfryd_mqtt_client_init(void)
     tls_config->sec_tag_count = 1;
     tls_config->hostname = SERVER_HOST;
 
+#ifdef CONFIG_ELFRYD_TLS_SESSION_CACHE
+    /* The modem keeps the session for SEC_TAG, so a reconnect resumes it with
+     * an abbreviated handshake instead of a full one with certificate checks
+     */
+    tls_config->session_cache = TLS_SESSION_CACHE_ENABLED;
+#else
+    tls_config->session_cache = TLS_SESSION_CACHE_DISABLED;
+#endif
+
     /* Setup MQTT buffers */
     client_ctx.rx_buf = rx_buffer;
     client_ctx.rx_buf_size = sizeof(rx_buffer);
     client_ctx.tx_buf = tx_buffer;
     client_ctx.tx_buf_size = sizeof(tx_buffer);
 
+    /* Start the socket watcher, it idles until the first connection */
+    k_poll_signal_init(&socket_signal);
+    k_thread_create(&socket_watcher_data, socket_watcher_stack,
+                    K_THREAD_STACK_SIZEOF(socket_watcher_stack),
+                    socket_watcher_fn, NULL, NULL, NULL,
+                    SOCKET_WATCHER_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&socket_watcher_data, "mqtt_socket_watcher");
+
     LOG_INF(LOG_PREFIX_MQTT "MQTT client initialized");
 
     return 0;
 }
 
-int mqtt_client_connect(void)
+int mqtt_client_disconnect(void)
 {
     int err;
-    int retry_count = 0;
-    int max_retries = CONFIG_MQTT_CONNECT_ATTEMPTS;
-
-    k_mutex_lock(&mqtt_mutex, K_FOREVER);
 
-    if (mqtt_connected)
+    if (!mqtt_client_is_connected())
     {
-        LOG_INF(LOG_PREFIX_MQTT "Already connected to MQTT broker");
-        k_mutex_unlock(&mqtt_mutex);
+        LOG_INF(LOG_PREFIX_MQTT "Not connected to MQTT broker");
         return 0;
     }
 
-    /* Verify DNS resolution happened */
-    if (!dns_resolved)
+    err = mqtt_disconnect(&client_ctx);
+    if (err)
     {
-        err = get_mqtt_broker_addrinfo();
-        if (err)
-        {
-            LOG_ERR(LOG_PREFIX_MQTT "Failed to resolve MQTT broker hostname, error: %d", err);
-            k_mutex_unlock(&mqtt_mutex);
-            return err;
-        }
+        LOG_ERR(LOG_PREFIX_MQTT "Failed to disconnect from MQTT broker, error: %d", err);
     }
-
-    /* Try connecting with retries */
-    while (retry_count < max_retries && !mqtt_connected)
+    else
     {
-        LOG_INF(LOG_PREFIX_MQTT "Attempting to connect to MQTT broker: %s:%d... (attempt %d/%d)",
-                SERVER_HOST, SERVER_PORT, retry_count + 1, max_retries);
+        LOG_INF(LOG_PREFIX_MQTT "Disconnected from MQTT broker");
+    }
 
-        err = mqtt_connect(&client_ctx);
-        if (err)
-        {
-            LOG_ERR(LOG_PREFIX_MQTT "Failed to connect to MQTT broker, error: %d", err);
-            retry_count++;
-            k_sleep(K_MSEC(CONFIG_MQTT_CONNECT_RETRY_DELAY_MS));
-            continue;
-        }
+    set_connected(false);
+
+    return err;
+}
 
-        prepare_fds(&client_ctx);
+void mqtt_client_get_link_stats(mqtt_link_stats_t *stats)
+{
+    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    *stats = link_stats;
+    k_mutex_unlock(&mqtt_mutex);
+}
 
-        /* Wait for the connection to complete */
-        if (wait(APP_CONNECT_TIMEOUT_MS))
-        {
-            err = mqtt_input(&client_ctx);
-            if (err)
-            {
-                LOG_ERR(LOG_PREFIX_MQTT "MQTT input error: %d", err);
-            }
-        }
+bool mqtt_client_is_connected(void)
+{
+    bool connected;
+
+    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    connected = mqtt_connected;
+    k_mutex_unlock(&mqtt_mutex);
+
+    return connected;
+}
+
+int mqtt_client_process(int timeout)
+{
+    struct k_poll_event events[] = {
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &socket_signal),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &link_signal),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_MSGQ_DATA_AVAILABLE,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &outgoing_msgq),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_MSGQ_DATA_AVAILABLE,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &priority_msgq),
+    };
+    /* Queued messages wait for the connection, polling them before would spin */
+    int count = mqtt_client_is_connected() ? ARRAY_SIZE(events) : 2;
+    int keepalive;
+    int err;
+#ifdef CONFIG_ELFRYD_LTE_RAI
+    bool quiet;
+#endif
+
+    /* Never sleep past the next step of bringing the connection up */
+    if (link_state != LINK_CONNECTED)
+    {
+        int64_t due = link_state == LINK_ATTACHING || link_state >= LINK_CONNACK
+                          ? link_deadline
+                          : link_retry_at;
+        int left = (int)CLAMP(due - k_uptime_get(), 0, INT_MAX);
 
-        if (!mqtt_connected)
+        if (timeout < 0 || left < timeout)
         {
-            LOG_ERR(LOG_PREFIX_MQTT "MQTT connection failed or timed out");
-            mqtt_abort(&client_ctx);
-            retry_count++;
-            k_sleep(K_MSEC(CONFIG_MQTT_CONNECT_RETRY_DELAY_MS));
+            timeout = left;
         }
     }
 
-    if (!mqtt_connected)
+    /* Never sleep past the next keepalive ping */
+    keepalive = nfds > 0 ? mqtt_keepalive_time_left(&client_ctx) : -1;
+    if (keepalive >= 0 && (timeout < 0 || keepalive < timeout))
     {
-        LOG_ERR(LOG_PREFIX_MQTT "Failed to connect to MQTT broker after %d attempts", max_retries);
-        k_mutex_unlock(&mqtt_mutex);
-        return -ETIMEDOUT;
+        timeout = keepalive;
     }
 
-    /* Send a ping to verify the connection */
-    err = mqtt_ping(&client_ctx);
-    if (err)
+#ifdef CONFIG_ELFRYD_LTE_RAI
+    /* Wake up to let the radio go once the exchange has settled */
+    if (rai_pending && (timeout < 0 || timeout > RAI_LINGER_MS))
+    {
+        timeout = RAI_LINGER_MS;
+    }
+#endif
+
+    /* Wait for socket input, modem events or outgoing messages, whichever
+     * comes first
+     */
+    err = k_poll(events, count, timeout < 0 ? K_FOREVER : K_MSEC(timeout));
+    if (err && err != -EAGAIN)
     {
-        LOG_ERR(LOG_PREFIX_MQTT "Failed to ping MQTT broker: %d", err);
-        mqtt_abort(&client_ctx);
-        mqtt_connected = false;
-        k_mutex_unlock(&mqtt_mutex);
         return err;
     }
 
-    /* Process the ping response */
-    if (wait(APP_CONNECT_TIMEOUT_MS))
+#ifdef CONFIG_ELFRYD_LTE_RAI
+    /* Something to receive or send, the radio stays up a while longer */
+    quiet = err == -EAGAIN;
+    rai_pending |= !quiet;
+#endif
+
+    if (events[1].state == K_POLL_STATE_SIGNALED)
+    {
+        k_poll_signal_reset(&link_signal);
+        handle_link_events();
+    }
+
+    if (events[0].state == K_POLL_STATE_SIGNALED && nfds > 0)
     {
+        k_poll_signal_reset(&socket_signal);
+
         err = mqtt_input(&client_ctx);
         if (err)
         {
-            LOG_ERR(LOG_PREFIX_MQTT "Error processing ping response: %d", err);
-            mqtt_abort(&client_ctx);
-            mqtt_connected = false;
-            k_mutex_unlock(&mqtt_mutex);
+            LOG_ERR(LOG_PREFIX_MQTT "Error in MQTT input: %d", err);
+            abort_connection();
             return err;
         }
+
+        if (nfds > 0)
+        {
+            arm_socket_watcher();
+        }
     }
-    else
+
+    if (link_state >= LINK_CONNACK && nfds == 0)
     {
-        LOG_ERR(LOG_PREFIX_MQTT "Ping response timeout");
+        /* Closed by the broker or mqtt_client_disconnect, the client has
+         * already cleaned up
+         */
+        schedule_retry(link_state != LINK_CONNECTED);
     }
 
-    k_mutex_unlock(&mqtt_mutex);
-    return 0;
-}
-
-int mqtt_client_disconnect(void)
-{
-    int err;
-
-    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    if (link_state != LINK_CONNECTED)
+    {
+        advance_link();
+    }
 
-    if (!mqtt_connected)
+    if (!mqtt_client_is_connected())
     {
-        LOG_INF(LOG_PREFIX_MQTT "Not connected to MQTT broker");
-        k_mutex_unlock(&mqtt_mutex);
-        return 0;
+        return -ENOTCONN;
     }
 
-    err = mqtt_disconnect(&client_ctx);
-    if (err)
+    if (count > 2 &&
+        (events[2].state == K_POLL_STATE_MSGQ_DATA_AVAILABLE ||
+         events[3].state == K_POLL_STATE_MSGQ_DATA_AVAILABLE))
     {
-        LOG_ERR(LOG_PREFIX_MQTT "Failed to disconnect from MQTT broker, error: %d", err);
+        err = send_queued();
+        if (err)
+        {
+            return err;
+        }
     }
-    else
+
+    /* Sends PINGREQ once the keepalive is due, does nothing before that */
+    err = mqtt_live(&client_ctx);
+    if (err && err != -EAGAIN)
     {
-        LOG_INF(LOG_PREFIX_MQTT "Disconnected from MQTT broker");
+        LOG_ERR(LOG_PREFIX_MQTT "Failed to send keepalive: %d", err);
+        abort_connection();
+        return err;
     }
 
-    mqtt_connected = false;
+#ifdef CONFIG_ELFRYD_LTE_RAI
+    /* Nothing happened for a while and nothing awaits an answer, tell the
+     * network to release the RRC connection instead of waiting for its
+     * inactivity timer
+     */
+    if (rai_pending && quiet && link_idle())
+    {
+        if (lte_manager_rrc_connected())
+        {
+            lte_manager_release(fds[0].fd);
+        }
+        rai_pending = false;
+    }
+#endif
 
-    k_mutex_unlock(&mqtt_mutex);
-    return err;
+    return 0;
 }
 
-bool mqtt_client_is_connected(void)
+int mqtt_client_publish(const char *topic, const char *message, enum mqtt_qos qos)
 {
-    bool connected;
-
-    k_mutex_lock(&mqtt_mutex, K_FOREVER);
-    connected = mqtt_connected;
-    k_mutex_unlock(&mqtt_mutex);
-
-    return connected;
+    return mqtt_client_publish_payload(topic, (const uint8_t *)message, strlen(message), qos);
 }
 
-int mqtt_client_process(int timeout)
+/* Queue a message for the I/O thread, QoS 1/2 messages keep their slot until acked */
+static int publish_message(const char *topic, const uint8_t *payload, size_t len,
+                           enum mqtt_qos qos, bool tracked, uint32_t token,
+                           k_timeout_t slot_timeout, bool priority)
 {
-    int err;
+    struct k_sem *free_slots = priority ? &priority_free : &inflight_free;
+    uint8_t first = priority ? CONFIG_MQTT_INFLIGHT_WINDOW : 0;
+    uint8_t last = priority ? ARRAY_SIZE(inflight) : CONFIG_MQTT_INFLIGHT_WINDOW;
+    inflight_msg_t *msg = NULL;
+    uint8_t index = 0;
+
+    if (len > APP_MQTT_BUFFER_SIZE)
+    {
+        LOG_ERR(LOG_PREFIX_MQTT "Message too long for payload buffer");
+        return -ENOMEM;
+    }
+
+    /* Wait for a slot without holding the mutex, acks need it to free one */
+    if (k_sem_take(free_slots,
+                   qos == MQTT_QOS_0_AT_MOST_ONCE ? K_NO_WAIT : slot_timeout) != 0)
+    {
+        LOG_WRN(LOG_PREFIX_MQTT "In-flight window full, cannot publish to %s", topic);
+        metrics_inc(METRIC_WINDOW_FULL);
+        return -EBUSY;
+    }
 
     k_mutex_lock(&mqtt_mutex, K_FOREVER);
 
     if (!mqtt_connected)
     {
         k_mutex_unlock(&mqtt_mutex);
+        k_sem_give(free_slots);
+        LOG_ERR(LOG_PREFIX_MQTT "Not connected to MQTT broker");
         return -ENOTCONN;
     }
 
-    /* Process MQTT events */
-    err = wait(timeout);
-    if (err < 0)
+    for (index = first; index < last; index++)
     {
-        k_mutex_unlock(&mqtt_mutex);
-        return err;
+        if (!inflight[index].used)
+        {
+            msg = &inflight[index];
+            break;
+        }
     }
 
-    err = mqtt_input(&client_ctx);
-    if (err)
-    {
-        LOG_ERR(LOG_PREFIX_MQTT "Error in MQTT input: %d", err);
-        mqtt_abort(&client_ctx);
-        mqtt_connected = false;
-        clear_fds();
-    }
+    /* The semaphore guarantees a free slot */
+    __ASSERT_NO_MSG(msg != NULL);
+
+    /* Keep a copy for sending and retransmission, the caller may reuse its buffer */
+    memcpy(msg->payload, payload, len);
+    msg->used = true;
+    msg->queued = true;
+    msg->released = false;
+    msg->tracked = tracked;
+    msg->message_id = allocate_message_id();
+    msg->qos = qos;
+    msg->topic = topic;
+    msg->token = token;
+    msg->len = len;
 
     k_mutex_unlock(&mqtt_mutex);
-    return err;
+
+    /* Wakes the I/O thread, the queue has room for every slot so this cannot fail */
+    k_msgq_put(priority ? &priority_msgq : &outgoing_msgq, &index, K_NO_WAIT);
+
+    return 0;
 }
 
-int mqtt_client_publish(const char *topic, const char *message, enum mqtt_qos qos)
+int mqtt_client_publish_payload(const char *topic, const uint8_t *payload, size_t len,
+                                enum mqtt_qos qos)
 {
-    int err;
-
-    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    /* Never wait here, this is also called from the MQTT event handler */
+    return publish_message(topic, payload, len, qos, false, 0, K_NO_WAIT, false);
+}
 
-    if (!mqtt_connected)
-    {
-        LOG_ERR(LOG_PREFIX_MQTT "Not connected to MQTT broker");
-        k_mutex_unlock(&mqtt_mutex);
-        return -ENOTCONN;
-    }
+int mqtt_client_publish_tracked(const char *topic, const uint8_t *payload, size_t len,
+                                enum mqtt_qos qos, uint32_t token)
+{
+    return publish_message(topic, payload, len, qos, true, token,
+                           K_MSEC(CONFIG_MQTT_INFLIGHT_WAIT_MS), false);
+}
 
-    /* Copy message to payload buffer */
-    size_t message_len = strlen(message);
-    if (message_len > sizeof(payload_buffer))
-    {
-        LOG_ERR(LOG_PREFIX_MQTT "Message too long for payload buffer");
-        k_mutex_unlock(&mqtt_mutex);
-        return -ENOMEM;
-    }
+int mqtt_client_publish_priority(const char *topic, const uint8_t *payload, size_t len,
+                                 enum mqtt_qos qos)
+{
+    return publish_message(topic, payload, len, qos, false, 0, K_NO_WAIT, true);
+}
 
-    memcpy(payload_buffer, message, message_len);
+void mqtt_client_set_ack_handler(mqtt_client_ack_cb_t handler)
+{
+    k_mutex_lock(&mqtt_mutex, K_FOREVER);
+    ack_handler = handler;
+    k_mutex_unlock(&mqtt_mutex);
+}
 
-    /* Prepare MQTT publish structure */
-    struct mqtt_publish_param param = {
-        .message.topic.qos = qos,
-        .message.topic.topic.utf8 = (uint8_t *)topic,
-        .message.topic.topic.size = strlen(topic),
-        .message.payload.data = payload_buffer,
-        .message.payload.len = message_len,
-        .message_id = sys_rand32_get(),
-        .dup_flag = 0,
-        .retain_flag = 0};
+size_t mqtt_client_max_payload_size(const char *topic)
+{
+    /* Fixed header, topic length and name, and packet identifier */
+    size_t overhead = MQTT_PUBLISH_FIXED_HEADER_MAX + 2 + strlen(topic) + 2;
 
-    /* Publish the message */
-    err = mqtt_publish(&client_ctx, &param);
-    if (err)
+    if (overhead >= APP_MQTT_BUFFER_SIZE)
     {
-        LOG_ERR(LOG_PREFIX_MQTT "Failed to publish to %s, error: %d", topic, err);
+        return 0;
     }
 
-    k_mutex_unlock(&mqtt_mutex);
-    return err;
-}
\ No newline at end of file
+    return APP_MQTT_BUFFER_SIZE - overhead;
+}
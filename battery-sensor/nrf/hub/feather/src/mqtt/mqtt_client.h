@@ -7,12 +7,19 @@
 #define MQTT_CLIENT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <zephyr/net/mqtt.h>
 
 /* MQTT topic definitions from Kconfig */
 #define MQTT_TOPIC_BATTERY CONFIG_MQTT_TOPIC_BATTERY
 #define MQTT_TOPIC_TEMP CONFIG_MQTT_TOPIC_TEMP
 #define MQTT_TOPIC_GYRO CONFIG_MQTT_TOPIC_GYRO
+#define MQTT_TOPIC_STATS CONFIG_MQTT_TOPIC_STATS
+#define MQTT_TOPIC_MOTION CONFIG_MQTT_TOPIC_MOTION
+#define MQTT_TOPIC_BATCH CONFIG_MQTT_TOPIC_BATCH
+#define MQTT_TOPIC_ALARM CONFIG_MQTT_TOPIC_ALARM
+#define MQTT_TOPIC_BOOT CONFIG_MQTT_TOPIC_BOOT
+#define MQTT_TOPIC_METRICS CONFIG_MQTT_TOPIC_METRICS
 #define MQTT_TOPIC_CONFIG_SEND CONFIG_MQTT_TOPIC_CONFIG_SEND
 #define MQTT_TOPIC_CONFIG_CONFIRM CONFIG_MQTT_TOPIC_CONFIG_CONFIRM
 
@@ -25,27 +32,57 @@
 #define APP_MQTT_BUFFER_SIZE CONFIG_MQTT_BUFFER_SIZE
 #define APP_CONNECT_TIMEOUT_MS CONFIG_MQTT_CONNECT_TIMEOUT_MS
 
+/** Connection recovery figures, see mqtt_client_get_link_stats */
+typedef struct
+{
+    uint32_t reconnects;       /* Connections re-established after losing one */
+    uint32_t last_connect_ms;  /* TCP and TLS handshake of the last connection */
+    uint32_t last_recovery_ms; /* Losing the last connection to the first publish after it */
+    uint32_t max_recovery_ms;  /* Longest recovery since boot */
+} mqtt_link_stats_t;
+
 /**
- * Initialize the MQTT client and connect to the broker
+ * Callback for acknowledged tracked publishes
  *
- * @return 0 on success, negative error code on failure
+ * Called from the MQTT processing thread when the broker has acknowledged a
+ * message published with mqtt_client_publish_tracked (PUBACK for QoS 1,
+ * PUBCOMP for QoS 2).
+ *
+ * @param token Token the message was published with
  */
-int elfryd_mqtt_client_init(void);
+typedef void (*mqtt_client_ack_cb_t)(uint32_t token);
 
 /**
- * Connect to the MQTT broker
+ * Initialize the MQTT client
+ *
+ * Prepares the modem and the client. The connection is brought up by
+ * mqtt_client_process.
  *
  * @return 0 on success, negative error code on failure
  */
-int mqtt_client_connect(void);
+int elfryd_mqtt_client_init(void);
 
 /**
  * Disconnect from the MQTT broker
  *
+ * Must only be called from the thread that calls mqtt_client_process, which
+ * connects again after the retry delay.
+ *
  * @return 0 on success, negative error code on failure
  */
 int mqtt_client_disconnect(void);
 
+/**
+ * Get the connection recovery figures
+ *
+ * Time to first publish counts from losing an established connection to
+ * the first PUBLISH sent on the next one, including retries and any new
+ * attach in between.
+ *
+ * @param stats Filled with the figures since boot
+ */
+void mqtt_client_get_link_stats(mqtt_link_stats_t *stats);
+
 /**
  * Check if connected to the MQTT broker
  *
@@ -54,21 +91,109 @@ int mqtt_client_disconnect(void);
 bool mqtt_client_is_connected(void);
 
 /**
- * Process MQTT events
+ * Bring the connection up and process MQTT events
  *
- * @param timeout Timeout in milliseconds for event processing
- * @return 0 on success, negative error code on failure
+ * The thread calling this owns the client. While disconnected it steps
+ * through LTE attach, DNS lookup, TLS and MQTT CONNECT and the subscription,
+ * backing off exponentially with jitter after failures and reattaching to
+ * the network after CONFIG_MQTT_CONNECT_ATTEMPTS of them in a row. Losing
+ * and regaining registration or changing cell is handled as it happens.
+ *
+ * Once connected it sleeps until the socket has input or another thread
+ * queues a message, so queued publishes go out without delay, and wakes in
+ * time to send the keepalive ping. No step sleeps and the client mutex is
+ * not held while waiting, so publishers are never blocked.
+ *
+ * @param timeout Longest time to wait in milliseconds, SYS_FOREVER_MS to wait
+ *                until there is something to do
+ * @return 0 on success, -ENOTCONN while not connected,
+ *         other negative error code if the connection was lost
  */
 int mqtt_client_process(int timeout);
 
 /**
  * Publish a message to the MQTT broker (internal function)
  *
- * @param topic   Topic to publish the message to
+ * The message is copied and queued for the MQTT processing thread, which
+ * sends it right away. Never waits for an in-flight slot.
+ *
+ * @param topic   Topic to publish the message to, must stay valid until sent
  * @param message Message to publish
  * @param qos     MQTT QoS level
- * @return        0 on success, negative error code on failure
+ * @return        0 once queued, -EBUSY if the in-flight window is full,
+ *                other negative error code on failure
  */
 int mqtt_client_publish(const char *topic, const char *message, enum mqtt_qos qos);
 
+/**
+ * Publish a payload of a given length to the MQTT broker (internal function)
+ *
+ * The payload is copied and queued for the MQTT processing thread, which
+ * sends it right away. Never waits for an in-flight slot.
+ *
+ * @param topic   Topic to publish the payload to, must stay valid until sent
+ * @param payload Payload to publish, need not be NUL terminated
+ * @param len     Length of the payload in bytes
+ * @param qos     MQTT QoS level
+ * @return        0 once queued, -EBUSY if the in-flight window is full,
+ *                other negative error code on failure
+ */
+int mqtt_client_publish_payload(const char *topic, const uint8_t *payload, size_t len,
+                                enum mqtt_qos qos);
+
+/**
+ * Publish a payload and report its acknowledgement
+ *
+ * The payload is copied into one of CONFIG_MQTT_INFLIGHT_WINDOW in-flight
+ * slots, waiting up to CONFIG_MQTT_INFLIGHT_WAIT_MS for one to free up, and
+ * queued for the MQTT processing thread to send. The slot is kept until the
+ * broker acknowledges the message, and the message is retransmitted with the
+ * DUP flag if the connection drops before that. Once acknowledged, the
+ * handler set with mqtt_client_set_ack_handler is called with the given
+ * token.
+ *
+ * @param topic   Topic to publish the payload to, must stay valid until acked
+ * @param payload Payload to publish, need not be NUL terminated
+ * @param len     Length of the payload in bytes
+ * @param qos     MQTT QoS level, 1 or 2
+ * @param token   Caller defined value passed to the ack handler
+ * @return        0 once queued, -EBUSY if no in-flight slot became free,
+ *                other negative error code on failure
+ */
+int mqtt_client_publish_tracked(const char *topic, const uint8_t *payload, size_t len,
+                                enum mqtt_qos qos, uint32_t token);
+
+/**
+ * Publish a payload ahead of everything else queued
+ *
+ * Uses an in-flight slot reserved for priority messages, so it never waits
+ * for sensor batches to be acknowledged, and the MQTT processing thread
+ * sends it before any other queued message. Meant for rare, urgent
+ * messages such as alarms and config confirmations.
+ *
+ * @param topic   Topic to publish the payload to, must stay valid until acked
+ * @param payload Payload to publish, need not be NUL terminated
+ * @param len     Length of the payload in bytes
+ * @param qos     MQTT QoS level
+ * @return        0 once queued, -EBUSY if the priority slots are still in use,
+ *                other negative error code on failure
+ */
+int mqtt_client_publish_priority(const char *topic, const uint8_t *payload, size_t len,
+                                 enum mqtt_qos qos);
+
+/**
+ * Set the handler called when a tracked publish is acknowledged
+ *
+ * @param handler Handler to call, or NULL to disable notifications
+ */
+void mqtt_client_set_ack_handler(mqtt_client_ack_cb_t handler);
+
+/**
+ * Get the largest payload that fits in one PUBLISH packet on a topic
+ *
+ * @param topic Topic the payload will be published to
+ * @return      Maximum payload size in bytes
+ */
+size_t mqtt_client_max_payload_size(const char *topic);
+
 #endif /* MQTT_CLIENT_H */
\ No newline at end of file
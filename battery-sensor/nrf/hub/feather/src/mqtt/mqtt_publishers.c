@@ -8,6 +8,7 @@
 #include <zephyr/random/rand32.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <zephyr/logging/log.h>
 
@@ -15,226 +16,960 @@
 #include "mqtt/mqtt_client.h"
 #include "config/config_module.h"
 #include "utils/utils.h"
+#include "utils/boot_phases.h"
+#include "metrics/metrics.h"
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+#include "storage/offline_store.h"
+#endif
 
 /* Register the module with a dedicated log level and prefix */
 LOG_MODULE_REGISTER(mqtt_publishers, LOG_LEVEL_INF);
 #define LOG_PREFIX_PUB "[PUB] "
 
-/* Sensor data publishing */
-int mqtt_client_publish_battery(battery_reading_t *readings, int count)
+/* Binary payload format version, the high bit keeps it apart from text payloads.
+ * Version 0x81 carried timestamps in seconds, 0x82 in milliseconds.
+ */
+#define BINARY_PAYLOAD_VERSION 0x82
+
+/* Largest binary record: two 10 byte varints plus the values of a motion
+ * record, roll, pitch and window length, then three 5 byte varints per axis
+ */
+#define MOTION_VALUES_MAX (3 + 3 + 5 + GYRO_AXES * 3 * 5)
+#define BINARY_RECORD_MAX (10 + 10 + MOTION_VALUES_MAX)
+
+#ifdef CONFIG_ELFRYD_COALESCE
+/* Coalesced frame marker, kept apart from both payload formats.
+ *
+ * Layout of a coalesced frame:
+ *   marker byte | section...
+ * where each section is the topic length byte, the topic, the payload
+ * length as a little-endian uint16 and the payload the sensor type would
+ * have published on that topic on its own.
+ */
+#define FRAME_MARKER 0xB0
+
+/* Every section of a frame is tracked as its own pending chunk */
+#define PENDING_PER_MESSAGE SENSOR_CHANNEL_COUNT
+#else
+#define PENDING_PER_MESSAGE 1
+#endif
+
+/* Payload being assembled from stored readings */
+typedef struct
 {
-    int err;
-    char message[512]; /* Buffer for message */
-    size_t offset = 0;
-    bool first = true;
+    char *buffer;
+    size_t size;
+    size_t offset;
+    int64_t last_timestamp; /* Timestamp of the previous binary record */
+} payload_writer_t;
+
+/* Chunk buffer, one PUBLISH payload plus room for the NUL terminator.
+ * Only the publisher thread serializes readings, so one buffer is enough.
+ */
+static char chunk_buffer[APP_MQTT_BUFFER_SIZE + 1];
+
+/* Sources of published chunks, a sensor channel or replayed offline
+ * batches. The sensor channels double as the tags of batches kept in the
+ * offline store.
+ */
+typedef uint8_t publish_channel_t;
+#define CHANNEL_OFFLINE SENSOR_CHANNEL_COUNT
+#define CHANNEL_COUNT (SENSOR_CHANNEL_COUNT + 1)
+
+/* A published chunk whose data is released once the broker acknowledges it */
+typedef struct
+{
+    bool used;
+    bool acked;
+    publish_channel_t channel;
+    uint32_t order;        /* Publish order within the channel */
+    sensor_cursor_t range; /* Readings in the chunk, unused for replayed batches */
+    int8_t next;           /* Next chunk published in the same frame, -1 if none */
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+    offline_store_loc_t batch; /* Replayed batch, consumed from flash once acked */
+#endif
+} pending_chunk_t;
+
+#define PENDING_CHUNKS (CONFIG_MQTT_INFLIGHT_WINDOW * PENDING_PER_MESSAGE)
+
+/* One pending chunk per in-flight message, or per frame section */
+static pending_chunk_t pending_chunks[PENDING_CHUNKS];
+static uint32_t channel_order[CHANNEL_COUNT];
+
+/* Mutex protecting the pending chunks, which are acked from the MQTT thread */
+static K_MUTEX_DEFINE(pending_mutex);
+static K_SEM_DEFINE(pending_free, PENDING_CHUNKS, PENDING_CHUNKS);
+
+#ifdef CONFIG_ELFRYD_PAYLOAD_BINARY
+/* Encode an unsigned LEB128 varint, returns the number of bytes written */
+static size_t put_varint(uint8_t *buf, uint64_t value)
+{
+    size_t len = 0;
+
+    do
+    {
+        uint8_t byte = value & 0x7F;
+
+        value >>= 7;
+        buf[len++] = byte | (value ? 0x80 : 0);
+    } while (value);
+
+    return len;
+}
+
+/* Encode a signed value as a zigzag varint so small negatives stay short */
+static size_t put_zigzag(uint8_t *buf, int64_t value)
+{
+    return put_varint(buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+/* Encode little-endian signed 16 and 24 bit values */
+static size_t put_int16(uint8_t *buf, int16_t value)
+{
+    buf[0] = (uint16_t)value & 0xFF;
+    buf[1] = ((uint16_t)value >> 8) & 0xFF;
+    return 2;
+}
+
+static size_t put_int24(uint8_t *buf, int32_t value)
+{
+    buf[0] = (uint32_t)value & 0xFF;
+    buf[1] = ((uint32_t)value >> 8) & 0xFF;
+    buf[2] = ((uint32_t)value >> 16) & 0xFF;
+    return 3;
+}
+
+/* Append one binary record, prefixed with its timestamp delta.
+ *
+ * Layout of a binary payload:
+ *   version byte | varint base timestamp | record...
+ * where each record is a zigzag varint delta to the previous record's
+ * timestamp (the first record's delta is relative to the base) followed by
+ * the packed sensor values.
+ */
+static int payload_append_binary(payload_writer_t *writer, int64_t timestamp,
+                                 const uint8_t *values, size_t values_len)
+{
+    uint8_t record[BINARY_RECORD_MAX];
+    size_t len = 0;
+
+    if (writer->offset == 0)
+    {
+        /* First record in this chunk, write the header with the base timestamp */
+        record[len++] = BINARY_PAYLOAD_VERSION;
+        len += put_varint(record + len, (uint64_t)timestamp);
+        writer->last_timestamp = timestamp;
+    }
 
-    /* Format multiple readings with pipe separator */
-    for (int i = 0; i < count && offset < sizeof(message) - 32; i++)
+    len += put_zigzag(record + len, timestamp - writer->last_timestamp);
+    memcpy(record + len, values, values_len);
+    len += values_len;
+
+    /* Keep one byte spare so the buffer size matches the text format */
+    if (writer->offset + len >= writer->size)
     {
-        size_t len;
-        char timestamp_str[24]; /* Dedicated buffer for timestamp */
+        return -ENOMEM;
+    }
+
+    memcpy(writer->buffer + writer->offset, record, len);
+    writer->offset += len;
+    writer->last_timestamp = timestamp;
 
-        /* Format timestamp using the utility function */
-        int ts_len = format_timestamp(readings[i].timestamp, timestamp_str, sizeof(timestamp_str));
-        if (ts_len < 0)
+    return 0;
+}
+#else
+/* Append one formatted reading to the payload, separated by '|' */
+static int payload_append(payload_writer_t *writer, const char *fmt, ...)
+{
+    va_list args;
+    size_t start = writer->offset;
+    int len;
+
+    if (start > 0)
+    {
+        /* Add separator between readings */
+        if (start + 1 >= writer->size)
         {
-            LOG_ERR(LOG_PREFIX_PUB "Error formatting timestamp");
-            continue;
+            return -ENOMEM;
         }
+        writer->buffer[start++] = '|';
+    }
+
+    va_start(args, fmt);
+    len = vsnprintf(writer->buffer + start, writer->size - start, fmt, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= writer->size - start)
+    {
+        /* Reading doesn't fit, drop the partial write and stop here */
+        writer->buffer[writer->offset] = '\0';
+        return -ENOMEM;
+    }
+
+    writer->offset = start + len;
+    return 0;
+}
+#endif /* CONFIG_ELFRYD_PAYLOAD_BINARY */
+
+static int append_battery(const void *reading, void *user_data)
+{
+    const battery_reading_t *battery = reading;
+#ifdef CONFIG_ELFRYD_PAYLOAD_BINARY
+    uint8_t values[3];
+
+    /* Battery ID in the low nibble (IDs 1-16), voltage as int16 */
+    values[0] = (battery->battery_id - 1) & 0x0F;
+    put_int16(&values[1], battery->voltage);
+
+    return payload_append_binary(user_data, battery->timestamp, values, sizeof(values));
+#else
+    char timestamp_str[24]; /* Dedicated buffer for timestamp */
+
+    /* Format timestamp using the utility function */
+    if (format_timestamp(battery->timestamp, timestamp_str, sizeof(timestamp_str)) < 0)
+    {
+        LOG_ERR(LOG_PREFIX_PUB "Error formatting timestamp");
+        return 0; /* Skip this reading */
+    }
+
+    /* Format: "{battery_id}/{voltage}/{timestamp}" */
+    return payload_append(user_data, "%d/%d/%s",
+                          battery->battery_id,
+                          battery->voltage,
+                          timestamp_str);
+#endif
+}
+
+static int append_temp(const void *reading, void *user_data)
+{
+    const temp_reading_t *temp = reading;
+#ifdef CONFIG_ELFRYD_PAYLOAD_BINARY
+    uint8_t values[2];
+
+    put_int16(values, temp->temperature);
+
+    return payload_append_binary(user_data, temp->timestamp, values, sizeof(values));
+#else
+    char timestamp_str[24]; /* Dedicated buffer for timestamp */
+
+    /* Format timestamp using the utility function */
+    if (format_timestamp(temp->timestamp, timestamp_str, sizeof(timestamp_str)) < 0)
+    {
+        LOG_ERR(LOG_PREFIX_PUB "Error formatting timestamp");
+        return 0; /* Skip this reading */
+    }
+
+    /* Format: "{temperature}/{timestamp}" */
+    return payload_append(user_data, "%d/%s",
+                          temp->temperature,
+                          timestamp_str);
+#endif
+}
 
-        if (!first)
+static int append_gyro(const void *reading, void *user_data)
+{
+    const gyro_reading_t *gyro = reading;
+#ifdef CONFIG_ELFRYD_PAYLOAD_BINARY
+    uint8_t values[6 * 3];
+    size_t len = 0;
+
+    /* Accelerometer then gyroscope axes, each as a signed 24-bit value */
+    len += put_int24(values + len, gyro->accel_x);
+    len += put_int24(values + len, gyro->accel_y);
+    len += put_int24(values + len, gyro->accel_z);
+    len += put_int24(values + len, gyro->gyro_x);
+    len += put_int24(values + len, gyro->gyro_y);
+    len += put_int24(values + len, gyro->gyro_z);
+
+    return payload_append_binary(user_data, gyro->timestamp, values, len);
+#else
+    char timestamp_str[24]; /* Dedicated buffer for timestamp */
+
+    /* Format timestamp using the utility function */
+    if (format_timestamp(gyro->timestamp, timestamp_str, sizeof(timestamp_str)) < 0)
+    {
+        LOG_ERR(LOG_PREFIX_PUB "Error formatting timestamp");
+        return 0; /* Skip this reading */
+    }
+
+    /* Format: "{accel_x},{accel_y},{accel_z}/{gyro_x},{gyro_y},{gyro_z}/{timestamp}" */
+    return payload_append(user_data, "%d,%d,%d/%d,%d,%d/%s",
+                          gyro->accel_x,
+                          gyro->accel_y,
+                          gyro->accel_z,
+                          gyro->gyro_x,
+                          gyro->gyro_y,
+                          gyro->gyro_z,
+                          timestamp_str);
+#endif
+}
+
+static int append_stats(const void *reading, void *user_data)
+{
+    const stats_record_t *stats = reading;
+#ifdef CONFIG_ELFRYD_PAYLOAD_BINARY
+    uint8_t values[1 + 6 * 5];
+    size_t len = 0;
+
+    /* Sensor type in the top two bits, channel below, then count, window
+     * length and the statistics as varints
+     */
+    values[len++] = (stats->sensor << 6) | (stats->channel & 0x3F);
+    len += put_varint(values + len, stats->count);
+    len += put_varint(values + len, stats->duration);
+    len += put_zigzag(values + len, stats->min);
+    len += put_zigzag(values + len, stats->max);
+    len += put_zigzag(values + len, stats->mean);
+    len += put_zigzag(values + len, stats->last);
+
+    return payload_append_binary(user_data, stats->timestamp, values, len);
+#else
+    static const char *const sensor_names[] = {
+        [CONFIG_PARAM_BATTERY] = "battery",
+        [CONFIG_PARAM_TEMP] = "temp",
+        [CONFIG_PARAM_GYRO] = "gyro",
+    };
+    char timestamp_str[24]; /* Dedicated buffer for timestamp */
+
+    if (stats->sensor >= ARRAY_SIZE(sensor_names))
+    {
+        return 0; /* Skip this record */
+    }
+
+    /* Format timestamp using the utility function */
+    if (format_timestamp(stats->timestamp, timestamp_str, sizeof(timestamp_str)) < 0)
+    {
+        LOG_ERR(LOG_PREFIX_PUB "Error formatting timestamp");
+        return 0; /* Skip this record */
+    }
+
+    /* Format: "{sensor}/{channel}/{count}/{min}/{max}/{mean}/{last}/{timestamp}/{duration}" */
+    return payload_append(user_data, "%s/%d/%u/%d/%d/%d/%d/%s/%u",
+                          sensor_names[stats->sensor],
+                          stats->channel,
+                          stats->count,
+                          stats->min,
+                          stats->max,
+                          stats->mean,
+                          stats->last,
+                          timestamp_str,
+                          stats->duration);
+#endif
+}
+
+static int append_motion(const void *reading, void *user_data)
+{
+    const motion_record_t *motion = reading;
+#ifdef CONFIG_ELFRYD_PAYLOAD_BINARY
+    uint8_t values[MOTION_VALUES_MAX];
+    size_t len = 0;
+
+    /* Roll, pitch and window length, then RMS, peak and frequency per axis */
+    len += put_zigzag(values + len, motion->roll);
+    len += put_zigzag(values + len, motion->pitch);
+    len += put_varint(values + len, motion->duration);
+    for (int axis = 0; axis < GYRO_AXES; axis++)
+    {
+        len += put_varint(values + len, motion->rms[axis]);
+        len += put_varint(values + len, motion->peak[axis]);
+        len += put_varint(values + len, motion->frequency[axis]);
+    }
+
+    return payload_append_binary(user_data, motion->timestamp, values, len);
+#else
+    char timestamp_str[24]; /* Dedicated buffer for timestamp */
+    const int32_t *rms = motion->rms;
+    const int32_t *peak = motion->peak;
+    const uint32_t *freq = motion->frequency;
+
+    /* Format timestamp using the utility function */
+    if (format_timestamp(motion->timestamp, timestamp_str, sizeof(timestamp_str)) < 0)
+    {
+        LOG_ERR(LOG_PREFIX_PUB "Error formatting timestamp");
+        return 0; /* Skip this record */
+    }
+
+    /* Format: "{roll}/{pitch}/{rms x6}/{peak x6}/{frequency x6}/{timestamp}/{duration}",
+     * axis values separated by commas
+     */
+    return payload_append(user_data,
+                          "%d/%d/%d,%d,%d,%d,%d,%d/%d,%d,%d,%d,%d,%d/%u,%u,%u,%u,%u,%u/%s/%u",
+                          motion->roll, motion->pitch,
+                          rms[0], rms[1], rms[2], rms[3], rms[4], rms[5],
+                          peak[0], peak[1], peak[2], peak[3], peak[4], peak[5],
+                          freq[0], freq[1], freq[2], freq[3], freq[4], freq[5],
+                          timestamp_str,
+                          motion->duration);
+#endif
+}
+
+/* Topic and serializer of one sensor channel */
+typedef struct
+{
+    const char *topic;
+    sensors_peek_cb_t append; /* NULL if the channel stores nothing */
+} channel_format_t;
+
+/* Serializers of channels without storage are left out of the image */
+#define CHANNEL_FORMAT(id, name, type, share, param) \
+    [SENSOR_CHANNEL_##id] = {MQTT_TOPIC_##id, (share) > 0 ? append_##name : NULL},
+static const channel_format_t channel_formats[SENSOR_CHANNEL_COUNT] = {
+    SENSOR_CHANNELS(CHANNEL_FORMAT)
+};
+
+/* Release the data behind an acknowledged chunk */
+static void release_chunk(const pending_chunk_t *chunk)
+{
+    if (chunk->channel < SENSOR_CHANNEL_COUNT)
+    {
+        sensors_commit(chunk->channel, &chunk->range);
+    }
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+    else if (chunk->channel == CHANNEL_OFFLINE)
+    {
+        offline_store_consume(&chunk->batch);
+    }
+#endif
+}
+
+/* Release the acknowledged chunks at the front of a channel. Acks can arrive
+ * out of order, but data is released strictly in publish order.
+ * Must be called with pending_mutex held.
+ */
+static void release_acked_chunks(publish_channel_t channel)
+{
+    while (1)
+    {
+        pending_chunk_t *oldest = NULL;
+
+        for (int i = 0; i < ARRAY_SIZE(pending_chunks); i++)
+        {
+            pending_chunk_t *chunk = &pending_chunks[i];
+
+            if (chunk->used && chunk->channel == channel &&
+                (oldest == NULL || (int32_t)(chunk->order - oldest->order) < 0))
+            {
+                oldest = chunk;
+            }
+        }
+
+        if (oldest == NULL || !oldest->acked)
         {
-            /* Add separator between readings */
-            message[offset++] = '|';
+            return;
         }
 
-        /* Format: "{battery_id}/{voltage}/{timestamp}" */
-        len = snprintf(message + offset, sizeof(message) - offset,
-                       "%d/%d/%s",
-                       readings[i].battery_id,
-                       readings[i].voltage,
-                       timestamp_str);
+        release_chunk(oldest);
+        oldest->used = false;
+        k_sem_give(&pending_free);
+    }
+}
+
+/* Ack handler registered with the MQTT client, token is the pending index
+ * of the first chunk in the message
+ */
+static void chunk_acked(uint32_t token)
+{
+    int index = token;
+
+    if (token >= ARRAY_SIZE(pending_chunks))
+    {
+        return;
+    }
+
+    k_mutex_lock(&pending_mutex, K_FOREVER);
+
+    /* A coalesced frame acknowledges every section it carried */
+    for (; index >= 0 && pending_chunks[index].used; index = pending_chunks[index].next)
+    {
+        pending_chunks[index].acked = true;
+        release_acked_chunks(pending_chunks[index].channel);
+    }
+
+    k_mutex_unlock(&pending_mutex);
+}
+
+/* Track a chunk about to be published, returns its token or a negative error */
+static int reserve_pending(publish_channel_t channel, const sensor_cursor_t *range,
+                           k_timeout_t timeout)
+{
+    int token = -EBUSY;
+
+    if (k_sem_take(&pending_free, timeout) != 0)
+    {
+        return -EBUSY;
+    }
+
+    k_mutex_lock(&pending_mutex, K_FOREVER);
 
-        if (len >= sizeof(message) - offset - 16)
-        { /* Extra margin */
-            /* Message too long, publish what we have so far */
-            message[offset] = '\0';
+    for (int i = 0; i < ARRAY_SIZE(pending_chunks); i++)
+    {
+        if (!pending_chunks[i].used)
+        {
+            pending_chunks[i].used = true;
+            pending_chunks[i].acked = false;
+            pending_chunks[i].channel = channel;
+            pending_chunks[i].order = channel_order[channel]++;
+            pending_chunks[i].next = -1;
+            if (range)
+            {
+                pending_chunks[i].range = *range;
+            }
+            token = i;
             break;
         }
+    }
 
-        offset += len;
-        first = false;
+    k_mutex_unlock(&pending_mutex);
+    return token;
+}
+
+/* Forget a chunk that could not be published, with the rest of its frame */
+static void cancel_pending(int token)
+{
+    k_mutex_lock(&pending_mutex, K_FOREVER);
+
+    for (; token >= 0; token = pending_chunks[token].next)
+    {
+        pending_chunks[token].used = false;
+        k_sem_give(&pending_free);
     }
 
-    /* Debug output to verify format */
-    LOG_DBG(LOG_PREFIX_PUB "Battery payload: %s", message);
+    k_mutex_unlock(&pending_mutex);
+}
+
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+/* Keep a serialized chunk in flash until it can be published */
+static int store_chunk(publish_channel_t tag, const char *name, const sensor_cursor_t *cursor,
+                       size_t len)
+{
+    int err;
 
-    if (offset > 0)
+    err = offline_store_append(tag, (const uint8_t *)chunk_buffer, len);
+    if (err)
     {
-        /* Publish the message with QoS 2 */
-        err = mqtt_client_publish(MQTT_TOPIC_BATTERY, message, MQTT_QOS_2_EXACTLY_ONCE);
-        if (err)
+        LOG_ERR(LOG_PREFIX_PUB "Failed to store %s chunk offline: %d", name, err);
+    }
+    else
+    {
+        LOG_INF(LOG_PREFIX_PUB "Stored %s chunk offline: %d readings, %d bytes",
+                name, cursor->count, len);
+    }
+
+    return err;
+}
+#endif
+
+void mqtt_publishers_init(void)
+{
+    mqtt_client_set_ack_handler(chunk_acked);
+}
+
+int mqtt_client_publish_channel(sensor_channel_t channel, sensor_cursor_t *cursor)
+{
+    const char *topic;
+    const char *name;
+    int err;
+    int token;
+    payload_writer_t writer = {
+        .buffer = chunk_buffer,
+        .offset = 0};
+
+    if (channel >= SENSOR_CHANNEL_COUNT || cursor == NULL)
+    {
+        return -EINVAL;
+    }
+
+    if (channel_formats[channel].append == NULL)
+    {
+        return -ENODATA;
+    }
+
+    topic = channel_formats[channel].topic;
+    name = sensors_channel_name(channel);
+
+    writer.size = mqtt_client_max_payload_size(topic) + 1;
+
+    /* Readings are stamped with the uptime until the time is known, hold
+     * them until they have been converted to UTC
+     */
+    if (!utils_is_time_synchronized())
+    {
+        LOG_INF(LOG_PREFIX_PUB "Time not synchronized, holding %s data", name);
+        return -ENODATA;
+    }
+
+    chunk_buffer[0] = '\0';
+
+    /* Format as many readings as fit in one PUBLISH packet, pipe separated */
+    err = sensors_peek(channel, cursor, channel_formats[channel].append, &writer);
+    if (err < 0)
+    {
+        LOG_ERR(LOG_PREFIX_PUB "Failed to read %s data: %d", name, err);
+        return err;
+    }
+
+    if (writer.offset == 0)
+    {
+        LOG_DBG(LOG_PREFIX_PUB "No %s data to publish", name);
+        return -ENODATA;
+    }
+
+    /* Tell the sensor store how many readings of this size fill a chunk,
+     * so it can ask for a publish once one is ready
+     */
+    sensors_set_chunk_readings(channel, (writer.size - 1) * cursor->count / writer.offset);
+
+    /* Debug output to verify format */
+#ifdef CONFIG_ELFRYD_PAYLOAD_BINARY
+    LOG_HEXDUMP_DBG(chunk_buffer, writer.offset, "Binary payload");
+#else
+    LOG_DBG(LOG_PREFIX_PUB "%s payload: %s", name, chunk_buffer);
+#endif
+
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+    if (!mqtt_client_is_connected())
+    {
+        /* Flash holds the chunk now, so the readings can go at once. Earlier
+         * chunks still in flight keep their own copy in the MQTT client.
+         */
+        err = store_chunk(channel, name, cursor, writer.offset);
+        if (!err)
         {
-            LOG_ERR(LOG_PREFIX_PUB "Failed to publish battery data: %d", err);
+            sensors_commit(channel, cursor);
         }
-        else
+        return err;
+    }
+#endif
+
+    token = reserve_pending(channel, cursor, K_MSEC(CONFIG_MQTT_INFLIGHT_WAIT_MS));
+    if (token < 0)
+    {
+        LOG_WRN(LOG_PREFIX_PUB "Too many unacknowledged chunks, %s publish deferred", name);
+        return token;
+    }
+
+    /* Publish the chunk with QoS 2, the readings are released on PUBCOMP */
+    err = mqtt_client_publish_tracked(topic, (const uint8_t *)chunk_buffer, writer.offset,
+                                      MQTT_QOS_2_EXACTLY_ONCE, token);
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_PUB "Failed to publish %s data: %d", name, err);
+        cancel_pending(token);
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+        /* The chunk is already serialized, keep it rather than retry from RAM */
+        err = store_chunk(channel, name, cursor, writer.offset);
+        if (!err)
         {
-            LOG_INF(LOG_PREFIX_PUB "Published battery data: %d readings", count);
+            sensors_commit(channel, cursor);
         }
+#endif
     }
     else
     {
-        LOG_ERR(LOG_PREFIX_PUB "No valid battery data to publish");
-        err = -EINVAL;
+        LOG_INF(LOG_PREFIX_PUB "Published %s chunk: %d readings, %d bytes",
+                name, cursor->count, writer.offset);
     }
 
     return err;
 }
 
-int mqtt_client_publish_temp(temp_reading_t *readings, int count)
+#ifdef CONFIG_ELFRYD_COALESCE
+int mqtt_client_publish_frame(uint32_t channels, sensor_cursor_t *cursors)
 {
+    size_t size = mqtt_client_max_payload_size(MQTT_TOPIC_BATCH);
+    size_t offset = 1;
+    int sections = 0;
+    int readings = 0;
+    int first = -1;
+    int last = -1;
+    int token;
     int err;
-    char message[256];
-    size_t offset = 0;
-    bool first = true;
 
-    /* Format multiple readings with pipe separator */
-    for (int i = 0; i < count && offset < sizeof(message) - 32; i++)
+    if (cursors == NULL)
+    {
+        return -EINVAL;
+    }
+
+    if (!utils_is_time_synchronized())
+    {
+        LOG_INF(LOG_PREFIX_PUB "Time not synchronized, holding frame");
+        return -ENODATA;
+    }
+
+    if (!mqtt_client_is_connected())
+    {
+        return -ENOTCONN;
+    }
+
+    chunk_buffer[0] = FRAME_MARKER;
+
+    /* Fill the frame channel by channel, each section as large as fits */
+    for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++)
     {
-        size_t len;
-        char timestamp_str[24]; /* Dedicated buffer for timestamp */
+        const char *topic = channel_formats[channel].topic;
+        size_t topic_len = strlen(topic);
+        size_t header = 1 + topic_len + 2;
+        payload_writer_t writer = {0};
+        char *section = chunk_buffer + offset;
 
-        /* Format timestamp using the utility function */
-        int ts_len = format_timestamp(readings[i].timestamp, timestamp_str, sizeof(timestamp_str));
-        if (ts_len < 0)
+        if (!(channels & BIT(channel)))
         {
-            LOG_ERR(LOG_PREFIX_PUB "Error formatting timestamp");
             continue;
         }
 
-        if (!first)
+        cursors[channel].count = 0;
+
+        if (channel_formats[channel].append == NULL || offset + header >= size)
         {
-            /* Add separator between readings */
-            message[offset++] = '|';
+            continue;
         }
 
-        /* Format: "{temperature}/{timestamp}" */
-        len = snprintf(message + offset, sizeof(message) - offset,
-                       "%d/%s",
-                       readings[i].temperature,
-                       timestamp_str);
+        /* Same spare byte as a chunk of its own */
+        writer.buffer = section + header;
+        writer.size = size - offset - header + 1;
 
-        if (len >= sizeof(message) - offset - 16)
+        err = sensors_peek(channel, &cursors[channel], channel_formats[channel].append,
+                           &writer);
+        if (err < 0)
         {
-            /* Message too long, publish what we have so far */
-            message[offset] = '\0';
-            break;
+            LOG_ERR(LOG_PREFIX_PUB "Failed to read %s data: %d",
+                    sensors_channel_name(channel), err);
+            return err;
         }
 
-        offset += len;
-        first = false;
+        if (writer.offset == 0)
+        {
+            continue;
+        }
+
+        section[0] = topic_len;
+        memcpy(section + 1, topic, topic_len);
+        section[1 + topic_len] = writer.offset & 0xFF;
+        section[2 + topic_len] = (writer.offset >> 8) & 0xFF;
+
+        /* Readings of this size that would fill a chunk of its own */
+        sensors_set_chunk_readings(channel, mqtt_client_max_payload_size(topic) *
+                                                cursors[channel].count / writer.offset);
+
+        offset += header + writer.offset;
+        readings += cursors[channel].count;
+        sections++;
     }
 
-    /* Debug output to verify format */
-    LOG_DBG(LOG_PREFIX_PUB "Temperature payload: %s", message);
+    if (sections == 0)
+    {
+        return -ENODATA;
+    }
 
-    if (offset > 0)
+    /* Track each section on its own channel, chained behind the first so
+     * the frame's ack releases them all
+     */
+    for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++)
     {
-        /* Publish the message with QoS 2 */
-        err = mqtt_client_publish(MQTT_TOPIC_TEMP, message, MQTT_QOS_2_EXACTLY_ONCE);
-        if (err)
+        if (!(channels & BIT(channel)) || cursors[channel].count == 0)
+        {
+            continue;
+        }
+
+        token = reserve_pending(channel, &cursors[channel],
+                                K_MSEC(CONFIG_MQTT_INFLIGHT_WAIT_MS));
+        if (token < 0)
+        {
+            LOG_WRN(LOG_PREFIX_PUB "Too many unacknowledged chunks, frame deferred");
+            if (first >= 0)
+            {
+                cancel_pending(first);
+            }
+            return token;
+        }
+
+        if (first < 0)
         {
-            LOG_ERR(LOG_PREFIX_PUB "Failed to publish temperature data: %d", err);
+            first = token;
         }
         else
         {
-            LOG_INF(LOG_PREFIX_PUB "Published temperature data: %d readings", count);
+            k_mutex_lock(&pending_mutex, K_FOREVER);
+            pending_chunks[last].next = token;
+            k_mutex_unlock(&pending_mutex);
         }
+        last = token;
     }
-    else
+
+    LOG_HEXDUMP_DBG(chunk_buffer, offset, "Coalesced frame");
+
+    err = mqtt_client_publish_tracked(MQTT_TOPIC_BATCH, (const uint8_t *)chunk_buffer, offset,
+                                      MQTT_QOS_2_EXACTLY_ONCE, first);
+    if (err)
     {
-        LOG_ERR(LOG_PREFIX_PUB "No valid temperature data to publish");
-        err = -EINVAL;
+        LOG_ERR(LOG_PREFIX_PUB "Failed to publish frame: %d", err);
+        cancel_pending(first);
+        return err;
     }
 
-    return err;
+    LOG_INF(LOG_PREFIX_PUB "Published frame: %d sections, %d readings, %d bytes",
+            sections, readings, offset);
+
+    return 0;
 }
+#endif
 
-int mqtt_client_publish_gyro(gyro_reading_t *readings, int count)
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
+/* Mark the peeked batch as sent and keep its location with its chunk */
+static void mark_batch_sent(int token)
 {
-    int err;
-    char message[512]; /* Gyro messages are longer */
-    size_t offset = 0;
-    bool first = true;
+    k_mutex_lock(&pending_mutex, K_FOREVER);
+    offline_store_mark_sent(&pending_chunks[token].batch);
+    k_mutex_unlock(&pending_mutex);
+}
 
-    /* Format multiple readings with pipe separator */
-    for (int i = 0; i < count && offset < sizeof(message) - 32; i++)
+int mqtt_client_publish_offline_batches(int max_batches)
+{
+    uint8_t tag;
+    size_t len;
+    int token;
+    int sent = 0;
+    int err = 0;
+
+    /* Replay oldest first, a bounded number per call to pace the uplink */
+    while (sent < max_batches && mqtt_client_is_connected())
     {
-        size_t len;
-        char timestamp_str[24]; /* Dedicated buffer for timestamp */
+        err = offline_store_peek(&tag, (uint8_t *)chunk_buffer, APP_MQTT_BUFFER_SIZE, &len);
+        if (err == -ENODATA)
+        {
+            err = 0;
+            break;
+        }
+        else if (err)
+        {
+            LOG_ERR(LOG_PREFIX_PUB "Failed to read offline batch: %d", err);
+            break;
+        }
 
-        /* Format timestamp using the utility function */
-        int ts_len = format_timestamp(readings[i].timestamp, timestamp_str, sizeof(timestamp_str));
-        if (ts_len < 0)
+        /* Don't wait for acks here, fresh data should not queue behind replay */
+        token = reserve_pending(CHANNEL_OFFLINE, NULL, K_NO_WAIT);
+        if (token < 0)
         {
-            LOG_ERR(LOG_PREFIX_PUB "Error formatting timestamp");
-            continue;
+            err = 0;
+            break;
         }
 
-        if (!first)
+        if (tag >= CHANNEL_OFFLINE)
         {
-            /* Add separator between readings */
-            message[offset++] = '|';
+            /* Unknown batch type, nothing sensible to publish it as */
+            LOG_WRN(LOG_PREFIX_PUB "Dropping offline batch with unknown tag %d", tag);
+            mark_batch_sent(token);
+            chunk_acked(token);
+            continue;
         }
 
-        /* Format: "{accel_x},{accel_y},{accel_z}/{gyro_x},{gyro_y},{gyro_z}/{timestamp}" */
-        len = snprintf(message + offset, sizeof(message) - offset,
-                       "%d,%d,%d/%d,%d,%d/%s",
-                       readings[i].accel_x,
-                       readings[i].accel_y,
-                       readings[i].accel_z,
-                       readings[i].gyro_x,
-                       readings[i].gyro_y,
-                       readings[i].gyro_z,
-                       timestamp_str);
+        /* Mark it before publishing, the ack may arrive before publish returns.
+         * It is consumed from flash when the broker acknowledges it.
+         */
+        mark_batch_sent(token);
 
-        if (len >= sizeof(message) - offset - 16)
+        err = mqtt_client_publish_tracked(channel_formats[tag].topic,
+                                          (const uint8_t *)chunk_buffer, len,
+                                          MQTT_QOS_2_EXACTLY_ONCE, token);
+        if (err)
         {
-            /* Message too long, publish what we have so far */
-            message[offset] = '\0';
+            LOG_ERR(LOG_PREFIX_PUB "Failed to replay offline batch: %d", err);
+            offline_store_unmark_sent();
+            cancel_pending(token);
             break;
         }
 
-        offset += len;
-        first = false;
+        sent++;
     }
 
-    /* Debug output to verify format */
-    LOG_DBG(LOG_PREFIX_PUB "Gyro payload: %s", message);
+    if (sent > 0)
+    {
+        LOG_INF(LOG_PREFIX_PUB "Replayed %d offline batches", sent);
+        offline_store_save_position();
+    }
+
+    return err ? err : sent;
+}
+#endif
+
+#ifdef CONFIG_ELFRYD_ALARMS
+int mqtt_client_publish_alarm(const alarm_event_t *event)
+{
+    char timestamp_str[24];
+    char payload[96];
+    int64_t timestamp = utils_timestamp_to_utc(event->timestamp);
+    int len;
 
-    if (offset > 0)
+    /* Before the first time sync the broker stamps the alarm on arrival */
+    if (utils_timestamp_is_uptime(timestamp))
     {
-        /* Publish the message with QoS 2 */
-        err = mqtt_client_publish(MQTT_TOPIC_GYRO, message, MQTT_QOS_2_EXACTLY_ONCE);
-        if (err)
-        {
-            LOG_ERR(LOG_PREFIX_PUB "Failed to publish gyroscope data: %d", err);
-        }
-        else
-        {
-            LOG_INF(LOG_PREFIX_PUB "Published gyroscope data: %d readings", count);
-        }
+        timestamp = 0;
     }
-    else
+
+    if (format_timestamp(timestamp, timestamp_str, sizeof(timestamp_str)) < 0)
     {
-        LOG_ERR(LOG_PREFIX_PUB "No valid gyroscope data to publish");
-        err = -EINVAL;
+        LOG_ERR(LOG_PREFIX_PUB "Error formatting timestamp");
+        return -EINVAL;
     }
 
-    return err;
+    /* Format: "{type}/{raised|cleared}/{channel}/{value}/{timestamp}" */
+    len = snprintf(payload, sizeof(payload), "%s/%s/%d/%d/%s",
+                   alarms_type_name(event->type),
+                   event->raised ? "raised" : "cleared",
+                   event->channel,
+                   event->value,
+                   timestamp_str);
+
+    return mqtt_client_publish_priority(MQTT_TOPIC_ALARM, (const uint8_t *)payload, len,
+                                        MQTT_QOS_1_AT_LEAST_ONCE);
+}
+#endif
+
+#ifdef CONFIG_ELFRYD_BOOT_RECORD
+int mqtt_client_publish_boot_record(void)
+{
+    char payload[192];
+    int len;
+
+    len = boot_timing_format(payload, sizeof(payload));
+    if (len < 0)
+    {
+        LOG_ERR(LOG_PREFIX_PUB "Boot record too long");
+        return len;
+    }
+
+    return mqtt_client_publish_payload(MQTT_TOPIC_BOOT, (const uint8_t *)payload, len,
+                                       MQTT_QOS_1_AT_LEAST_ONCE);
+}
+#endif
+
+#ifdef CONFIG_ELFRYD_METRICS
+int mqtt_client_publish_metrics(void)
+{
+    /* Too large for the work queue stack, only used by the metrics work item */
+    static char payload[METRICS_SNAPSHOT_SIZE];
+    mqtt_link_stats_t stats;
+    int len;
+
+    mqtt_client_get_link_stats(&stats);
+    metrics_set(METRIC_UPTIME, k_uptime_get() / MSEC_PER_SEC);
+    metrics_set(METRIC_RECONNECTS, stats.reconnects);
+    metrics_set(METRIC_MAX_RECOVERY, stats.max_recovery_ms);
+
+    len = metrics_format(payload, sizeof(payload));
+    if (len < 0)
+    {
+        LOG_ERR(LOG_PREFIX_PUB "Metrics snapshot too long");
+        return len;
+    }
+
+    return mqtt_client_publish_payload(MQTT_TOPIC_METRICS, (const uint8_t *)payload, len,
+                                       MQTT_QOS_0_AT_MOST_ONCE);
 }
+#endif
 
 int mqtt_client_publish_config_confirm(const char *confirmation)
 {
-    return mqtt_client_publish(MQTT_TOPIC_CONFIG_CONFIRM, confirmation, MQTT_QOS_2_EXACTLY_ONCE);
+    return mqtt_client_publish_priority(MQTT_TOPIC_CONFIG_CONFIRM, (const uint8_t *)confirmation,
+                                        strlen(confirmation), MQTT_QOS_2_EXACTLY_ONCE);
 }
\ No newline at end of file
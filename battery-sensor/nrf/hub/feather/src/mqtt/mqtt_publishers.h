@@ -7,37 +7,123 @@
 #define MQTT_PUBLISHERS_H
 
 #include "sensors/sensors.h"
+#ifdef CONFIG_ELFRYD_ALARMS
+#include "alarms/alarms.h"
+#endif
 
 /**
- * Publish battery readings to the MQTT broker
+ * Initialize the sensor data publishers
  *
- * @param readings Array of battery readings
- * @param count    Number of readings in the array
- * @return         0 on success, negative error code on failure
+ * Registers for publish acknowledgements, which release the published
+ * readings from the sensor store. Must be called before publishing.
  */
-int mqtt_client_publish_battery(battery_reading_t *readings, int count);
+void mqtt_publishers_init(void);
 
 /**
- * Publish temperature readings to the MQTT broker
+ * Publish one chunk of stored readings of a sensor channel to the MQTT broker
  *
- * @param readings Array of temperature readings
- * @param count    Number of readings in the array
- * @return         0 on success, negative error code on failure
+ * Readings are serialized directly from the sensor store, starting at
+ * cursor->start, until the payload is as large as one PUBLISH packet allows,
+ * and published on the topic of the channel. On success cursor->count holds
+ * the number of readings in the chunk, and the caller calls again with the
+ * cursor moved past them to send the next chunk. The readings stay in the
+ * sensor store until the broker acknowledges the chunk. With the offline
+ * store enabled, chunks that cannot be published are kept in flash instead
+ * and released at once.
+ *
+ * @param channel Channel to publish
+ * @param cursor  Cursor to start from, updated with the published range
+ * @return        0 on success, -ENODATA if there is nothing to publish,
+ *                -EBUSY if too many chunks await acknowledgement,
+ *                other negative error code on failure
+ */
+int mqtt_client_publish_channel(sensor_channel_t channel, sensor_cursor_t *cursor);
+
+#ifdef CONFIG_ELFRYD_COALESCE
+/**
+ * Publish stored readings of several sensor channels in one coalesced frame
+ *
+ * Each channel in the mask gets a section holding the payload it would
+ * publish on its own topic, serialized from cursors[channel].start, and the
+ * frame is published on MQTT_TOPIC_BATCH. Channels are filled in order
+ * until the frame is as large as one PUBLISH packet allows. On success
+ * cursors[channel].count holds the number of readings sent per channel, 0
+ * for channels that did not fit, and the caller calls again with the
+ * cursors moved past them. The readings stay in the sensor store until the
+ * broker acknowledges the frame.
+ *
+ * @param channels Mask of channels to publish, bit n for sensor channel n
+ * @param cursors  Cursors of all SENSOR_CHANNEL_COUNT channels, updated with
+ *                 the published ranges
+ * @return         0 on success, -ENODATA if there is nothing to publish,
+ *                 -ENOTCONN if not connected, -EBUSY if too many chunks
+ *                 await acknowledgement, other negative error code on failure
  */
-int mqtt_client_publish_temp(temp_reading_t *readings, int count);
+int mqtt_client_publish_frame(uint32_t channels, sensor_cursor_t *cursors);
+#endif
 
+#ifdef CONFIG_ELFRYD_OFFLINE_STORE
 /**
- * Publish gyroscope readings to the MQTT broker
+ * Replay batches kept in the offline store, oldest first
+ *
+ * While the broker is unreachable mqtt_client_publish_channel keeps its
+ * serialized chunks in flash instead of dropping them. This publishes up to
+ * max_batches of those, without waiting for in-flight slots. Each batch is
+ * removed from the store once the broker acknowledges it.
+ *
+ * @param max_batches Maximum number of batches to publish in this call
+ * @return            Number of batches published, negative error code on failure
+ */
+int mqtt_client_publish_offline_batches(int max_batches);
+#endif
+
+#ifdef CONFIG_ELFRYD_ALARMS
+/**
+ * Publish an alarm event on the alarm topic
+ *
+ * The alarm is sent with QoS 1 ahead of any queued sensor batches, see
+ * mqtt_client_publish_priority. Alarms are never kept in the offline store,
+ * the caller retries until the alarm is queued.
  *
- * @param readings Array of gyroscope readings
- * @param count    Number of readings in the array
- * @return         0 on success, negative error code on failure
+ * @param event Alarm event to publish
+ * @return      0 once queued, -EBUSY if earlier priority messages are still
+ *              awaiting acknowledgement, other negative error code on failure
  */
-int mqtt_client_publish_gyro(gyro_reading_t *readings, int count);
+int mqtt_client_publish_alarm(const alarm_event_t *event);
+#endif
+
+#ifdef CONFIG_ELFRYD_BOOT_RECORD
+/**
+ * Publish the boot timing record on the boot topic
+ *
+ * See boot_timing_format for the format. Sent with QoS 1 and never waits
+ * for an in-flight slot, the caller retries until it is queued.
+ *
+ * @return 0 once queued, -EBUSY if the in-flight window is full,
+ *         other negative error code on failure
+ */
+int mqtt_client_publish_boot_record(void);
+#endif
+
+#ifdef CONFIG_ELFRYD_METRICS
+/**
+ * Publish a snapshot of the hub metrics on the metrics topic
+ *
+ * Refreshes the gauges taken from elsewhere, uptime and the MQTT link
+ * statistics, then sends the snapshot from metrics_format with QoS 0, so it
+ * never takes an in-flight slot from sensor data.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int mqtt_client_publish_metrics(void);
+#endif
 
 /**
  * Publish configuration confirmation to the MQTT broker
  *
+ * Sent with QoS 2 through mqtt_client_publish_priority, so sensor batches
+ * filling the in-flight window cannot make the confirmation fail.
+ *
  * @param confirmation Configuration confirmation message
  * @return             0 on success, negative error code on failure
  */
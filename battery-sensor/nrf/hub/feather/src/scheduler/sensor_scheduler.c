@@ -0,0 +1,533 @@
+/**
+ * @file sensor_scheduler.c
+ * @brief Deadline based scheduling of sensor sampling and publishing
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "scheduler/sensor_scheduler.h"
+#include "sensors/sensors.h"
+#ifdef CONFIG_ELFRYD_MOTION_FEATURES
+#include "motion/motion.h"
+#endif
+
+/* Register the module with a dedicated log level and prefix */
+LOG_MODULE_REGISTER(sensor_scheduler, LOG_LEVEL_INF);
+#define LOG_PREFIX_SCHED "[SCHED] "
+
+/* Work queue running sampling and publish deadlines */
+#define SCHEDULER_STACK_SIZE 4096
+#define SCHEDULER_PRIORITY 6
+
+/* Sampling period, I2C sensors are read less often to limit bus traffic */
+#define SAMPLE_PERIOD_MS 1000
+#define I2C_SAMPLE_PERIOD_MS (CONFIG_SENSOR_I2C_READ_INTERVAL * 1000)
+
+/* Deadlines of one sensor type */
+typedef struct
+{
+    const char *name;
+    config_param_t param;
+    int (*sample)(void);
+    int (*get_interval)(void);
+    int sample_period_ms;       /* 0 = the common sampling period */
+    struct k_work_delayable sample_work;
+    struct k_work_delayable publish_work;
+    struct k_work rearm_work;   /* Interval changed, recompute the publish deadline */
+    struct k_work request_work; /* Publish now, leaving the deadline as is */
+    struct k_work watermark_work; /* A full chunk is waiting, publish and restart the interval */
+    int64_t next_sample;        /* Uptime in ms */
+    int64_t next_publish;       /* Uptime in ms */
+    int interval;               /* Publish interval in seconds, 0 = disabled */
+} sensor_schedule_t;
+
+static K_THREAD_STACK_DEFINE(scheduler_stack, SCHEDULER_STACK_SIZE);
+static struct k_work_q scheduler_workq;
+
+static sensor_scheduler_publish_cb_t publish_handler;
+static int sample_period_ms;
+
+/* Aggregation window deadline, shared by all sensor channels */
+static struct k_work_delayable window_work;
+static struct k_work window_rearm_work;
+static struct k_work window_request_work;
+static int64_t next_window; /* Uptime in ms */
+static int window_length;   /* Window length in seconds, 0 = raw readings */
+
+/* Battery deadband changed, hand the new filter to the sensors module */
+static struct k_work deadband_work;
+
+/* Raw gyroscope capture requested */
+static struct k_work capture_work;
+
+#ifdef CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR
+static int sample_battery(void)
+{
+    int err;
+
+    if (sensors_using_i2c())
+    {
+        /* One I2C transaction reads every battery */
+        err = sensors_generate_all_battery_readings();
+        if (err == -EAGAIN)
+        {
+            return 0;
+        }
+
+        if (err > 0)
+        {
+            LOG_DBG(LOG_PREFIX_SCHED "Generated %d battery readings in a batch", err);
+        }
+
+        return err < 0 ? err : 0;
+    }
+
+    for (int battery_id = 1; battery_id <= NUM_BATTERIES; battery_id++)
+    {
+        err = sensors_generate_battery_reading(battery_id);
+        if (err)
+        {
+            LOG_ERR(LOG_PREFIX_SCHED "Failed to generate battery reading for battery %d: %d",
+                    battery_id, err);
+        }
+    }
+
+    return 0;
+}
+#endif
+
+static sensor_schedule_t schedules[] = {
+#ifdef CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR
+    {
+        .name = "battery",
+        .param = CONFIG_PARAM_BATTERY,
+        .sample = sample_battery,
+        .get_interval = config_get_battery_interval,
+    },
+#endif
+#ifdef CONFIG_ELFRYD_ENABLE_TEMP_SENSOR
+    {
+        .name = "temperature",
+        .param = CONFIG_PARAM_TEMP,
+        .sample = sensors_generate_temp_reading,
+        .get_interval = config_get_temp_interval,
+    },
+#endif
+#ifdef CONFIG_ELFRYD_ENABLE_GYRO_SENSOR
+    {
+        .name = "gyroscope",
+        .param = CONFIG_PARAM_GYRO,
+        .sample = sensors_generate_gyro_reading,
+        .get_interval = config_get_gyro_interval,
+#ifdef CONFIG_ELFRYD_MOTION_FEATURES
+        /* Motion features need readings faster than the other sensors */
+        .sample_period_ms = MOTION_SAMPLE_PERIOD_MS,
+#endif
+    },
+#endif
+};
+
+static sensor_schedule_t *find_schedule(config_param_t param)
+{
+    for (int i = 0; i < ARRAY_SIZE(schedules); i++)
+    {
+        if (schedules[i].param == param)
+        {
+            return &schedules[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Schedule work for an absolute uptime deadline, so periods do not drift */
+static void schedule_at(struct k_work_delayable *work, int64_t deadline)
+{
+    int64_t delay = deadline - k_uptime_get();
+
+    k_work_reschedule_for_queue(&scheduler_workq, work, K_MSEC(MAX(delay, 0)));
+}
+
+/* Move a deadline one period ahead, skipping periods that were missed
+ * instead of running them back to back
+ */
+static int64_t next_deadline(int64_t deadline, int64_t period)
+{
+    int64_t now = k_uptime_get();
+
+    deadline += period;
+    if (deadline <= now)
+    {
+        deadline += ((now - deadline) / period + 1) * period;
+    }
+
+    return deadline;
+}
+
+static void sample_work_fn(struct k_work *work)
+{
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    sensor_schedule_t *sched = CONTAINER_OF(dwork, sensor_schedule_t, sample_work);
+    int err;
+
+    err = sched->sample();
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_SCHED "Failed to generate %s reading: %d", sched->name, err);
+    }
+
+    sched->next_sample = next_deadline(sched->next_sample, sched->sample_period_ms);
+    schedule_at(&sched->sample_work, sched->next_sample);
+}
+
+#ifdef CONFIG_ELFRYD_COALESCE
+/* Queue the other sensor types due within the slack window along with one
+ * that is due now, so the publisher sends them in one frame and the radio
+ * wakes once. Their deadlines move on as if they had fired.
+ */
+static void coalesce_due(const sensor_schedule_t *due)
+{
+    int64_t horizon = k_uptime_get() + (int64_t)CONFIG_ELFRYD_COALESCE_SLACK * MSEC_PER_SEC;
+
+    for (int i = 0; i < ARRAY_SIZE(schedules); i++)
+    {
+        sensor_schedule_t *sched = &schedules[i];
+
+        if (sched == due || sched->interval == 0 || sched->next_publish > horizon)
+        {
+            continue;
+        }
+
+        if (publish_handler(sched->param) == 0)
+        {
+            LOG_INF(LOG_PREFIX_SCHED "Queued %s publish early along with %s",
+                    sched->name, due->name);
+        }
+
+        sched->next_publish = next_deadline(sched->next_publish,
+                                            (int64_t)sched->interval * MSEC_PER_SEC);
+        schedule_at(&sched->publish_work, sched->next_publish);
+    }
+}
+#endif
+
+static void publish_work_fn(struct k_work *work)
+{
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    sensor_schedule_t *sched = CONTAINER_OF(dwork, sensor_schedule_t, publish_work);
+    int err;
+
+    err = publish_handler(sched->param);
+    if (err)
+    {
+        LOG_WRN(LOG_PREFIX_SCHED "Failed to queue %s interval publish: %d", sched->name, err);
+    }
+    else
+    {
+        LOG_INF(LOG_PREFIX_SCHED "Queued %s interval publish request", sched->name);
+    }
+
+#ifdef CONFIG_ELFRYD_COALESCE
+    coalesce_due(sched);
+#endif
+
+    sched->next_publish = next_deadline(sched->next_publish,
+                                        (int64_t)sched->interval * MSEC_PER_SEC);
+    schedule_at(&sched->publish_work, sched->next_publish);
+}
+
+/* Start a full interval from now, as after boot */
+static void rearm_work_fn(struct k_work *work)
+{
+    sensor_schedule_t *sched = CONTAINER_OF(work, sensor_schedule_t, rearm_work);
+
+    sched->interval = sched->get_interval();
+
+    if (sched->interval == 0)
+    {
+        k_work_cancel_delayable(&sched->publish_work);
+        LOG_INF(LOG_PREFIX_SCHED "Interval publishing of %s data disabled", sched->name);
+        return;
+    }
+
+    sched->next_publish = k_uptime_get() + (int64_t)sched->interval * MSEC_PER_SEC;
+    schedule_at(&sched->publish_work, sched->next_publish);
+
+    LOG_INF(LOG_PREFIX_SCHED "Publishing %s data every %d seconds", sched->name, sched->interval);
+}
+
+static void request_work_fn(struct k_work *work)
+{
+    sensor_schedule_t *sched = CONTAINER_OF(work, sensor_schedule_t, request_work);
+    int err;
+
+    err = publish_handler(sched->param);
+    if (err)
+    {
+        LOG_WRN(LOG_PREFIX_SCHED "Failed to queue %s publish request: %d", sched->name, err);
+    }
+    else
+    {
+        LOG_INF(LOG_PREFIX_SCHED "Queued immediate %s publish request", sched->name);
+    }
+}
+
+/* Publish early once a full chunk is waiting, and restart the interval so
+ * the deadline does not follow with a nearly empty one
+ */
+static void watermark_work_fn(struct k_work *work)
+{
+    sensor_schedule_t *sched = CONTAINER_OF(work, sensor_schedule_t, watermark_work);
+    int err;
+
+    /* Publishing of this sensor type is disabled */
+    if (sched->interval == 0)
+    {
+        return;
+    }
+
+    err = publish_handler(sched->param);
+    if (err)
+    {
+        LOG_WRN(LOG_PREFIX_SCHED "Failed to queue %s watermark publish: %d", sched->name, err);
+        return;
+    }
+
+    LOG_INF(LOG_PREFIX_SCHED "Queued %s watermark publish request", sched->name);
+
+#ifdef CONFIG_ELFRYD_COALESCE
+    coalesce_due(sched);
+#endif
+
+    sched->next_publish = k_uptime_get() + (int64_t)sched->interval * MSEC_PER_SEC;
+    schedule_at(&sched->publish_work, sched->next_publish);
+}
+
+/* Called by the sensors module with the sensor store locked */
+static void watermark_reached(sensor_channel_t channel)
+{
+    sensor_schedule_t *sched = find_schedule(sensors_channel_param(channel));
+
+    /* Aggregate records are published as their windows close */
+    if (sched != NULL)
+    {
+        k_work_submit_to_queue(&scheduler_workq, &sched->watermark_work);
+    }
+}
+
+/* Close the current aggregation window and have its records published */
+static void close_window(void)
+{
+    int err;
+
+    if (sensors_close_aggregate_window() <= 0)
+    {
+        return;
+    }
+
+    err = publish_handler(CONFIG_PARAM_AGGREGATE);
+    if (err)
+    {
+        LOG_WRN(LOG_PREFIX_SCHED "Failed to queue aggregate publish: %d", err);
+    }
+}
+
+static void window_work_fn(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    close_window();
+
+    next_window = next_deadline(next_window, (int64_t)window_length * MSEC_PER_SEC);
+    schedule_at(&window_work, next_window);
+}
+
+/* Apply a new window length, switching between raw and aggregated readings */
+static void window_rearm_work_fn(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    /* Flush the running window so no record mixes two window lengths */
+    if (window_length > 0)
+    {
+        close_window();
+    }
+
+    window_length = config_get_aggregate_window();
+    sensors_set_aggregation(window_length > 0);
+
+    if (window_length == 0)
+    {
+        k_work_cancel_delayable(&window_work);
+        LOG_INF(LOG_PREFIX_SCHED "Aggregation disabled, publishing raw readings");
+        return;
+    }
+
+    next_window = k_uptime_get() + (int64_t)window_length * MSEC_PER_SEC;
+    schedule_at(&window_work, next_window);
+
+    LOG_INF(LOG_PREFIX_SCHED "Aggregating readings over %d second windows", window_length);
+}
+
+static void window_request_work_fn(struct k_work *work)
+{
+    int err;
+
+    ARG_UNUSED(work);
+
+    /* Only closed windows are sent, the running one stays open */
+    err = publish_handler(CONFIG_PARAM_AGGREGATE);
+    if (err)
+    {
+        LOG_WRN(LOG_PREFIX_SCHED "Failed to queue aggregate publish request: %d", err);
+    }
+}
+
+static void deadband_work_fn(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    sensors_set_battery_deadband(config_get_battery_deadband(), config_get_battery_heartbeat());
+}
+
+static void capture_work_fn(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    sensors_capture_raw_gyro(config_get_gyro_capture());
+}
+
+/* Called from the thread processing configuration commands */
+static void config_event_handler(config_evt_type_t evt, config_param_t param)
+{
+    sensor_schedule_t *sched;
+
+    if (param == CONFIG_PARAM_AGGREGATE)
+    {
+        k_work_submit_to_queue(&scheduler_workq, evt == CONFIG_EVT_INTERVAL_CHANGED ?
+                                                     &window_rearm_work : &window_request_work);
+        return;
+    }
+
+    if (param == CONFIG_PARAM_DEADBAND)
+    {
+        k_work_submit_to_queue(&scheduler_workq, &deadband_work);
+        return;
+    }
+
+    if (param == CONFIG_PARAM_CAPTURE)
+    {
+        k_work_submit_to_queue(&scheduler_workq, &capture_work);
+        return;
+    }
+
+    sched = find_schedule(param);
+
+    if (sched == NULL)
+    {
+        LOG_INF(LOG_PREFIX_SCHED "Sensor type %d disabled in config, ignoring", param);
+        return;
+    }
+
+    /* All schedule state is owned by the work queue, hand the event over */
+    switch (evt)
+    {
+    case CONFIG_EVT_INTERVAL_CHANGED:
+        k_work_submit_to_queue(&scheduler_workq, &sched->rearm_work);
+        break;
+
+    case CONFIG_EVT_PUBLISH_REQUESTED:
+        k_work_submit_to_queue(&scheduler_workq, &sched->request_work);
+        break;
+
+    default:
+        break;
+    }
+}
+
+int sensor_scheduler_start(sensor_scheduler_publish_cb_t publish_cb)
+{
+    int64_t now;
+
+    if (publish_cb == NULL)
+    {
+        return -EINVAL;
+    }
+
+    publish_handler = publish_cb;
+
+    sensors_init();
+
+    sample_period_ms = sensors_using_i2c() ? I2C_SAMPLE_PERIOD_MS : SAMPLE_PERIOD_MS;
+    LOG_INF(LOG_PREFIX_SCHED "Sampling every %d ms", sample_period_ms);
+
+    k_work_queue_start(&scheduler_workq, scheduler_stack,
+                       K_THREAD_STACK_SIZEOF(scheduler_stack),
+                       SCHEDULER_PRIORITY, NULL);
+    k_thread_name_set(&scheduler_workq.thread, "sensor_scheduler");
+
+    /* Share one base time so deadlines of all sensor types coincide and
+     * are served by a single wakeup
+     */
+    now = k_uptime_get();
+
+    for (int i = 0; i < ARRAY_SIZE(schedules); i++)
+    {
+        sensor_schedule_t *sched = &schedules[i];
+
+        k_work_init_delayable(&sched->sample_work, sample_work_fn);
+        k_work_init_delayable(&sched->publish_work, publish_work_fn);
+        k_work_init(&sched->rearm_work, rearm_work_fn);
+        k_work_init(&sched->request_work, request_work_fn);
+        k_work_init(&sched->watermark_work, watermark_work_fn);
+
+        if (sched->sample_period_ms == 0)
+        {
+            sched->sample_period_ms = sample_period_ms;
+        }
+
+        sched->next_sample = now;
+        schedule_at(&sched->sample_work, sched->next_sample);
+
+        /* Wait a full interval before the first publish */
+        sched->interval = sched->get_interval();
+        if (sched->interval > 0)
+        {
+            sched->next_publish = now + (int64_t)sched->interval * MSEC_PER_SEC;
+            schedule_at(&sched->publish_work, sched->next_publish);
+        }
+
+        LOG_INF(LOG_PREFIX_SCHED "Scheduled %s sensor every %d ms, publish interval %d seconds",
+                sched->name, sched->sample_period_ms, sched->interval);
+    }
+
+    if (ARRAY_SIZE(schedules) == 0)
+    {
+        LOG_INF(LOG_PREFIX_SCHED "All sensor types disabled");
+    }
+
+    /* Windows close on the same base time as the other deadlines */
+    k_work_init_delayable(&window_work, window_work_fn);
+    k_work_init(&window_rearm_work, window_rearm_work_fn);
+    k_work_init(&window_request_work, window_request_work_fn);
+    k_work_init(&deadband_work, deadband_work_fn);
+    k_work_init(&capture_work, capture_work_fn);
+
+    sensors_set_battery_deadband(config_get_battery_deadband(), config_get_battery_heartbeat());
+
+    window_length = config_get_aggregate_window();
+    sensors_set_aggregation(window_length > 0);
+    if (window_length > 0)
+    {
+        next_window = now + (int64_t)window_length * MSEC_PER_SEC;
+        schedule_at(&window_work, next_window);
+
+        LOG_INF(LOG_PREFIX_SCHED "Aggregating readings over %d second windows", window_length);
+    }
+
+    sensors_set_watermark_handler(watermark_reached);
+    config_set_event_handler(config_event_handler);
+
+    return 0;
+}
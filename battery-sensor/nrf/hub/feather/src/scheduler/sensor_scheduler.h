@@ -0,0 +1,41 @@
+/**
+ * @file sensor_scheduler.h
+ * @brief Deadline based scheduling of sensor sampling and publishing
+ */
+
+#ifndef SENSOR_SCHEDULER_H
+#define SENSOR_SCHEDULER_H
+
+#include "config/config_module.h"
+
+/**
+ * Callback invoked when a sensor type is due to be published
+ *
+ * Runs on the scheduler work queue, so it must not block.
+ *
+ * @param sensor Sensor type to publish, CONFIG_PARAM_AGGREGATE for the
+ *               records of closed aggregation windows
+ * @return       0 on success, negative errno code on failure
+ */
+typedef int (*sensor_scheduler_publish_cb_t)(config_param_t sensor);
+
+/**
+ * Start sampling and publishing sensor data
+ *
+ * Every enabled sensor type gets a sampling deadline and a publish deadline,
+ * each backed by a delayable work item on the scheduler's own work queue.
+ * Nothing runs between deadlines, so the CPU stays idle until real work is
+ * due. Publish deadlines are computed from the configured intervals and only
+ * re-armed when the configuration changes, or brought forward when a channel
+ * reaches its publish watermark. With coalescing enabled, sensor types due
+ * within the slack window are published along with the one that is due. With
+ * an aggregation window set, one more deadline closes the window for all
+ * channels and publishes it.
+ *
+ * @param publish_cb Called when a sensor type is due to be published, or when
+ *                   publishing was requested with a configuration command
+ * @return           0 on success, negative errno code on failure
+ */
+int sensor_scheduler_start(sensor_scheduler_publish_cb_t publish_cb);
+
+#endif /* SENSOR_SCHEDULER_H */
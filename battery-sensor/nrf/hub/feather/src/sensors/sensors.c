@@ -6,44 +6,659 @@
 #include <zephyr/kernel.h>
 #include <zephyr/random/rand32.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <zephyr/logging/log.h>
 
 #include "sensors/sensors.h"
 #include "utils/utils.h"
+#include "utils/ring_buffer.h"
 #include "i2c/i2c_master.h"
+#include "config/config_module.h"
+#include "metrics/metrics.h"
+
+#ifdef CONFIG_ELFRYD_ALARMS
+#include "alarms/alarms.h"
+#endif
+#ifdef CONFIG_ELFRYD_MOTION_FEATURES
+#include "motion/motion.h"
+#endif
+
+/* The old options now set shares of the store, not numbers of readings */
+#if CONFIG_ELFRYD_MAX_BATTERY_SAMPLES > 0 || CONFIG_ELFRYD_MAX_TEMP_SAMPLES > 0 || \
+    CONFIG_ELFRYD_MAX_GYRO_SAMPLES > 0
+#warning "CONFIG_ELFRYD_MAX_*_SAMPLES are deprecated, use CONFIG_ELFRYD_*_SHARE"
+#endif
 
 LOG_MODULE_REGISTER(sensors, LOG_LEVEL_INF);
 #define LOG_PREFIX_SENSOR "[SENSOR] "
 #define LOG_PREFIX_I2C "[I2C] "
 
-/* Data storage for sensor readings */
-static battery_reading_t battery_readings[MAX_BATTERY_SAMPLES];
-static int battery_count = 0;
+/* Bytes of the sensor store taken by the heap's own bookkeeping */
+#define STORE_HEAP_RESERVE (64 + SENSOR_CHANNEL_COUNT * 16)
+
+/* One budget for the readings of all channels, divided at init */
+K_HEAP_DEFINE(store_heap, SENSOR_STORE_SIZE);
+
+/* Readings are stored packed, without padding. Every packed record starts
+ * with its timestamp in milliseconds after the time base of its channel.
+ */
+typedef struct __packed
+{
+    uint32_t time;
+} packed_header_t;
+
+typedef struct __packed
+{
+    packed_header_t header;
+    uint8_t battery_id;
+    int16_t voltage;
+} packed_battery_t;
+
+typedef struct __packed
+{
+    packed_header_t header;
+    int16_t temperature;
+} packed_temp_t;
+
+typedef struct __packed
+{
+    packed_header_t header;
+    uint8_t axes[GYRO_AXES][3]; /* 24 bit little-endian, accel x/y/z then gyro x/y/z */
+} packed_gyro_t;
+
+typedef struct __packed
+{
+    packed_header_t header;
+    uint8_t sensor;
+    uint8_t channel;
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int32_t mean;
+    int32_t last;
+    uint32_t duration;
+} packed_stats_t;
+
+typedef struct __packed
+{
+    packed_header_t header;
+    int16_t roll;
+    int16_t pitch;
+    uint32_t duration;
+    int32_t rms[GYRO_AXES];
+    int32_t peak[GYRO_AXES];
+    uint32_t frequency[GYRO_AXES];
+} packed_motion_t;
+
+/* Room for a reading or a packed record of any channel */
+typedef union
+{
+#define CHANNEL_READING(id, name, type, share, param) type name;
+    SENSOR_CHANNELS(CHANNEL_READING)
+#undef CHANNEL_READING
+} any_reading_t;
+
+typedef union
+{
+#define CHANNEL_PACKED(id, name, type, share, param) packed_##name##_t name;
+    SENSOR_CHANNELS(CHANNEL_PACKED)
+#undef CHANNEL_PACKED
+} any_packed_t;
+
+static void pack_int24(uint8_t *dst, int32_t value)
+{
+    dst[0] = (uint32_t)value & 0xFF;
+    dst[1] = ((uint32_t)value >> 8) & 0xFF;
+    dst[2] = ((uint32_t)value >> 16) & 0xFF;
+}
+
+static int32_t unpack_int24(const uint8_t *src)
+{
+    /* Shift into the top bytes and back to sign extend */
+    return (int32_t)((uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 |
+                     (uint32_t)src[2] << 24) >> 8;
+}
+
+/* Convert readings to and from their packed form, the timestamps are
+ * handled by store_reading and unpack_record
+ */
+static void pack_battery(void *packed, const void *reading)
+{
+    packed_battery_t *dst = packed;
+    const battery_reading_t *src = reading;
+
+    dst->battery_id = src->battery_id;
+    dst->voltage = src->voltage;
+}
+
+static void unpack_battery(void *reading, const void *packed)
+{
+    battery_reading_t *dst = reading;
+    const packed_battery_t *src = packed;
+
+    dst->battery_id = src->battery_id;
+    dst->voltage = src->voltage;
+}
+
+static void pack_temp(void *packed, const void *reading)
+{
+    packed_temp_t *dst = packed;
+    const temp_reading_t *src = reading;
+
+    dst->temperature = src->temperature;
+}
+
+static void unpack_temp(void *reading, const void *packed)
+{
+    temp_reading_t *dst = reading;
+    const packed_temp_t *src = packed;
+
+    dst->temperature = src->temperature;
+}
+
+static void pack_gyro(void *packed, const void *reading)
+{
+    packed_gyro_t *dst = packed;
+    const gyro_reading_t *src = reading;
+
+    pack_int24(dst->axes[0], src->accel_x);
+    pack_int24(dst->axes[1], src->accel_y);
+    pack_int24(dst->axes[2], src->accel_z);
+    pack_int24(dst->axes[3], src->gyro_x);
+    pack_int24(dst->axes[4], src->gyro_y);
+    pack_int24(dst->axes[5], src->gyro_z);
+}
+
+static void unpack_gyro(void *reading, const void *packed)
+{
+    gyro_reading_t *dst = reading;
+    const packed_gyro_t *src = packed;
+
+    dst->accel_x = unpack_int24(src->axes[0]);
+    dst->accel_y = unpack_int24(src->axes[1]);
+    dst->accel_z = unpack_int24(src->axes[2]);
+    dst->gyro_x = unpack_int24(src->axes[3]);
+    dst->gyro_y = unpack_int24(src->axes[4]);
+    dst->gyro_z = unpack_int24(src->axes[5]);
+}
+
+static void pack_stats(void *packed, const void *reading)
+{
+    packed_stats_t *dst = packed;
+    const stats_record_t *src = reading;
+
+    dst->sensor = src->sensor;
+    dst->channel = src->channel;
+    dst->count = src->count;
+    dst->min = src->min;
+    dst->max = src->max;
+    dst->mean = src->mean;
+    dst->last = src->last;
+    dst->duration = src->duration;
+}
+
+static void unpack_stats(void *reading, const void *packed)
+{
+    stats_record_t *dst = reading;
+    const packed_stats_t *src = packed;
+
+    dst->sensor = src->sensor;
+    dst->channel = src->channel;
+    dst->count = src->count;
+    dst->min = src->min;
+    dst->max = src->max;
+    dst->mean = src->mean;
+    dst->last = src->last;
+    dst->duration = src->duration;
+}
+
+static void pack_motion(void *packed, const void *reading)
+{
+    packed_motion_t *dst = packed;
+    const motion_record_t *src = reading;
+
+    dst->roll = src->roll;
+    dst->pitch = src->pitch;
+    dst->duration = src->duration;
+    memcpy(dst->rms, src->rms, sizeof(dst->rms));
+    memcpy(dst->peak, src->peak, sizeof(dst->peak));
+    memcpy(dst->frequency, src->frequency, sizeof(dst->frequency));
+}
+
+static void unpack_motion(void *reading, const void *packed)
+{
+    motion_record_t *dst = reading;
+    const packed_motion_t *src = packed;
+
+    dst->roll = src->roll;
+    dst->pitch = src->pitch;
+    dst->duration = src->duration;
+    memcpy(dst->rms, src->rms, sizeof(dst->rms));
+    memcpy(dst->peak, src->peak, sizeof(dst->peak));
+    memcpy(dst->frequency, src->frequency, sizeof(dst->frequency));
+}
+
+/* Record layout and share of the store of one channel */
+typedef struct
+{
+    const char *name;
+    size_t packed_size;
+    size_t timestamp_offset; /* Location of the timestamp within a reading */
+    uint32_t share;
+    void (*pack)(void *packed, const void *reading);
+    void (*unpack)(void *reading, const void *packed);
+} channel_layout_t;
+
+#define CHANNEL_LAYOUT(id, name, type, share, param)                             \
+    [SENSOR_CHANNEL_##id] = {#name, sizeof(packed_##name##_t), offsetof(type, timestamp), \
+                             share, pack_##name, unpack_##name},
+static const channel_layout_t layouts[SENSOR_CHANNEL_COUNT] = {
+    SENSOR_CHANNELS(CHANNEL_LAYOUT)
+};
+
+/* Packed readings of one channel, oldest reading is overwritten when full */
+typedef struct
+{
+    ring_buffer_t ring;
+    int64_t base;            /* Timestamp the packed times count from */
+    uint32_t fill_mark;      /* Readings at the configured fill level, 0 = no watermark */
+    uint32_t chunk_readings; /* Readings filling one published chunk, 0 = unknown */
+} channel_store_t;
+
+static channel_store_t stores[SENSOR_CHANNEL_COUNT];
 
-static temp_reading_t temp_readings[MAX_TEMP_SAMPLES];
-static int temp_count = 0;
+/* Sensor type publishing each channel */
+#define CHANNEL_PARAM(id, name, type, share, param) [SENSOR_CHANNEL_##id] = param,
+static const config_param_t channel_params[SENSOR_CHANNEL_COUNT] = {
+    SENSOR_CHANNELS(CHANNEL_PARAM)
+};
 
-static gyro_reading_t gyro_readings[MAX_GYRO_SAMPLES];
-static int gyro_count = 0;
+/* Called when a channel reaches its watermark, protected by sensor_mutex */
+static sensors_watermark_cb_t watermark_handler;
 
 /* Mutex for protecting the reading arrays */
 static K_MUTEX_DEFINE(sensor_mutex);
 
+/* Running statistics of one channel in the current aggregation window */
+typedef struct
+{
+    int32_t min;
+    int32_t max;
+    int32_t last;
+    int64_t sum;
+    uint32_t count;
+} channel_stats_t;
+
+/* Aggregation state, readings only update the window statistics while
+ * aggregating is set. Protected by sensor_mutex.
+ */
+static bool aggregating;
+static int64_t window_start;  /* Sample timestamp of the window start */
+static int64_t window_opened; /* Uptime of the window start in ms */
+static channel_stats_t battery_stats[NUM_BATTERIES];
+static channel_stats_t temp_stats;
+static channel_stats_t gyro_stats[GYRO_AXES];
+
+/* Change-of-value filter state of one battery */
+typedef struct
+{
+    bool valid;      /* A reading of this battery has been stored */
+    int16_t voltage; /* Voltage of the last stored reading */
+    int64_t kept_at; /* Uptime of the last stored reading in ms */
+} deadband_state_t;
+
+/* Battery deadband filter, protected by sensor_mutex */
+static int deadband_mv = CONFIG_ELFRYD_BATTERY_DEADBAND_MV;
+static int64_t heartbeat_ms = (int64_t)CONFIG_ELFRYD_BATTERY_HEARTBEAT * MSEC_PER_SEC;
+static deadband_state_t battery_deadband[NUM_BATTERIES];
+
+#ifdef CONFIG_ELFRYD_MOTION_FEATURES
+/* Raw gyroscope readings are stored until this uptime in ms, protected by
+ * sensor_mutex
+ */
+static int64_t capture_until;
+#endif
+
 /* Flag to track if using I2C sensors */
 static bool using_i2c = false;
 
+/* Timestamp of a packed record */
+static int64_t record_timestamp(const channel_store_t *store, const void *packed)
+{
+    return store->base + ((const packed_header_t *)packed)->time;
+}
+
+/* Unpack a stored record of a channel into a reading */
+static void unpack_record(sensor_channel_t channel, const void *packed, void *reading)
+{
+    const channel_layout_t *layout = &layouts[channel];
+
+    layout->unpack(reading, packed);
+    *(int64_t *)((uint8_t *)reading + layout->timestamp_offset) =
+        record_timestamp(&stores[channel], packed);
+}
+
+/* Move the time base of a channel, keeping the timestamps of its records.
+ * Must be called with sensor_mutex held.
+ */
+static void rebase(channel_store_t *store, int64_t base)
+{
+    for (uint32_t i = 0; i < ring_buffer_count(&store->ring); i++)
+    {
+        packed_header_t *header = ring_buffer_get(&store->ring, i);
+
+        header->time = CLAMP(record_timestamp(store, header) - base, 0, UINT32_MAX);
+    }
+
+    store->base = base;
+}
+
+/* Convert the time base of a channel to UTC once the time is known. Its
+ * records count from the base, so they all follow. Returns the number of
+ * records converted, must be called with sensor_mutex held.
+ */
+static int convert_base(channel_store_t *store)
+{
+    int64_t base = utils_timestamp_to_utc(store->base);
+
+    if (base == store->base)
+    {
+        return 0;
+    }
+
+    store->base = base;
+
+    return ring_buffer_count(&store->ring);
+}
+
+/* Notify the watermark handler as a channel's readings reach a full chunk
+ * or the fill level, whichever comes first. Only the reading that crosses
+ * the watermark notifies, not the overwrites of a full ring sitting at it.
+ * Must be called with sensor_mutex held.
+ */
+static void check_watermark(sensor_channel_t channel, uint32_t prev_count)
+{
+    channel_store_t *store = &stores[channel];
+    uint32_t mark = store->fill_mark;
+    uint32_t count;
+
+    if (mark == 0 || watermark_handler == NULL)
+    {
+        return;
+    }
+
+    if (store->chunk_readings > 0)
+    {
+        mark = MIN(mark, store->chunk_readings);
+    }
+
+    count = ring_buffer_count(&store->ring);
+    if (prev_count < mark && count >= mark)
+    {
+        watermark_handler(channel);
+    }
+}
+
+/* Store a reading of a channel, must be called with sensor_mutex held */
+static void store_reading(sensor_channel_t channel, const void *reading)
+{
+    const channel_layout_t *layout = &layouts[channel];
+    channel_store_t *store = &stores[channel];
+    ring_buffer_t *ring = &store->ring;
+    any_packed_t packed;
+    uint32_t prev_count;
+    int64_t timestamp;
+
+    timestamp = *(const int64_t *)((const uint8_t *)reading + layout->timestamp_offset);
+
+    /* Stamped just before the time was synchronized, convert it along with
+     * the rest of the channel
+     */
+    timestamp = utils_timestamp_to_utc(timestamp);
+    convert_base(store);
+
+    if (ring_buffer_count(ring) == 0)
+    {
+        store->base = timestamp;
+    }
+    else if (timestamp - store->base > UINT32_MAX)
+    {
+        /* Out of reach of the packed times, drop the readings too old to
+         * share a time base with this one
+         */
+        while (ring_buffer_count(ring) > 0 &&
+               timestamp - record_timestamp(store, ring_buffer_get(ring, 0)) > UINT32_MAX)
+        {
+            ring_buffer_drop(ring, 1);
+            metrics_inc(METRIC_SENSOR_EVICTIONS);
+        }
+
+        rebase(store, ring_buffer_count(ring) > 0 ?
+                          record_timestamp(store, ring_buffer_get(ring, 0)) : timestamp);
+    }
+
+    layout->pack(&packed, reading);
+
+    /* A clock stepped back is clamped to the base rather than wrapping */
+    ((packed_header_t *)&packed)->time = CLAMP(timestamp - store->base, 0, UINT32_MAX);
+
+    prev_count = ring_buffer_count(ring);
+    metrics_inc(METRIC_SENSOR_INSERTS);
+    if (ring_buffer_put(ring, &packed))
+    {
+        LOG_DBG(LOG_PREFIX_SENSOR "%s buffer full, oldest reading overwritten", layout->name);
+        metrics_inc(METRIC_SENSOR_EVICTIONS);
+    }
+
+    check_watermark(channel, prev_count);
+}
+
+/* Fold one value into the statistics of a channel */
+static void accumulate(channel_stats_t *stats, int32_t value)
+{
+    if (stats->count == 0)
+    {
+        stats->min = value;
+        stats->max = value;
+        stats->sum = 0;
+    }
+    else
+    {
+        stats->min = MIN(stats->min, value);
+        stats->max = MAX(stats->max, value);
+    }
+
+    stats->sum += value;
+    stats->last = value;
+    stats->count++;
+}
+
+/* Store a channel's window as an aggregate record and reset it, must be
+ * called with sensor_mutex held
+ */
+static int emit_stats(config_param_t sensor, uint8_t channel, channel_stats_t *stats,
+                      uint32_t duration)
+{
+    stats_record_t record;
+
+    if (stats->count == 0)
+    {
+        return 0;
+    }
+
+    record.sensor = sensor;
+    record.channel = channel;
+    record.count = stats->count;
+    record.min = stats->min;
+    record.max = stats->max;
+    record.mean = stats->sum / (int64_t)stats->count;
+    record.last = stats->last;
+    record.duration = duration;
+    record.timestamp = window_start;
+
+    store_reading(SENSOR_CHANNEL_STATS, &record);
+    stats->count = 0;
+
+    return 1;
+}
+
+/* Start a new aggregation window, must be called with sensor_mutex held */
+static void open_window(void)
+{
+    window_start = utils_get_sample_timestamp();
+    window_opened = k_uptime_get();
+}
+
+/* Check a battery reading against the deadband, and remember it if it is
+ * to be stored. Must be called with sensor_mutex held.
+ */
+static bool passes_deadband(const battery_reading_t *reading)
+{
+    deadband_state_t *state = &battery_deadband[reading->battery_id - 1];
+    int64_t now = k_uptime_get();
+
+    if (deadband_mv > 0 && state->valid &&
+        abs(reading->voltage - state->voltage) <= deadband_mv &&
+        (heartbeat_ms == 0 || now - state->kept_at < heartbeat_ms))
+    {
+        return false;
+    }
+
+    state->valid = true;
+    state->voltage = reading->voltage;
+    state->kept_at = now;
+
+    return true;
+}
+
+/* Store or aggregate new readings, must be called with sensor_mutex held */
+static void add_battery_reading(const battery_reading_t *reading)
+{
+    if (reading->battery_id < 1 || reading->battery_id > NUM_BATTERIES)
+    {
+        return;
+    }
+
+    if (aggregating)
+    {
+        accumulate(&battery_stats[reading->battery_id - 1], reading->voltage);
+    }
+    else if (passes_deadband(reading))
+    {
+        store_reading(SENSOR_CHANNEL_BATTERY, reading);
+    }
+}
+
+static void add_temp_reading(const temp_reading_t *reading)
+{
+    if (!aggregating)
+    {
+        store_reading(SENSOR_CHANNEL_TEMP, reading);
+        return;
+    }
+
+    accumulate(&temp_stats, reading->temperature);
+}
+
+static void add_gyro_reading(const gyro_reading_t *reading)
+{
+    if (!aggregating)
+    {
+#ifdef CONFIG_ELFRYD_MOTION_FEATURES
+        /* The motion features stand in for raw readings outside a capture */
+        if (k_uptime_get() >= capture_until)
+        {
+            return;
+        }
+#endif
+        store_reading(SENSOR_CHANNEL_GYRO, reading);
+        return;
+    }
+
+    accumulate(&gyro_stats[0], reading->accel_x);
+    accumulate(&gyro_stats[1], reading->accel_y);
+    accumulate(&gyro_stats[2], reading->accel_z);
+    accumulate(&gyro_stats[3], reading->gyro_x);
+    accumulate(&gyro_stats[4], reading->gyro_y);
+    accumulate(&gyro_stats[5], reading->gyro_z);
+}
+
+#ifdef CONFIG_ELFRYD_MOTION_FEATURES
+/* Feed a reading to the motion window and store the features of a full
+ * window. Called without sensor_mutex held, closing a window runs the FFTs.
+ */
+static void add_motion_sample(const gyro_reading_t *reading)
+{
+    motion_record_t record;
+
+    if (motion_add_sample(reading, &record) == 0)
+    {
+        return;
+    }
+
+    k_mutex_lock(&sensor_mutex, K_FOREVER);
+    store_reading(SENSOR_CHANNEL_MOTION, &record);
+    k_mutex_unlock(&sensor_mutex);
+}
+#endif
+
+/* Divide the sensor store between the channels in proportion to their
+ * shares, must be called with sensor_mutex held
+ */
+static void allocate_store(void)
+{
+    uint64_t weight = 0;
+
+    for (int i = 0; i < SENSOR_CHANNEL_COUNT; i++)
+    {
+        weight += (uint64_t)layouts[i].share * layouts[i].packed_size;
+    }
+
+    for (int i = 0; i < SENSOR_CHANNEL_COUNT; i++)
+    {
+        const channel_layout_t *layout = &layouts[i];
+        ring_buffer_t *ring = &stores[i].ring;
+        uint32_t capacity;
+
+        /* Already allocated, only start over empty */
+        if (ring->storage != NULL || layout->share == 0)
+        {
+            ring_buffer_init(ring, ring->storage, layout->packed_size, ring->capacity);
+            continue;
+        }
+
+        capacity = (uint64_t)layout->share * (SENSOR_STORE_SIZE - STORE_HEAP_RESERVE) / weight;
+
+        /* Shrink a little should the heap need more room than reserved */
+        while (capacity > 0 &&
+               (ring->storage = k_heap_alloc(&store_heap, capacity * layout->packed_size,
+                                             K_NO_WAIT)) == NULL)
+        {
+            capacity -= capacity / 16 + 1;
+        }
+
+        ring_buffer_init(ring, ring->storage, layout->packed_size, capacity);
+        stores[i].fill_mark = (uint64_t)capacity * CONFIG_ELFRYD_PUBLISH_WATERMARK / 100;
+
+        LOG_INF(LOG_PREFIX_SENSOR "Storing up to %u %s readings, %zu bytes each",
+                capacity, layout->name, layout->packed_size);
+    }
+}
+
 int sensors_init(void)
 {
 #ifdef CONFIG_ELFRYD_USE_I2C_SENSORS
     int err;
 #endif
 
-    /* Initialize the arrays with empty data */
-    battery_count = 0;
-    temp_count = 0;
-    gyro_count = 0;
+    /* Initialize the ring buffers with empty data */
+    k_mutex_lock(&sensor_mutex, K_FOREVER);
+    allocate_store();
+    open_window();
+    k_mutex_unlock(&sensor_mutex);
 
     /* Seed the random number generator for sample data generation */
     sys_rand_get(NULL, 0);
@@ -82,13 +697,6 @@ int sensors_generate_battery_reading(int battery_id)
         return -EINVAL; /* Invalid battery ID */
     }
 
-    /* Check if time is synchronized before collecting data */
-    if (!utils_is_time_synchronized())
-    {
-        LOG_WRN(LOG_PREFIX_SENSOR "Time not synchronized, skipping battery reading");
-        return 0; /* Skip data collection but don't report as error */
-    }
-
     /* Generate battery reading from I2C or sample data */
     if (using_i2c)
     {
@@ -108,47 +716,30 @@ int sensors_generate_battery_reading(int battery_id)
         /* Successfully read new data, store it */
         k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-        /* If buffer is full, make room by shifting */
-        if (battery_count >= MAX_BATTERY_SAMPLES)
-        {
-            for (int i = 0; i < MAX_BATTERY_SAMPLES - 1; i++)
-            {
-                battery_readings[i] = battery_readings[i + 1];
-            }
-            battery_count = MAX_BATTERY_SAMPLES - 1;
-        }
-
         /* Store the new reading */
-        battery_readings[battery_count] = reading;
-        battery_count++;
+        add_battery_reading(&reading);
 
         k_mutex_unlock(&sensor_mutex);
         
         LOG_INF(LOG_PREFIX_SENSOR "New battery reading for ID %d: %d mV", 
                 reading.battery_id, reading.voltage);
+
+#ifdef CONFIG_ELFRYD_ALARMS
+        /* Only real readings are checked, sample data would raise alarms all the time */
+        alarms_check_battery(&reading);
+#endif
     }
     else
     {
         /* Generate sample battery data - only in non-I2C mode */
         reading.battery_id = battery_id;
         reading.voltage = 12000 + (sys_rand32_get() % 1501);
-        reading.timestamp = utils_get_timestamp();
+        reading.timestamp = utils_get_sample_timestamp();
         
         k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-        /* If buffer is full, make room by shifting */
-        if (battery_count >= MAX_BATTERY_SAMPLES)
-        {
-            for (int i = 0; i < MAX_BATTERY_SAMPLES - 1; i++)
-            {
-                battery_readings[i] = battery_readings[i + 1];
-            }
-            battery_count = MAX_BATTERY_SAMPLES - 1;
-        }
-
         /* Store the new reading */
-        battery_readings[battery_count] = reading;
-        battery_count++;
+        add_battery_reading(&reading);
 
         k_mutex_unlock(&sensor_mutex);
     }
@@ -161,13 +752,6 @@ int sensors_generate_temp_reading(void)
     int err;
     temp_reading_t reading;
 
-    /* Check if time is synchronized before collecting data */
-    if (!utils_is_time_synchronized())
-    {
-        LOG_WRN(LOG_PREFIX_SENSOR "Time not synchronized, skipping temperature reading");
-        return 0; /* Skip data collection but don't report as error */
-    }
-
     /* Generate temperature reading from I2C or sample data */
     if (using_i2c)
     {
@@ -187,19 +771,8 @@ int sensors_generate_temp_reading(void)
         /* Successfully read new data, store it */
         k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-        /* If buffer is full, make room by shifting */
-        if (temp_count >= MAX_TEMP_SAMPLES)
-        {
-            for (int i = 0; i < MAX_TEMP_SAMPLES - 1; i++)
-            {
-                temp_readings[i] = temp_readings[i + 1];
-            }
-            temp_count = MAX_TEMP_SAMPLES - 1;
-        }
-
         /* Store the new reading */
-        temp_readings[temp_count] = reading;
-        temp_count++;
+        add_temp_reading(&reading);
 
         k_mutex_unlock(&sensor_mutex);
         
@@ -209,23 +782,12 @@ int sensors_generate_temp_reading(void)
     {
         /* Generate sample temperature data - only in non-I2C mode */
         reading.temperature = 5 + (sys_rand32_get() % 30);
-        reading.timestamp = utils_get_timestamp();
+        reading.timestamp = utils_get_sample_timestamp();
         
         k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-        /* If buffer is full, make room by shifting */
-        if (temp_count >= MAX_TEMP_SAMPLES)
-        {
-            for (int i = 0; i < MAX_TEMP_SAMPLES - 1; i++)
-            {
-                temp_readings[i] = temp_readings[i + 1];
-            }
-            temp_count = MAX_TEMP_SAMPLES - 1;
-        }
-
         /* Store the new reading */
-        temp_readings[temp_count] = reading;
-        temp_count++;
+        add_temp_reading(&reading);
 
         k_mutex_unlock(&sensor_mutex);
     }
@@ -238,13 +800,6 @@ int sensors_generate_gyro_reading(void)
     int err;
     gyro_reading_t reading;
 
-    /* Check if time is synchronized before collecting data */
-    if (!utils_is_time_synchronized())
-    {
-        LOG_WRN(LOG_PREFIX_SENSOR "Time not synchronized, skipping gyroscope reading");
-        return 0; /* Skip data collection but don't report as error */
-    }
-
     /* Generate gyroscope reading from I2C or sample data */
     if (using_i2c)
     {
@@ -264,23 +819,16 @@ int sensors_generate_gyro_reading(void)
         /* Successfully read new data, store it */
         k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-        /* If buffer is full, make room by shifting */
-        if (gyro_count >= MAX_GYRO_SAMPLES)
-        {
-            for (int i = 0; i < MAX_GYRO_SAMPLES - 1; i++)
-            {
-                gyro_readings[i] = gyro_readings[i + 1];
-            }
-            gyro_count = MAX_GYRO_SAMPLES - 1;
-        }
-
         /* Store the new reading */
-        gyro_readings[gyro_count] = reading;
-        gyro_count++;
+        add_gyro_reading(&reading);
 
         k_mutex_unlock(&sensor_mutex);
         
-        LOG_INF(LOG_PREFIX_SENSOR "New gyroscope reading received");
+        LOG_DBG(LOG_PREFIX_SENSOR "New gyroscope reading received");
+
+#ifdef CONFIG_ELFRYD_ALARMS
+        alarms_check_gyro(&reading);
+#endif
     }
     else
     {
@@ -291,209 +839,261 @@ int sensors_generate_gyro_reading(void)
         reading.gyro_x = -250000 + (sys_rand32_get() % 500000);
         reading.gyro_y = -250000 + (sys_rand32_get() % 500000);
         reading.gyro_z = -250000 + (sys_rand32_get() % 500000);
-        reading.timestamp = utils_get_timestamp();
+        reading.timestamp = utils_get_sample_timestamp();
         
         k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-        /* If buffer is full, make room by shifting */
-        if (gyro_count >= MAX_GYRO_SAMPLES)
-        {
-            for (int i = 0; i < MAX_GYRO_SAMPLES - 1; i++)
-            {
-                gyro_readings[i] = gyro_readings[i + 1];
-            }
-            gyro_count = MAX_GYRO_SAMPLES - 1;
-        }
-
         /* Store the new reading */
-        gyro_readings[gyro_count] = reading;
-        gyro_count++;
+        add_gyro_reading(&reading);
 
         k_mutex_unlock(&sensor_mutex);
     }
 
+#ifdef CONFIG_ELFRYD_MOTION_FEATURES
+    add_motion_sample(&reading);
+#endif
+
     return 0;
 }
 
-int sensors_get_battery_readings(battery_reading_t *readings, int max_count)
+int sensors_peek(sensor_channel_t channel, sensor_cursor_t *cursor,
+                 sensors_peek_cb_t cb, void *user_data)
 {
-    int count;
+    ring_buffer_t *ring;
+    any_reading_t reading;
+    uint32_t offset;
+    uint32_t count;
+    uint32_t consumed = 0;
+
+    if (channel >= SENSOR_CHANNEL_COUNT || cursor == NULL || cb == NULL)
+    {
+        return -EINVAL;
+    }
+
+    ring = &stores[channel].ring;
 
     k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-    /* Copy the available readings, up to max_count */
-    count = battery_count < max_count ? battery_count : max_count;
-    for (int i = 0; i < count; i++)
+    /* Skip forward if the requested readings have been overwritten */
+    offset = cursor->start - ring_buffer_first_seq(ring);
+    if ((int32_t)offset < 0)
     {
-        readings[i] = battery_readings[i];
+        cursor->start = ring_buffer_first_seq(ring);
+        offset = 0;
+    }
+
+    count = ring_buffer_count(ring);
+    while (offset + consumed < count)
+    {
+        unpack_record(channel, ring_buffer_get(ring, offset + consumed), &reading);
+
+        if (cb(&reading, user_data) != 0)
+        {
+            break;
+        }
+        consumed++;
     }
 
     k_mutex_unlock(&sensor_mutex);
 
-    return count;
+    cursor->count = consumed;
+
+    return consumed;
 }
 
-int sensors_get_temp_readings(temp_reading_t *readings, int max_count)
+void sensors_commit(sensor_channel_t channel, const sensor_cursor_t *cursor)
 {
-    int count;
+    ring_buffer_t *ring;
+    uint32_t release;
+
+    if (channel >= SENSOR_CHANNEL_COUNT || cursor == NULL)
+    {
+        return;
+    }
+
+    ring = &stores[channel].ring;
 
     k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-    /* Copy the available readings, up to max_count */
-    count = temp_count < max_count ? temp_count : max_count;
-    for (int i = 0; i < count; i++)
+    /* Readings already overwritten since the peek need no release */
+    release = (cursor->start + cursor->count) - ring_buffer_first_seq(ring);
+    if ((int32_t)release > 0)
     {
-        readings[i] = temp_readings[i];
+        ring_buffer_drop(ring, release);
     }
 
     k_mutex_unlock(&sensor_mutex);
-
-    return count;
 }
 
-int sensors_get_gyro_readings(gyro_reading_t *readings, int max_count)
+int sensors_get_latest(sensor_channel_t channel, void *reading)
 {
-    int count;
+    const void *latest;
+
+    if (channel >= SENSOR_CHANNEL_COUNT || reading == NULL)
+    {
+        return -EINVAL;
+    }
 
     k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-    /* Copy the available readings, up to max_count */
-    count = gyro_count < max_count ? gyro_count : max_count;
-    for (int i = 0; i < count; i++)
+    latest = ring_buffer_latest(&stores[channel].ring);
+    if (latest == NULL)
     {
-        readings[i] = gyro_readings[i];
+        k_mutex_unlock(&sensor_mutex);
+        return -ENODATA;
     }
 
+    /* Unpack the most recent reading */
+    unpack_record(channel, latest, reading);
+
     k_mutex_unlock(&sensor_mutex);
 
-    return count;
+    return 0;
 }
 
-void sensors_clear_battery_readings(void)
+int sensors_get_count(sensor_channel_t channel)
 {
-    k_mutex_lock(&sensor_mutex, K_FOREVER);
-    battery_count = 0;
-    k_mutex_unlock(&sensor_mutex);
-}
+    int count;
+
+    if (channel >= SENSOR_CHANNEL_COUNT)
+    {
+        return 0;
+    }
 
-void sensors_clear_temp_readings(void)
-{
     k_mutex_lock(&sensor_mutex, K_FOREVER);
-    temp_count = 0;
+    count = ring_buffer_count(&stores[channel].ring);
     k_mutex_unlock(&sensor_mutex);
+
+    return count;
 }
 
-void sensors_clear_gyro_readings(void)
+const char *sensors_channel_name(sensor_channel_t channel)
 {
-    k_mutex_lock(&sensor_mutex, K_FOREVER);
-    gyro_count = 0;
-    k_mutex_unlock(&sensor_mutex);
+    return channel < SENSOR_CHANNEL_COUNT ? layouts[channel].name : "unknown";
 }
 
-/**
- * Implementation of new monitoring functions
- */
-
-int sensors_get_latest_battery_reading(battery_reading_t *reading)
+void sensors_set_aggregation(bool enable)
 {
-    if (reading == NULL)
-    {
-        return -EINVAL;
-    }
-
     k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-    if (battery_count <= 0)
+    if (enable && !aggregating)
     {
-        k_mutex_unlock(&sensor_mutex);
-        return -ENODATA;
+        /* Drop leftovers of an earlier window, it was closed before disabling */
+        memset(battery_stats, 0, sizeof(battery_stats));
+        memset(&temp_stats, 0, sizeof(temp_stats));
+        memset(gyro_stats, 0, sizeof(gyro_stats));
+        open_window();
     }
 
-    /* Copy the most recent reading (last in the array) */
-    *reading = battery_readings[battery_count - 1];
+    aggregating = enable;
 
     k_mutex_unlock(&sensor_mutex);
-
-    return 0;
 }
 
-int sensors_get_latest_temp_reading(temp_reading_t *reading)
+void sensors_set_battery_deadband(int deadband, int heartbeat)
 {
-    if (reading == NULL)
-    {
-        return -EINVAL;
-    }
-
     k_mutex_lock(&sensor_mutex, K_FOREVER);
 
-    if (temp_count <= 0)
-    {
-        k_mutex_unlock(&sensor_mutex);
-        return -ENODATA;
-    }
+    deadband_mv = MAX(deadband, 0);
+    heartbeat_ms = (int64_t)MAX(heartbeat, 0) * MSEC_PER_SEC;
 
-    /* Copy the most recent reading (last in the array) */
-    *reading = temp_readings[temp_count - 1];
+    /* Store the next reading of every battery as the new reference */
+    memset(battery_deadband, 0, sizeof(battery_deadband));
 
     k_mutex_unlock(&sensor_mutex);
 
-    return 0;
+    LOG_INF(LOG_PREFIX_SENSOR "Battery deadband %d mV, heartbeat %d s", deadband, heartbeat);
 }
 
-int sensors_get_latest_gyro_reading(gyro_reading_t *reading)
+void sensors_capture_raw_gyro(int seconds)
 {
-    if (reading == NULL)
+#ifdef CONFIG_ELFRYD_MOTION_FEATURES
+    k_mutex_lock(&sensor_mutex, K_FOREVER);
+    capture_until = k_uptime_get() + (int64_t)MAX(seconds, 0) * MSEC_PER_SEC;
+    k_mutex_unlock(&sensor_mutex);
+
+    LOG_INF(LOG_PREFIX_SENSOR "Capturing raw gyroscope readings for %d s", seconds);
+#else
+    /* Raw readings are always stored */
+    ARG_UNUSED(seconds);
+#endif
+}
+
+int sensors_close_aggregate_window(void)
+{
+    uint32_t duration;
+    int records = 0;
+
+    k_mutex_lock(&sensor_mutex, K_FOREVER);
+
+    /* Measured on the uptime clock, the window may span the time sync */
+    duration = (uint32_t)(k_uptime_get() - window_opened);
+
+    for (int i = 0; i < NUM_BATTERIES; i++)
     {
-        return -EINVAL;
+        records += emit_stats(CONFIG_PARAM_BATTERY, i + 1, &battery_stats[i], duration);
     }
 
-    k_mutex_lock(&sensor_mutex, K_FOREVER);
+    records += emit_stats(CONFIG_PARAM_TEMP, 0, &temp_stats, duration);
 
-    if (gyro_count <= 0)
+    for (int i = 0; i < GYRO_AXES; i++)
     {
-        k_mutex_unlock(&sensor_mutex);
-        return -ENODATA;
+        records += emit_stats(CONFIG_PARAM_GYRO, i, &gyro_stats[i], duration);
     }
 
-    /* Copy the most recent reading (last in the array) */
-    *reading = gyro_readings[gyro_count - 1];
+    open_window();
 
     k_mutex_unlock(&sensor_mutex);
 
-    return 0;
+    if (records > 0)
+    {
+        LOG_INF(LOG_PREFIX_SENSOR "Closed %u ms aggregation window: %d records", duration, records);
+    }
+
+    return records;
 }
 
-int sensors_get_battery_reading_count(void)
+int sensors_timestamps_synchronized(void)
 {
-    int count;
+    int patched = 0;
 
     k_mutex_lock(&sensor_mutex, K_FOREVER);
-    count = battery_count;
+    for (int i = 0; i < SENSOR_CHANNEL_COUNT; i++)
+    {
+        patched += convert_base(&stores[i]);
+    }
     k_mutex_unlock(&sensor_mutex);
 
-    return count;
+    if (patched > 0)
+    {
+        LOG_INF(LOG_PREFIX_SENSOR "Converted %d readings taken before time sync to UTC", patched);
+    }
+
+    return patched;
 }
 
-int sensors_get_temp_reading_count(void)
+config_param_t sensors_channel_param(sensor_channel_t channel)
 {
-    int count;
+    return channel < SENSOR_CHANNEL_COUNT ? channel_params[channel] : CONFIG_PARAM_AGGREGATE;
+}
 
+void sensors_set_watermark_handler(sensors_watermark_cb_t handler)
+{
     k_mutex_lock(&sensor_mutex, K_FOREVER);
-    count = temp_count;
+    watermark_handler = handler;
     k_mutex_unlock(&sensor_mutex);
-
-    return count;
 }
 
-int sensors_get_gyro_reading_count(void)
+void sensors_set_chunk_readings(sensor_channel_t channel, uint32_t readings)
 {
-    int count;
+    if (channel >= SENSOR_CHANNEL_COUNT)
+    {
+        return;
+    }
 
     k_mutex_lock(&sensor_mutex, K_FOREVER);
-    count = gyro_count;
+    stores[channel].chunk_readings = readings;
     k_mutex_unlock(&sensor_mutex);
-
-    return count;
 }
 
 bool sensors_using_i2c(void)
@@ -505,20 +1105,13 @@ int sensors_generate_all_battery_readings(void)
 {
     int err;
     int valid_readings = 0;
-    battery_reading_t temp_readings[NUM_BATTERIES];
-
-    /* Check if time is synchronized before collecting data */
-    if (!utils_is_time_synchronized())
-    {
-        LOG_WRN(LOG_PREFIX_SENSOR "Time not synchronized, skipping battery readings");
-        return 0; /* Skip data collection but don't report as error */
-    }
+    battery_reading_t new_readings[NUM_BATTERIES];
 
     /* Generate battery readings from I2C or sample data */
     if (using_i2c)
     {
         /* Use the new bulk read function for I2C mode */
-        err = i2c_read_all_battery_data(temp_readings, NUM_BATTERIES);
+        err = i2c_read_all_battery_data(new_readings, NUM_BATTERIES);
         if (err < 0)
         {
             if (err == -EAGAIN)
@@ -544,25 +1137,21 @@ int sensors_generate_all_battery_readings(void)
 
         for (int i = 0; i < valid_readings; i++)
         {
-            /* If buffer is full, make room by shifting */
-            if (battery_count >= MAX_BATTERY_SAMPLES)
-            {
-                for (int j = 0; j < MAX_BATTERY_SAMPLES - 1; j++)
-                {
-                    battery_readings[j] = battery_readings[j + 1];
-                }
-                battery_count = MAX_BATTERY_SAMPLES - 1;
-            }
-
             /* Store the new reading */
-            battery_readings[battery_count] = temp_readings[i];
-            battery_count++;
+            add_battery_reading(&new_readings[i]);
             
             LOG_INF(LOG_PREFIX_SENSOR "New battery reading for ID %d: %d mV", 
-                    temp_readings[i].battery_id, temp_readings[i].voltage);
+                    new_readings[i].battery_id, new_readings[i].voltage);
         }
 
         k_mutex_unlock(&sensor_mutex);
+
+#ifdef CONFIG_ELFRYD_ALARMS
+        for (int i = 0; i < valid_readings; i++)
+        {
+            alarms_check_battery(&new_readings[i]);
+        }
+#endif
     }
     else
     {
@@ -571,21 +1160,13 @@ int sensors_generate_all_battery_readings(void)
         
         for (int battery_id = 1; battery_id <= NUM_BATTERIES; battery_id++)
         {
-            /* If buffer is full, make room by shifting */
-            if (battery_count >= MAX_BATTERY_SAMPLES)
-            {
-                for (int j = 0; j < MAX_BATTERY_SAMPLES - 1; j++)
-                {
-                    battery_readings[j] = battery_readings[j + 1];
-                }
-                battery_count = MAX_BATTERY_SAMPLES - 1;
-            }
-            
             /* Create a new sample reading */
-            battery_readings[battery_count].battery_id = battery_id;
-            battery_readings[battery_count].voltage = 12000 + (sys_rand32_get() % 1501);
-            battery_readings[battery_count].timestamp = utils_get_timestamp();
-            battery_count++;
+            battery_reading_t reading = {
+                .battery_id = battery_id,
+                .voltage = 12000 + (sys_rand32_get() % 1501),
+                .timestamp = utils_get_sample_timestamp()};
+
+            add_battery_reading(&reading);
             valid_readings++;
         }
         
@@ -9,6 +9,8 @@
 #include <stdbool.h>
 #include <zephyr/kernel.h>
 
+#include "config/config_module.h"
+
 /** 
  * Configure number of battery packs to monitor 
  * Note: This is defined by Kconfig (CONFIG_ELFRYD_NUM_BATTERIES)
@@ -16,12 +18,42 @@
 #define NUM_BATTERIES CONFIG_ELFRYD_NUM_BATTERIES
 
 /**
- * Maximum number of sensor readings to store
- * Note: These are defined by Kconfig
+ * Size of the sensor store in bytes, shared by all channels
+ * Note: This is defined by Kconfig (CONFIG_ELFRYD_SENSOR_STORE_SIZE)
  */
-#define MAX_BATTERY_SAMPLES CONFIG_ELFRYD_MAX_BATTERY_SAMPLES
-#define MAX_TEMP_SAMPLES CONFIG_ELFRYD_MAX_TEMP_SAMPLES
-#define MAX_GYRO_SAMPLES CONFIG_ELFRYD_MAX_GYRO_SAMPLES
+#define SENSOR_STORE_SIZE CONFIG_ELFRYD_SENSOR_STORE_SIZE
+
+/**
+ * Share of the sensor store per channel, relative to the other channels
+ * Note: These are defined by Kconfig, disabled sensors get no storage. The
+ * split is computed once at startup.
+ */
+#ifdef CONFIG_ELFRYD_ENABLE_BATTERY_SENSOR
+#define BATTERY_SHARE CONFIG_ELFRYD_BATTERY_SHARE
+#else
+#define BATTERY_SHARE 0
+#endif
+#ifdef CONFIG_ELFRYD_ENABLE_TEMP_SENSOR
+#define TEMP_SHARE CONFIG_ELFRYD_TEMP_SHARE
+#else
+#define TEMP_SHARE 0
+#endif
+#ifdef CONFIG_ELFRYD_ENABLE_GYRO_SENSOR
+#define GYRO_SHARE CONFIG_ELFRYD_GYRO_SHARE
+#else
+#define GYRO_SHARE 0
+#endif
+#define STATS_SHARE CONFIG_ELFRYD_STATS_SHARE
+#ifdef CONFIG_ELFRYD_MOTION_FEATURES
+#define MOTION_SHARE CONFIG_ELFRYD_MOTION_SHARE
+#else
+#define MOTION_SHARE 0
+#endif
+
+/**
+ * Number of aggregated gyroscope channels, accelerometer x/y/z then gyroscope x/y/z
+ */
+#define GYRO_AXES 6
 
 /**
  * Battery voltage reading structure
@@ -30,7 +62,7 @@ typedef struct
 {
     int battery_id;
     int16_t voltage;
-    int64_t timestamp;
+    int64_t timestamp; /* Milliseconds since epoch, or since boot before time sync */
 } battery_reading_t;
 
 /**
@@ -39,7 +71,7 @@ typedef struct
 typedef struct
 {
     int16_t temperature;
-    int64_t timestamp;
+    int64_t timestamp; /* Milliseconds since epoch, or since boot before time sync */
 } temp_reading_t;
 
 /**
@@ -53,9 +85,74 @@ typedef struct
     int32_t gyro_x;   /* Using 24 bits only */
     int32_t gyro_y;   /* Using 24 bits only */
     int32_t gyro_z;   /* Using 24 bits only */
-    int64_t timestamp;
+    int64_t timestamp; /* Milliseconds since epoch, or since boot before time sync */
 } gyro_reading_t;
 
+/**
+ * Aggregate of one sensor channel over a window
+ */
+typedef struct
+{
+    uint8_t sensor;    /* config_param_t of the sensor type */
+    uint8_t channel;   /* Battery ID, gyro axis (accel x/y/z then gyro x/y/z) or 0 for temperature */
+    uint32_t count;    /* Number of readings in the window */
+    int32_t min;
+    int32_t max;
+    int32_t mean;
+    int32_t last;
+    uint32_t duration; /* Length of the window in milliseconds */
+    int64_t timestamp; /* Start of the window, milliseconds since epoch, or since boot before time sync */
+} stats_record_t;
+
+/**
+ * Motion features of the gyroscope/accelerometer axes over a window
+ *
+ * Axes are ordered accelerometer x/y/z then gyroscope x/y/z, in raw sensor
+ * units. The RMS and peak are taken after removing the mean of the window.
+ */
+typedef struct
+{
+    int16_t roll;                   /* Mean roll in tenths of a degree */
+    int16_t pitch;                  /* Mean pitch in tenths of a degree */
+    uint32_t duration;              /* Time from first to last reading in milliseconds */
+    int32_t rms[GYRO_AXES];
+    int32_t peak[GYRO_AXES];        /* Largest deviation from the mean */
+    uint32_t frequency[GYRO_AXES];  /* Dominant frequency in millihertz, 0 if still */
+    int64_t timestamp;              /* First reading, milliseconds since epoch, or since boot before time sync */
+} motion_record_t;
+
+/**
+ * Registry of stored sensor channels
+ *
+ * X(id, name, type, share, param) for every channel: the sensor store
+ * keeps records of the given type in a ring buffer, packed to
+ * packed_<name>_t by pack_<name> in sensors.c, they are published on
+ * MQTT_TOPIC_<id> with the serializer append_<name>, and they are due
+ * whenever sensor type param is due. The store is divided between channels
+ * in proportion to their share. Channels with a share of 0 keep their ID
+ * but take no RAM.
+ *
+ * Channel IDs tag the batches kept in the offline store, so new channels
+ * must be added at the end.
+ */
+#define SENSOR_CHANNELS(X)                                                    \
+    X(BATTERY, battery, battery_reading_t, BATTERY_SHARE, CONFIG_PARAM_BATTERY) \
+    X(TEMP, temp, temp_reading_t, TEMP_SHARE, CONFIG_PARAM_TEMP)                \
+    X(GYRO, gyro, gyro_reading_t, GYRO_SHARE, CONFIG_PARAM_GYRO)                \
+    X(STATS, stats, stats_record_t, STATS_SHARE, CONFIG_PARAM_AGGREGATE)        \
+    X(MOTION, motion, motion_record_t, MOTION_SHARE, CONFIG_PARAM_GYRO)
+
+/**
+ * Stored sensor channels, generated from SENSOR_CHANNELS
+ */
+typedef enum
+{
+#define SENSOR_CHANNEL_ID(id, name, type, share, param) SENSOR_CHANNEL_##id,
+    SENSOR_CHANNELS(SENSOR_CHANNEL_ID)
+#undef SENSOR_CHANNEL_ID
+    SENSOR_CHANNEL_COUNT
+} sensor_channel_t;
+
 /**
  * Initialize the sensor module
  *
@@ -93,91 +190,180 @@ int sensors_generate_temp_reading(void);
 int sensors_generate_gyro_reading(void);
 
 /**
- * Get battery readings
+ * Range of stored readings, identified by sequence number
+ *
+ * Every stored reading of a channel gets a sequence number that grows by
+ * one per reading. A cursor stays valid while new readings are added, so it
+ * can be used to release exactly the readings that were published.
+ */
+typedef struct
+{
+    uint32_t start; /* Sequence number of the first reading in the range */
+    uint32_t count; /* Number of readings in the range */
+} sensor_cursor_t;
+
+/**
+ * Callback invoked for each reading visited by a peek
  *
- * @param readings Array to store the readings
- * @param max_count Maximum number of readings to retrieve
- * @return Number of readings copied, or negative errno code on failure
+ * Readings are kept packed in the sensor store, the reading passed here is
+ * unpacked from it and only valid for the duration of the call. The sensor
+ * store is locked while the callback runs, so it must not block.
+ *
+ * @param reading   Pointer to the reading, of the record type of the channel
+ * @param user_data User data passed to the peek function
+ * @return          0 if the reading was consumed, non-zero to stop before this reading
  */
-int sensors_get_battery_readings(battery_reading_t *readings, int max_count);
+typedef int (*sensors_peek_cb_t)(const void *reading, void *user_data);
 
 /**
- * Get temperature readings
+ * Visit stored readings of a channel without removing them
+ *
+ * Readings are visited oldest first, starting at cursor->start. If that
+ * reading has already been overwritten, the peek starts at the oldest stored
+ * reading and cursor->start is moved forward accordingly. On return
+ * cursor->count holds the number of readings consumed by the callback.
  *
- * @param readings Array to store the readings
- * @param max_count Maximum number of readings to retrieve
- * @return Number of readings copied, or negative errno code on failure
+ * @param channel   Channel to visit
+ * @param cursor    Cursor to start from, updated with the consumed range
+ * @param cb        Callback invoked for each reading
+ * @param user_data User data passed to the callback
+ * @return          Number of readings consumed, or negative errno code on failure
  */
-int sensors_get_temp_readings(temp_reading_t *readings, int max_count);
+int sensors_peek(sensor_channel_t channel, sensor_cursor_t *cursor,
+                 sensors_peek_cb_t cb, void *user_data);
 
 /**
- * Get gyroscope/accelerometer readings
+ * Release readings of a channel up to and including the end of a cursor range
+ *
+ * Readings that were stored after the range was peeked are kept.
  *
- * @param readings Array to store the readings
- * @param max_count Maximum number of readings to retrieve
- * @return Number of readings copied, or negative errno code on failure
+ * @param channel Channel the range was peeked from
+ * @param cursor  Range returned by sensors_peek
  */
-int sensors_get_gyro_readings(gyro_reading_t *readings, int max_count);
+void sensors_commit(sensor_channel_t channel, const sensor_cursor_t *cursor);
 
 /**
- * Clear all stored battery readings
+ * Get the latest reading of a channel
+ *
+ * @param channel Channel to read
+ * @param reading Pointer to store the reading, of the channel's record type
+ * @return 0 on success, negative errno code on failure
  */
-void sensors_clear_battery_readings(void);
+int sensors_get_latest(sensor_channel_t channel, void *reading);
 
 /**
- * Clear all stored temperature readings
+ * Get the number of stored readings of a channel
+ *
+ * @param channel Channel to count
+ * @return Number of readings
  */
-void sensors_clear_temp_readings(void);
+int sensors_get_count(sensor_channel_t channel);
 
 /**
- * Clear all stored gyroscope/accelerometer readings
+ * Get the name of a channel, for logging
+ *
+ * @param channel Channel to name
+ * @return Name of the channel
  */
-void sensors_clear_gyro_readings(void);
+const char *sensors_channel_name(sensor_channel_t channel);
 
 /**
- * Get the latest battery reading
+ * Get the sensor type whose publish deadline publishes a channel
  *
- * @param reading Pointer to store the reading
- * @return 0 on success, negative errno code on failure
+ * @param channel Channel to look up
+ * @return Sensor type of the channel, CONFIG_PARAM_AGGREGATE for aggregate records
  */
-int sensors_get_latest_battery_reading(battery_reading_t *reading);
+config_param_t sensors_channel_param(sensor_channel_t channel);
 
 /**
- * Get the latest temperature reading
+ * Callback invoked when a channel reaches its publish watermark
  *
- * @param reading Pointer to store the reading
- * @return 0 on success, negative errno code on failure
+ * Called from the thread storing the reading, with the sensor store locked,
+ * so it must not block or access the sensor store.
+ *
+ * @param channel Channel that reached its watermark
  */
-int sensors_get_latest_temp_reading(temp_reading_t *reading);
+typedef void (*sensors_watermark_cb_t)(sensor_channel_t channel);
 
 /**
- * Get the latest gyroscope/accelerometer reading
+ * Set the handler called when a channel reaches its publish watermark
  *
- * @param reading Pointer to store the reading
- * @return 0 on success, negative errno code on failure
+ * A channel reaches its watermark when its stored readings fill
+ * CONFIG_ELFRYD_PUBLISH_WATERMARK percent of its storage, or one published
+ * chunk as set with sensors_set_chunk_readings, whichever is fewer. The
+ * handler is called once as the watermark is crossed, and again only after
+ * published readings have been released and it is crossed anew.
+ *
+ * @param handler Handler to call, or NULL to disable notifications
  */
-int sensors_get_latest_gyro_reading(gyro_reading_t *reading);
+void sensors_set_watermark_handler(sensors_watermark_cb_t handler);
 
 /**
- * Get the number of stored battery readings
+ * Set the number of readings of a channel that fill one published chunk
  *
- * @return Number of readings
+ * @param channel  Channel the chunk was published from
+ * @param readings Readings that fit one chunk, 0 if not known
  */
-int sensors_get_battery_reading_count(void);
+void sensors_set_chunk_readings(sensor_channel_t channel, uint32_t readings);
 
 /**
- * Get the number of stored temperature readings
+ * Switch between storing raw readings and aggregating them
  *
- * @return Number of readings
+ * While aggregation is enabled new readings only update running min, max,
+ * mean, count and last value per channel, and the raw reading buffers stay
+ * empty. Enabling it starts a new window; close the current window before
+ * disabling it so its readings are not lost.
+ *
+ * @param enable true to aggregate readings, false to store them as they are
  */
-int sensors_get_temp_reading_count(void);
+void sensors_set_aggregation(bool enable);
 
 /**
- * Get the number of stored gyroscope/accelerometer readings
+ * Set the change-of-value filter for battery readings
  *
- * @return Number of readings
+ * A raw battery reading is only stored when its voltage differs from the
+ * last stored voltage of that battery by more than the deadband, or when
+ * the heartbeat time has passed since then. Aggregation still sees every
+ * reading.
+ *
+ * @param deadband  Deadband in millivolts, 0 to store every reading
+ * @param heartbeat Longest time between stored readings of a battery in
+ *                  seconds, 0 to only store changes
+ */
+void sensors_set_battery_deadband(int deadband, int heartbeat);
+
+/**
+ * Store raw gyroscope readings for a while
+ *
+ * With motion features enabled only the features of each motion window are
+ * stored, and raw gyroscope readings are dropped. This keeps raw readings
+ * as well for the given time, e.g. to look into unusual motion.
+ *
+ * @param seconds How long to keep raw readings, 0 to stop a running capture
+ */
+void sensors_capture_raw_gyro(int seconds);
+
+/**
+ * Close the current aggregation window and start the next one
+ *
+ * Stores one aggregate record for every channel that received readings
+ * during the window. The minimum and maximum keep the extremes of the
+ * window, so short voltage dips are not averaged away.
+ *
+ * @return Number of records stored
+ */
+int sensors_close_aggregate_window(void);
+
+/**
+ * Convert the timestamps of readings taken before time synchronization
+ *
+ * Sampling starts at boot, and readings stored before the time is known are
+ * stamped with the uptime. Call this once the time has been synchronized to
+ * turn them into UTC, so they can be published.
+ *
+ * @return Number of readings converted
  */
-int sensors_get_gyro_reading_count(void);
+int sensors_timestamps_synchronized(void);
 
 /**
  * Check if we are using I2C sensors
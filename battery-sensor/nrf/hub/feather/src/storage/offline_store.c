@@ -0,0 +1,457 @@
+/**
+ * @file offline_store.c
+ * @brief Flash-backed store-and-forward queue implementation
+ *
+ * Batches are appended to a flash circular buffer (FCB) on the elfryd_store
+ * partition. The FCB writes sequentially through its sectors and only erases
+ * a sector when it has to be reused, which spreads wear evenly over the whole
+ * partition.
+ *
+ * Every entry starts with a one byte tag. Data entries carry the caller's tag
+ * followed by the batch, while position markers (STORE_TAG_MARKER) record
+ * the last consumed entry so replay can resume after a reboot.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/fs/fcb.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+#include <pm_config.h>
+#include <errno.h>
+#include <string.h>
+
+#include "storage/offline_store.h"
+
+LOG_MODULE_REGISTER(offline_store, LOG_LEVEL_INF);
+#define LOG_PREFIX_STORE "[STORE] "
+
+/* FCB identification, bump the version if the entry layout changes */
+#define STORE_MAGIC 0x454C4659 /* "ELFY" */
+#define STORE_VERSION 1
+
+/* Tag reserved for replay position markers */
+#define STORE_TAG_MARKER 0xFF
+
+/* Marker layout: tag, sector offset, entry offset within the sector */
+#define STORE_MARKER_LEN (1 + 4 + 4)
+
+/* Logical FCB sectors, each one or more flash erase pages */
+#define STORE_SECTOR_SIZE CONFIG_ELFRYD_OFFLINE_STORE_SECTOR_SIZE
+#define STORE_SECTOR_COUNT (PM_ELFRYD_STORE_SIZE / STORE_SECTOR_SIZE)
+
+BUILD_ASSERT(STORE_SECTOR_COUNT >= 2 && STORE_SECTOR_COUNT <= UINT8_MAX,
+             "elfryd_store must hold between 2 and 255 sectors");
+BUILD_ASSERT(STORE_SECTOR_SIZE > OFFLINE_STORE_MAX_PAYLOAD + 16,
+             "Offline store sectors must fit a full batch");
+
+static struct fcb store_fcb;
+static struct flash_sector store_sectors[STORE_SECTOR_COUNT];
+
+/* Times each sector has been erased since boot, tells a batch sent from a
+ * sector apart from whatever was written there after it was erased
+ */
+static uint32_t sector_generation[STORE_SECTOR_COUNT];
+
+/* Staging buffer so every flash write covers whole write blocks */
+static uint8_t record_buffer[ROUND_UP(OFFLINE_STORE_MAX_PAYLOAD + 1, 8)];
+
+/* Last consumed and last sent entries (fe_sector is NULL if none), and the
+ * entry returned by the last peek. Entries between read_loc and send_loc
+ * have been sent but not yet acknowledged.
+ */
+static struct fcb_entry read_loc;
+static struct fcb_entry send_loc;
+static struct fcb_entry prev_send_loc;
+static struct fcb_entry peek_loc;
+static bool peek_valid;
+static bool position_dirty;
+static bool store_ready;
+
+/* Mutex protecting the store state */
+static K_MUTEX_DEFINE(store_mutex);
+
+/* Read the tag byte of an entry */
+static int read_tag(const struct fcb_entry *loc, uint8_t *tag)
+{
+    return flash_area_read(store_fcb.fap, FCB_ENTRY_FA_DATA_OFF((*loc)), tag, 1);
+}
+
+/* Advance loc to the next data entry, skipping position markers */
+static int next_data_entry(struct fcb_entry *loc)
+{
+    uint8_t tag;
+    int err;
+
+    while ((err = fcb_getnext(&store_fcb, loc)) == 0)
+    {
+        err = read_tag(loc, &tag);
+        if (err)
+        {
+            return err;
+        }
+
+        if (tag != STORE_TAG_MARKER)
+        {
+            return 0;
+        }
+    }
+
+    return -ENODATA;
+}
+
+/* Forget a location if it lies in a sector that is about to be erased */
+static void forget_in_sector(struct fcb_entry *loc, const struct flash_sector *sector)
+{
+    if (loc->fe_sector == sector)
+    {
+        memset(loc, 0, sizeof(*loc));
+    }
+}
+
+/* Erase the oldest sector along with every position pointing into it, so
+ * no stale entry offset outlives its sector. Must be called with
+ * store_mutex held.
+ */
+static int rotate_oldest(void)
+{
+    struct flash_sector *oldest = store_fcb.f_oldest;
+
+    forget_in_sector(&read_loc, oldest);
+    forget_in_sector(&send_loc, oldest);
+    forget_in_sector(&prev_send_loc, oldest);
+    if (peek_loc.fe_sector == oldest)
+    {
+        peek_valid = false;
+    }
+
+    sector_generation[oldest - store_sectors]++;
+
+    return fcb_rotate(&store_fcb);
+}
+
+/* Write one entry, erasing the oldest sector if the store is full */
+static int write_entry(const uint8_t *data, size_t len)
+{
+    struct fcb_entry loc;
+    int err;
+
+    err = fcb_append(&store_fcb, len, &loc);
+    if (err == -ENOSPC)
+    {
+        /* Full: drop the oldest sector, including unsent data if need be */
+        if (read_loc.fe_sector == NULL || read_loc.fe_sector == store_fcb.f_oldest)
+        {
+            LOG_WRN(LOG_PREFIX_STORE "Store full, discarding oldest unsent batches");
+        }
+
+        err = rotate_oldest();
+        if (err)
+        {
+            LOG_ERR(LOG_PREFIX_STORE "Failed to rotate store: %d", err);
+            return err;
+        }
+
+        err = fcb_append(&store_fcb, len, &loc);
+    }
+
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_STORE "Failed to allocate entry: %d", err);
+        return err;
+    }
+
+    /* FCB reserves whole write blocks, so writing the padded length is safe */
+    err = flash_area_write(store_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), data,
+                           ROUND_UP(len, store_fcb.f_align));
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_STORE "Failed to write entry: %d", err);
+        return err;
+    }
+
+    return fcb_append_finish(&store_fcb, &loc);
+}
+
+/* Find the last position marker and resume after the entry it points to */
+static void restore_position(void)
+{
+    struct fcb_entry loc = {0};
+    uint8_t marker[STORE_MARKER_LEN];
+    uint32_t sector_off = 0;
+    uint32_t elem_off = 0;
+    bool found = false;
+
+    while (fcb_getnext(&store_fcb, &loc) == 0)
+    {
+        if (loc.fe_data_len != STORE_MARKER_LEN ||
+            flash_area_read(store_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), marker, sizeof(marker)) ||
+            marker[0] != STORE_TAG_MARKER)
+        {
+            continue;
+        }
+
+        sector_off = sys_get_le32(&marker[1]);
+        elem_off = sys_get_le32(&marker[5]);
+        found = true;
+    }
+
+    if (!found)
+    {
+        return;
+    }
+
+    /* The marked entry is gone if its sector has been erased since */
+    memset(&loc, 0, sizeof(loc));
+    while (fcb_getnext(&store_fcb, &loc) == 0)
+    {
+        if (loc.fe_sector->fs_off == sector_off && loc.fe_elem_off == elem_off)
+        {
+            read_loc = loc;
+            LOG_INF(LOG_PREFIX_STORE "Resuming replay at sector offset 0x%x", sector_off);
+            return;
+        }
+    }
+}
+
+int offline_store_init(void)
+{
+    int err;
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+
+    for (int i = 0; i < STORE_SECTOR_COUNT; i++)
+    {
+        store_sectors[i].fs_off = i * STORE_SECTOR_SIZE;
+        store_sectors[i].fs_size = STORE_SECTOR_SIZE;
+    }
+
+    store_fcb.f_magic = STORE_MAGIC;
+    store_fcb.f_version = STORE_VERSION;
+    store_fcb.f_sector_cnt = STORE_SECTOR_COUNT;
+    store_fcb.f_scratch_cnt = 0;
+    store_fcb.f_sectors = store_sectors;
+
+    err = fcb_init(PM_ELFRYD_STORE_ID, &store_fcb);
+    if (err)
+    {
+        LOG_ERR(LOG_PREFIX_STORE "Failed to initialize flash circular buffer: %d", err);
+        k_mutex_unlock(&store_mutex);
+        return err;
+    }
+
+    memset(&read_loc, 0, sizeof(read_loc));
+    restore_position();
+    send_loc = read_loc;
+    store_ready = true;
+
+    LOG_INF(LOG_PREFIX_STORE "Offline store ready: %d sectors of %d bytes",
+            STORE_SECTOR_COUNT, STORE_SECTOR_SIZE);
+
+    k_mutex_unlock(&store_mutex);
+    return 0;
+}
+
+int offline_store_append(uint8_t tag, const uint8_t *payload, size_t len)
+{
+    int err;
+
+    if (tag == STORE_TAG_MARKER || len == 0 || len > OFFLINE_STORE_MAX_PAYLOAD)
+    {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+
+    if (!store_ready)
+    {
+        k_mutex_unlock(&store_mutex);
+        return -ENODEV;
+    }
+
+    /* Pad with the erased value so the padding needs no extra write cycle */
+    memset(record_buffer, store_fcb.f_erase_value, sizeof(record_buffer));
+    record_buffer[0] = tag;
+    memcpy(&record_buffer[1], payload, len);
+
+    err = write_entry(record_buffer, len + 1);
+    if (!err)
+    {
+        LOG_DBG(LOG_PREFIX_STORE "Stored batch with tag %d, %d bytes", tag, len);
+    }
+
+    k_mutex_unlock(&store_mutex);
+    return err;
+}
+
+int offline_store_peek(uint8_t *tag, uint8_t *buffer, size_t size, size_t *len)
+{
+    struct fcb_entry loc;
+    int err;
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+
+    if (!store_ready)
+    {
+        k_mutex_unlock(&store_mutex);
+        return -ENODEV;
+    }
+
+    loc = send_loc;
+    err = next_data_entry(&loc);
+    if (err)
+    {
+        k_mutex_unlock(&store_mutex);
+        return err;
+    }
+
+    if (loc.fe_data_len - 1 > size)
+    {
+        k_mutex_unlock(&store_mutex);
+        return -ENOMEM;
+    }
+
+    err = read_tag(&loc, tag);
+    if (!err)
+    {
+        err = flash_area_read(store_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc) + 1, buffer,
+                              loc.fe_data_len - 1);
+    }
+
+    if (!err)
+    {
+        *len = loc.fe_data_len - 1;
+        peek_loc = loc;
+        peek_valid = true;
+    }
+
+    k_mutex_unlock(&store_mutex);
+    return err;
+}
+
+void offline_store_mark_sent(offline_store_loc_t *loc)
+{
+    k_mutex_lock(&store_mutex, K_FOREVER);
+
+    memset(loc, 0, sizeof(*loc));
+
+    if (peek_valid)
+    {
+        prev_send_loc = send_loc;
+        send_loc = peek_loc;
+        peek_valid = false;
+
+        loc->entry = peek_loc;
+        loc->generation = sector_generation[peek_loc.fe_sector - store_sectors];
+    }
+
+    k_mutex_unlock(&store_mutex);
+}
+
+void offline_store_unmark_sent(void)
+{
+    k_mutex_lock(&store_mutex, K_FOREVER);
+    send_loc = prev_send_loc;
+    k_mutex_unlock(&store_mutex);
+}
+
+int offline_store_consume(const offline_store_loc_t *loc)
+{
+    const struct flash_sector *sector = loc->entry.fe_sector;
+    int rotated = 0;
+    int err = 0;
+
+    if (sector == NULL)
+    {
+        return 0;
+    }
+
+    /* A location outside the store would have every sector erased below */
+    if (sector < store_sectors || sector >= store_sectors + STORE_SECTOR_COUNT)
+    {
+        LOG_ERR(LOG_PREFIX_STORE "Batch location outside the store, not consuming");
+        return -EIO;
+    }
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+
+    /* Erased to make room while awaiting its ack, the position was moved on
+     * past it then, and the entry there now was never sent
+     */
+    if (!store_ready || sector_generation[sector - store_sectors] != loc->generation)
+    {
+        LOG_DBG(LOG_PREFIX_STORE "Acknowledged batch already erased");
+        k_mutex_unlock(&store_mutex);
+        return 0;
+    }
+
+    /* Acks come in send order, so everything up to this batch is done */
+    read_loc = loc->entry;
+    position_dirty = true;
+
+    /* Sectors before the consumed entry hold nothing unsent anymore. The
+     * read position is never more than a full turn ahead, so stop there
+     * rather than erase sectors that were never sent.
+     */
+    while (store_fcb.f_oldest != read_loc.fe_sector)
+    {
+        if (rotated++ >= store_fcb.f_sector_cnt)
+        {
+            LOG_ERR(LOG_PREFIX_STORE "Read position not reached after a full turn");
+            err = -EIO;
+            break;
+        }
+
+        if (rotate_oldest())
+        {
+            break;
+        }
+    }
+
+    k_mutex_unlock(&store_mutex);
+
+    return err;
+}
+
+int offline_store_save_position(void)
+{
+    uint8_t marker[ROUND_UP(STORE_MARKER_LEN, 8)];
+    int err;
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+
+    if (!store_ready || !position_dirty || read_loc.fe_sector == NULL)
+    {
+        k_mutex_unlock(&store_mutex);
+        return 0;
+    }
+
+    memset(marker, store_fcb.f_erase_value, sizeof(marker));
+    marker[0] = STORE_TAG_MARKER;
+    sys_put_le32(read_loc.fe_sector->fs_off, &marker[1]);
+    sys_put_le32(read_loc.fe_elem_off, &marker[5]);
+
+    err = write_entry(marker, STORE_MARKER_LEN);
+    if (!err)
+    {
+        position_dirty = false;
+    }
+
+    k_mutex_unlock(&store_mutex);
+    return err;
+}
+
+bool offline_store_has_pending(void)
+{
+    struct fcb_entry loc;
+    bool pending;
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+
+    loc = send_loc;
+    pending = store_ready && next_data_entry(&loc) == 0;
+
+    k_mutex_unlock(&store_mutex);
+    return pending;
+}
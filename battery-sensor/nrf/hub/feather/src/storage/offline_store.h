@@ -0,0 +1,122 @@
+/**
+ * @file offline_store.h
+ * @brief Flash-backed store-and-forward queue for unsent sensor batches
+ */
+
+#ifndef OFFLINE_STORE_H
+#define OFFLINE_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <zephyr/fs/fcb.h>
+
+/**
+ * Largest payload a single stored batch can hold
+ */
+#define OFFLINE_STORE_MAX_PAYLOAD CONFIG_MQTT_BUFFER_SIZE
+
+/**
+ * Location of a sent batch, handed back to offline_store_consume
+ *
+ * Sectors are reused once erased, so the erase count of the sector tells
+ * whether the entry is still the batch that was sent.
+ */
+typedef struct
+{
+    struct fcb_entry entry; /* fe_sector is NULL if there is no batch */
+    uint32_t generation;    /* Erase count of the sector when the batch was sent */
+} offline_store_loc_t;
+
+/**
+ * @brief Initialize the offline store
+ *
+ * Mounts the flash circular buffer on the elfryd_store partition and restores
+ * the replay position saved before the last reboot, so batches that were
+ * already sent are not replayed again.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int offline_store_init(void);
+
+/**
+ * @brief Append a serialized batch to the store
+ *
+ * If the store is full the oldest flash sector is erased to make room, so
+ * the newest data is always kept.
+ *
+ * @param tag Caller defined tag identifying the batch type (0-254)
+ * @param payload Serialized batch
+ * @param len Length of the batch in bytes, at most OFFLINE_STORE_MAX_PAYLOAD
+ * @return 0 on success, negative error code on failure
+ */
+int offline_store_append(uint8_t tag, const uint8_t *payload, size_t len);
+
+/**
+ * @brief Read the oldest batch that has not been sent yet
+ *
+ * Calling this again returns the same batch until offline_store_mark_sent
+ * is called.
+ *
+ * @param tag Set to the tag the batch was stored with
+ * @param buffer Buffer to read the batch into
+ * @param size Size of the buffer
+ * @param len Set to the length of the batch
+ * @return 0 on success, -ENODATA if the store is empty,
+ *         other negative error code on failure
+ */
+int offline_store_peek(uint8_t *tag, uint8_t *buffer, size_t size, size_t *len);
+
+/**
+ * @brief Mark the batch returned by the last peek as sent
+ *
+ * The next peek returns the batch after it. The batch stays in the store
+ * until it is consumed, so several batches can await acknowledgement.
+ *
+ * @param loc Set to the location of the batch, to pass to
+ *            offline_store_consume once it is acknowledged. Has no batch if
+ *            the peeked batch was erased in between.
+ */
+void offline_store_mark_sent(offline_store_loc_t *loc);
+
+/**
+ * @brief Undo the last offline_store_mark_sent
+ *
+ * For when publishing the batch failed after all, so the next peek returns
+ * it again.
+ */
+void offline_store_unmark_sent(void);
+
+/**
+ * @brief Remove a sent batch, and every batch before it, from the store
+ *
+ * Called once the broker has acknowledged the batch. Batches must be
+ * consumed in the order they were sent, and flash sectors are erased once
+ * every batch in them has been consumed. A batch whose sector was erased to
+ * make room since it was sent is ignored.
+ *
+ * @param loc Location of the batch from offline_store_mark_sent
+ * @return    0 on success or with nothing to consume, -EIO if the location
+ *            is not in the store, in which case nothing is erased
+ */
+int offline_store_consume(const offline_store_loc_t *loc);
+
+/**
+ * @brief Persist the replay position
+ *
+ * Writes a small marker so a reboot resumes replay after the last consumed
+ * batch. Meant to be called once per replay burst rather than per batch to
+ * keep flash writes down.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int offline_store_save_position(void);
+
+/**
+ * @brief Check whether there are batches waiting to be replayed
+ *
+ * @return true if there are unsent batches, false otherwise
+ */
+bool offline_store_has_pending(void);
+
+#endif /* OFFLINE_STORE_H */
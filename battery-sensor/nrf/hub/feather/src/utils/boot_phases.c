@@ -0,0 +1,146 @@
+/**
+ * @file boot_phases.c
+ * @brief Boot phase dependency graph and timing implementation
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "utils/boot_phases.h"
+
+LOG_MODULE_REGISTER(boot_phases, LOG_LEVEL_INF);
+#define LOG_PREFIX_BOOT "[BOOT] "
+
+BUILD_ASSERT(BOOT_PHASE_COUNT <= 32, "Boot phases must fit a 32 bit mask");
+
+#define ALL_PHASES (BIT(BOOT_PHASE_COUNT) - 1)
+
+#define PHASE_NAME(id, name, deps) [BOOT_PHASE_##id] = #name,
+static const char *const phase_names[BOOT_PHASE_COUNT] = {
+    BOOT_PHASES(PHASE_NAME)
+};
+#undef PHASE_NAME
+
+#define PHASE_DEPS(id, name, deps) [BOOT_PHASE_##id] = deps,
+static const uint32_t phase_deps[BOOT_PHASE_COUNT] = {
+    BOOT_PHASES(PHASE_DEPS)
+};
+#undef PHASE_DEPS
+
+/* Bits of the phases done, for waiters */
+static K_EVENT_DEFINE(boot_events);
+
+/* Uptime each phase was done at, -1 = not yet, under boot_mutex */
+static K_MUTEX_DEFINE(boot_mutex);
+static int64_t done_at[BOOT_PHASE_COUNT] = {
+    [0 ... BOOT_PHASE_COUNT - 1] = -1,
+};
+static uint32_t done_mask;
+static boot_phase_cb_t phase_handler;
+
+void boot_phase_done(boot_phase_t phase)
+{
+    boot_phase_cb_t handler = NULL;
+    int64_t now = k_uptime_get();
+    bool complete = false;
+    bool first;
+
+    if (phase >= BOOT_PHASE_COUNT)
+    {
+        return;
+    }
+
+    k_mutex_lock(&boot_mutex, K_FOREVER);
+    first = done_at[phase] < 0;
+    if (first)
+    {
+        done_at[phase] = now;
+        done_mask |= BIT(phase);
+        complete = done_mask == ALL_PHASES;
+        handler = phase_handler;
+    }
+    k_mutex_unlock(&boot_mutex);
+
+    if (!first)
+    {
+        return;
+    }
+
+    LOG_INF(LOG_PREFIX_BOOT "Phase %s done at %lld ms", phase_names[phase], now);
+    k_event_post(&boot_events, BIT(phase));
+
+    if (complete)
+    {
+        LOG_INF(LOG_PREFIX_BOOT "Boot complete after %lld ms", now);
+    }
+
+    if (handler)
+    {
+        handler(phase);
+    }
+}
+
+void boot_wait_for(uint32_t phases)
+{
+    if (phases)
+    {
+        k_event_wait_all(&boot_events, phases, false, K_FOREVER);
+    }
+}
+
+void boot_phase_wait(boot_phase_t phase)
+{
+    if (phase < BOOT_PHASE_COUNT)
+    {
+        boot_wait_for(phase_deps[phase]);
+    }
+}
+
+int64_t boot_phase_time(boot_phase_t phase)
+{
+    int64_t time;
+
+    if (phase >= BOOT_PHASE_COUNT)
+    {
+        return -1;
+    }
+
+    k_mutex_lock(&boot_mutex, K_FOREVER);
+    time = done_at[phase];
+    k_mutex_unlock(&boot_mutex);
+
+    return time;
+}
+
+const char *boot_phase_name(boot_phase_t phase)
+{
+    return phase < BOOT_PHASE_COUNT ? phase_names[phase] : "unknown";
+}
+
+void boot_set_phase_handler(boot_phase_cb_t handler)
+{
+    k_mutex_lock(&boot_mutex, K_FOREVER);
+    phase_handler = handler;
+    k_mutex_unlock(&boot_mutex);
+}
+
+int boot_timing_format(char *buf, size_t len)
+{
+    size_t offset = 0;
+
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++)
+    {
+        int written = snprintf(buf + offset, len - offset, "%s%s=%lld",
+                               i > 0 ? "," : "", phase_names[i], boot_phase_time(i));
+
+        if (written < 0 || written >= len - offset)
+        {
+            return -ENOMEM;
+        }
+        offset += written;
+    }
+
+    return offset;
+}
@@ -0,0 +1,114 @@
+/**
+ * @file boot_phases.h
+ * @brief Boot phase dependency graph and timing
+ */
+
+#ifndef BOOT_PHASES_H
+#define BOOT_PHASES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Dependency mask bit of a boot phase */
+#define BOOT_DEP(id) (1U << BOOT_PHASE_##id)
+
+/**
+ * Boot phases and what each of them needs
+ *
+ * X(id, name, deps) for every phase: the phase can only start once every
+ * phase in the deps mask is done, phases without a path between them run
+ * in parallel. A phase served from a cache, such as DNS with a stored
+ * broker address, may be done before its dependencies.
+ */
+#define BOOT_PHASES(X)                                                                 \
+    X(MODEM, modem, 0)                                                                 \
+    X(SENSORS, sensors, 0)                                                             \
+    X(STORE, store, 0)                                                                 \
+    X(ATTACH, attach, BOOT_DEP(MODEM))                                                 \
+    X(TIME, time, BOOT_DEP(MODEM))                                                     \
+    X(DNS, dns, BOOT_DEP(ATTACH))                                                      \
+    X(CONNECT, connect, BOOT_DEP(DNS))                                                 \
+    X(FIRST_PUBLISH, first_publish, BOOT_DEP(CONNECT))
+
+/**
+ * Boot phases, generated from BOOT_PHASES
+ */
+typedef enum
+{
+#define BOOT_PHASE_ID(id, name, deps) BOOT_PHASE_##id,
+    BOOT_PHASES(BOOT_PHASE_ID)
+#undef BOOT_PHASE_ID
+    BOOT_PHASE_COUNT
+} boot_phase_t;
+
+/**
+ * Callback for the completion of a boot phase
+ *
+ * Called once per phase from the context that completed it, so it must not
+ * block.
+ *
+ * @param phase Phase that is done
+ */
+typedef void (*boot_phase_cb_t)(boot_phase_t phase);
+
+/**
+ * Mark a boot phase as done
+ *
+ * Records the uptime on the first call, later calls are ignored, so this
+ * may be called on every pass through a code path.
+ *
+ * @param phase Phase that is done
+ */
+void boot_phase_done(boot_phase_t phase);
+
+/**
+ * Wait until the dependencies of a boot phase are done
+ *
+ * @param phase Phase about to start
+ */
+void boot_phase_wait(boot_phase_t phase);
+
+/**
+ * Wait until the given boot phases are done
+ *
+ * @param phases Mask of BOOT_DEP bits
+ */
+void boot_wait_for(uint32_t phases);
+
+/**
+ * Get when a boot phase was done
+ *
+ * @param phase Phase to look up
+ * @return      Milliseconds since boot, -1 if not done yet
+ */
+int64_t boot_phase_time(boot_phase_t phase);
+
+/**
+ * Get the name of a boot phase
+ *
+ * @param phase Phase to look up
+ * @return      Name of the phase, "unknown" if invalid
+ */
+const char *boot_phase_name(boot_phase_t phase);
+
+/**
+ * Set the handler called as each boot phase is done
+ *
+ * @param handler Handler to call, or NULL to disable
+ */
+void boot_set_phase_handler(boot_phase_cb_t handler);
+
+/**
+ * Format the boot timing record
+ *
+ * Format: "{name}={ms},{name}={ms},..." with the uptime each phase was done
+ * at, -1 for phases not done yet.
+ *
+ * @param buf Buffer to write to
+ * @param len Size of the buffer
+ * @return    Length written, or negative error code if it did not fit
+ */
+int boot_timing_format(char *buf, size_t len);
+
+#endif /* BOOT_PHASES_H */
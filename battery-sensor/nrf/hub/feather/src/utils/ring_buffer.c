@@ -0,0 +1,115 @@
+/**
+ * @file ring_buffer.c
+ * @brief Fixed-capacity ring buffer implementation
+ */
+
+#include <string.h>
+#include "utils/ring_buffer.h"
+
+/* Map a logical position (0 = oldest) to an index in the backing array */
+static inline uint32_t ring_index(const ring_buffer_t *rb, uint32_t position)
+{
+    uint32_t index = rb->tail + position;
+
+    /* Capacity need not be a power of two, and position < capacity always holds */
+    if (index >= rb->capacity)
+    {
+        index -= rb->capacity;
+    }
+
+    return index;
+}
+
+void ring_buffer_init(ring_buffer_t *rb, void *storage, size_t item_size, uint32_t capacity)
+{
+    rb->storage = storage;
+    rb->item_size = item_size;
+    rb->capacity = capacity;
+    rb->tail = 0;
+    rb->count = 0;
+    rb->first_seq = 0;
+}
+
+bool ring_buffer_put(ring_buffer_t *rb, const void *item)
+{
+    bool overwritten = false;
+
+    if (rb->capacity == 0)
+    {
+        return false;
+    }
+
+    if (rb->count == rb->capacity)
+    {
+        /* Full: the slot after the newest item is the oldest one, reuse it */
+        rb->tail = ring_index(rb, 1);
+        rb->count--;
+        rb->first_seq++;
+        overwritten = true;
+    }
+
+    memcpy(rb->storage + ring_index(rb, rb->count) * rb->item_size, item, rb->item_size);
+    rb->count++;
+
+    return overwritten;
+}
+
+void *ring_buffer_get(const ring_buffer_t *rb, uint32_t index)
+{
+    if (index >= rb->count)
+    {
+        return NULL;
+    }
+
+    return rb->storage + ring_index(rb, index) * rb->item_size;
+}
+
+void *ring_buffer_latest(const ring_buffer_t *rb)
+{
+    if (rb->count == 0)
+    {
+        return NULL;
+    }
+
+    return ring_buffer_get(rb, rb->count - 1);
+}
+
+uint32_t ring_buffer_count(const ring_buffer_t *rb)
+{
+    return rb->count;
+}
+
+uint32_t ring_buffer_first_seq(const ring_buffer_t *rb)
+{
+    return rb->first_seq;
+}
+
+uint32_t ring_buffer_drop(ring_buffer_t *rb, uint32_t count)
+{
+    if (count > rb->count)
+    {
+        count = rb->count;
+    }
+
+    if (count == rb->count)
+    {
+        /* Emptying the buffer, restart from the beginning of the storage */
+        rb->tail = 0;
+    }
+    else
+    {
+        rb->tail = ring_index(rb, count);
+    }
+
+    rb->count -= count;
+    rb->first_seq += count;
+
+    return count;
+}
+
+void ring_buffer_clear(ring_buffer_t *rb)
+{
+    rb->first_seq += rb->count;
+    rb->tail = 0;
+    rb->count = 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * @file ring_buffer.h
+ * @brief Fixed-capacity ring buffer for sensor readings
+ */
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Fixed-capacity ring buffer with overwrite-oldest semantics
+ *
+ * Items are copied in by value into caller-provided storage. All operations
+ * are O(1). The buffer does no locking of its own, so callers must serialize
+ * access to it.
+ *
+ * Every item is implicitly numbered with a sequence number that grows by one
+ * per stored item and wraps at 2^32. Sequence numbers stay stable while the
+ * buffer is modified, so they can be used to refer to items across calls.
+ */
+typedef struct
+{
+    uint8_t *storage;   /* Backing array of capacity * item_size bytes */
+    size_t item_size;   /* Size of one item in bytes */
+    uint32_t capacity;  /* Maximum number of items */
+    uint32_t tail;      /* Index of the oldest item in storage */
+    uint32_t count;     /* Number of items currently stored */
+    uint32_t first_seq; /* Sequence number of the oldest item */
+} ring_buffer_t;
+
+/**
+ * @brief Initialize a ring buffer over caller-provided storage
+ *
+ * @param rb Ring buffer to initialize
+ * @param storage Backing array, at least item_size * capacity bytes
+ * @param item_size Size of one item in bytes
+ * @param capacity Maximum number of items
+ */
+void ring_buffer_init(ring_buffer_t *rb, void *storage, size_t item_size, uint32_t capacity);
+
+/**
+ * @brief Append an item, overwriting the oldest one if the buffer is full
+ *
+ * @param rb Ring buffer
+ * @param item Item to copy into the buffer
+ * @return true if the oldest item was overwritten, false otherwise
+ */
+bool ring_buffer_put(ring_buffer_t *rb, const void *item);
+
+/**
+ * @brief Get a pointer to a stored item
+ *
+ * @param rb Ring buffer
+ * @param index Position counted from the oldest item (0 = oldest)
+ * @return Pointer to the item, or NULL if index is out of range
+ */
+void *ring_buffer_get(const ring_buffer_t *rb, uint32_t index);
+
+/**
+ * @brief Get a pointer to the most recently added item
+ *
+ * @param rb Ring buffer
+ * @return Pointer to the item, or NULL if the buffer is empty
+ */
+void *ring_buffer_latest(const ring_buffer_t *rb);
+
+/**
+ * @brief Get the number of stored items
+ *
+ * @param rb Ring buffer
+ * @return Number of items
+ */
+uint32_t ring_buffer_count(const ring_buffer_t *rb);
+
+/**
+ * @brief Get the sequence number of the oldest item
+ *
+ * The newest item has sequence number first_seq + count - 1.
+ *
+ * @param rb Ring buffer
+ * @return Sequence number of the oldest item (or of the next item if empty)
+ */
+uint32_t ring_buffer_first_seq(const ring_buffer_t *rb);
+
+/**
+ * @brief Remove the oldest items
+ *
+ * @param rb Ring buffer
+ * @param count Number of items to remove
+ * @return Number of items actually removed
+ */
+uint32_t ring_buffer_drop(ring_buffer_t *rb, uint32_t count);
+
+/**
+ * @brief Remove all items
+ *
+ * @param rb Ring buffer
+ */
+void ring_buffer_clear(ring_buffer_t *rb);
+
+#endif /* RING_BUFFER_H */
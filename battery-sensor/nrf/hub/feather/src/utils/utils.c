@@ -13,12 +13,25 @@
 /* Flag to track if RTC is synchronized */
 static bool rtc_synchronized = false;
 
-/* Mutex to protect the RTC sync flag */
+/* UTC in milliseconds minus uptime in milliseconds, valid once synchronized */
+static int64_t epoch_offset_ms;
+
+/* Mutex to protect the RTC sync flag and the epoch offset */
 static K_MUTEX_DEFINE(rtc_sync_mutex);
 
 void utils_notify_time_synchronized(void)
 {
+    int err;
+    int64_t now_ms;
+
+    err = date_time_now(&now_ms);
+    if (err)
+    {
+        return;
+    }
+
     k_mutex_lock(&rtc_sync_mutex, K_FOREVER);
+    epoch_offset_ms = now_ms - k_uptime_get();
     rtc_synchronized = true;
     k_mutex_unlock(&rtc_sync_mutex);
 }
@@ -36,24 +49,53 @@ bool utils_is_time_synchronized(void)
 
 int64_t utils_get_timestamp(void)
 {
-    int err;
     int64_t timestamp = 0;
 
-    /* Check if RTC is synchronized before using date_time API */
-    if (!utils_is_time_synchronized())
+    k_mutex_lock(&rtc_sync_mutex, K_FOREVER);
+    if (rtc_synchronized)
     {
-        return 0; /* Return 0 to indicate that time is not valid yet */
+        /* Uptime in milliseconds plus the epoch offset, converted to seconds */
+        timestamp = (k_uptime_get() + epoch_offset_ms) / 1000;
     }
+    k_mutex_unlock(&rtc_sync_mutex);
 
-    /* Get the current real timestamp from date_time API */
-    err = date_time_now(&timestamp);
-    if (err)
+    return timestamp;
+}
+
+int64_t utils_get_sample_timestamp(void)
+{
+    int64_t timestamp = k_uptime_get();
+
+    k_mutex_lock(&rtc_sync_mutex, K_FOREVER);
+    if (rtc_synchronized)
     {
-        return 0; /* Return 0 if unable to get the timestamp */
+        timestamp += epoch_offset_ms;
     }
+    k_mutex_unlock(&rtc_sync_mutex);
 
-    /* date_time_now returns timestamp in milliseconds, convert to seconds */
-    return timestamp / 1000;
+    return timestamp;
+}
+
+bool utils_timestamp_is_uptime(int64_t timestamp)
+{
+    return timestamp < UTILS_UTC_MIN_MS;
+}
+
+int64_t utils_timestamp_to_utc(int64_t timestamp)
+{
+    if (!utils_timestamp_is_uptime(timestamp))
+    {
+        return timestamp;
+    }
+
+    k_mutex_lock(&rtc_sync_mutex, K_FOREVER);
+    if (rtc_synchronized)
+    {
+        timestamp += epoch_offset_ms;
+    }
+    k_mutex_unlock(&rtc_sync_mutex);
+
+    return timestamp;
 }
 
 int utils_generate_random_id(char *buffer, size_t size)
@@ -69,6 +111,33 @@ int utils_generate_random_id(char *buffer, size_t size)
     return 0;
 }
 
+uint32_t utils_isqrt(uint64_t value)
+{
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while (bit > value)
+    {
+        bit >>= 2;
+    }
+
+    while (bit)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return (uint32_t)root;
+}
+
 /**
  * Format a 64-bit timestamp into a string without using %lld
  *
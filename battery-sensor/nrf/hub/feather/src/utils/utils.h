@@ -10,11 +10,21 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+/**
+ * Smallest sample timestamp treated as UTC, in milliseconds (2020-01-01)
+ *
+ * Readings taken before time is synchronized carry milliseconds since boot
+ * instead, which stay far below this.
+ */
+#define UTILS_UTC_MIN_MS 1577836800000LL
+
 /**
  * @brief Notify that time has been synchronized
  *
- * This must be called when the system has obtained valid time
- * from the network or other source before timestamp usage
+ * Anchors the UTC epoch to the kernel uptime, so later timestamps are the
+ * uptime plus a fixed offset instead of a date_time library call. Must be
+ * called whenever the system obtains valid time from the network or another
+ * source, so the offset follows corrections.
  */
 void utils_notify_time_synchronized(void);
 
@@ -32,6 +42,36 @@ bool utils_is_time_synchronized(void);
  */
 int64_t utils_get_timestamp(void);
 
+/**
+ * @brief Get the timestamp for a new sensor reading
+ *
+ * Sampling does not wait for time synchronization. Until the time is known
+ * the timestamp is the uptime, converted to UTC later with
+ * utils_timestamp_to_utc. Millisecond resolution keeps readings taken less
+ * than a second apart distinct.
+ *
+ * @return Milliseconds since epoch if time is synchronized, milliseconds
+ *         since boot otherwise
+ */
+int64_t utils_get_sample_timestamp(void);
+
+/**
+ * @brief Check whether a timestamp is still relative to boot
+ *
+ * @param timestamp Timestamp from utils_get_sample_timestamp
+ * @return true if the timestamp counts milliseconds since boot, false if it is UTC
+ */
+bool utils_timestamp_is_uptime(int64_t timestamp);
+
+/**
+ * @brief Convert a timestamp taken before time synchronization to UTC
+ *
+ * @param timestamp Timestamp from utils_get_sample_timestamp
+ * @return UTC timestamp, or the timestamp unchanged if it already is UTC or
+ *         time is not synchronized yet
+ */
+int64_t utils_timestamp_to_utc(int64_t timestamp);
+
 /**
  * @brief Generate a random ID string
  *
@@ -41,6 +81,14 @@ int64_t utils_get_timestamp(void);
  */
 int utils_generate_random_id(char *buffer, size_t size);
 
+/**
+ * @brief Integer square root
+ *
+ * @param value Value to take the square root of
+ * @return Square root of the value, rounded down
+ */
+uint32_t utils_isqrt(uint64_t value);
+
 /**
  * @brief Format a 64-bit timestamp into a string
  *